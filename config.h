@@ -10,16 +10,165 @@
 #define NSTACK_DATAGRAM_BUF_SIZE 16384
 
 /**
- * Periodic IP event tick.
- * How often should periodic tasks run.
- * This is handled by IP but it's meant to be more generic.
+ * Egress quantum of a socket [bytes].
+ * The sockets with datagrams queued are served in deficit round robin; Each
+ * round a socket may send this many bytes plus what it had left over from the
+ * previous round. Must be at least NSTACK_DATAGRAM_SIZE_MAX.
+ */
+#define NSTACK_EGRESS_QUANTUM NSTACK_DATAGRAM_SIZE_MAX
+
+/**
+ * Max time a thread blocks waiting for an event [sec].
+ * The threads check whether the stack is stopping at least this often.
  */
 #define NSTACK_PERIODIC_EVENT_SEC 10
 
 /**
- * Periodic TCP timer tick. (500 ms)
+ * Timer tick [us].
+ * The timing wheels are advanced, and the periodic tasks run, every tick.
+ */
+#define NSTACK_TIMER_TICK_USEC 10000
+
+/**
+ * Max number of frames an event loop worker receives in one round.
+ * The other events of the worker are served between the rounds.
+ */
+#define NSTACK_EVENT_LOOP_RX_BURST 64
+
+/**
+ * Number of packet buffers in the egress pool.
+ * A buffer is only held while a packet is built and handed to the driver,
+ * so this bounds the number of packets being sent at a time. Each sending
+ * thread also keeps up to NSTACK_MBUF_CACHE_NR free buffers of its own.
+ */
+#define NSTACK_MBUF_NR 64
+
+/**
+ * Max number of free buffers cached by a thread.
+ */
+#define NSTACK_MBUF_CACHE_NR 4
+
+/**
+ * Log Configuration.
+ * @{
+ */
+
+/**
+ * Least severe level of the log messages compiled in.
+ * LOG_ERR, LOG_WARN, LOG_INFO or LOG_DEBUG.
+ */
+#ifndef NSTACK_LOG_LEVEL
+#define NSTACK_LOG_LEVEL LOG_INFO
+#endif
+
+/**
+ * Number of records in the log ring of a thread.
+ * Messages are dropped while the ring is full.
+ */
+#define NSTACK_LOG_RING_NR 1024
+
+/**
+ * How often the log thread prints the messages in the log rings [us].
+ */
+#define NSTACK_LOG_FLUSH_USEC 10000
+
+/**
+ * @}
+ */
+
+/**
+ * Ether Configuration.
+ * @{
+ */
+
+/**
+ * Max number of network interfaces.
+ */
+#define NSTACK_ETHER_MAX_IF 4
+
+/**
+ * Default number of RX queues and ingress threads per interface.
+ * If there are more than one queue, frames are distributed between the
+ * queues by a flow hash with PACKET_FANOUT_HASH.
+ */
+#define NSTACK_ETHER_QUEUES 1
+
+/**
+ * Default number of blocks in the PACKET_RX_RING.
+ * 0 = The ring is not used unless the rx_blocks option is given to
+ *     ether_init() and frames are read with recvfrom().
+ */
+#define NSTACK_ETHER_RX_BLOCK_NR 0
+
+/**
+ * Default size of a PACKET_RX_RING block in bytes.
+ * Must be a multiple of the page size.
+ */
+#define NSTACK_ETHER_RX_BLOCK_SIZE (1 << 18)
+
+/**
+ * Default PACKET_RX_RING block retire timeout [ms].
+ * A partially filled block is handed to the ingress thread after this time.
+ */
+#define NSTACK_ETHER_RX_BLOCK_TMO 10
+
+/**
+ * Default number of frames in the PACKET_TX_RING.
+ * 0 = Frames are batched and sent with sendmmsg() instead.
+ */
+#define NSTACK_ETHER_TX_RING_FRAMES 0
+
+/**
+ * Max number of frames in a sendmmsg() batch.
+ */
+#define NSTACK_ETHER_TX_BATCH 32
+
+/**
+ * Max number of frames received and passed up the stack as one burst.
+ */
+#define NSTACK_ETHER_RX_BURST 32
+
+/**
+ * Default busy-poll budget of the ingress threads [us].
+ * An idle ingress thread spins on its socket or RX ring for this long before
+ * it blocks in the kernel; the budget starts over with each frame.
+ * 0 = The thread blocks right away.
+ */
+#define NSTACK_ETHER_BUSY_POLL_USEC 0
+
+/**
+ * Default number of UMEM frames of the AF_XDP driver.
+ * Half of the frames are used for RX and half for TX. Must be a power of two.
+ */
+#define NSTACK_ETHER_XDP_FRAME_NR 4096
+
+/**
+ * Number of frame slots in each direction of a loopback link.
+ */
+#define NSTACK_ETHER_LOOP_FRAME_NR 512
+
+/**
+ * @}
+ */
+
+/**
+ * RSS Configuration.
+ * @{
+ */
+
+/**
+ * Max number of flow workers of the software RSS.
+ */
+#define NSTACK_RSS_WORKERS_MAX 16
+
+/**
+ * Number of frame slots in a ring between a dispatcher and a flow worker.
+ */
+#define NSTACK_RSS_RING_NR 256
+
+/**
+ * @}
  */
-#define NSTACK_TCP_TIMER_USEC 500000
 
 /**
  * ARP Configuration.
@@ -46,8 +195,9 @@
 
 /**
  * RIB (Routing Information Base) size in the number of entries.
+ * Each interface takes an entry for its address and one for its network.
  */
-#define NSTACK_IP_RIB_SIZE 5
+#define NSTACK_IP_RIB_SIZE (2 * NSTACK_ETHER_MAX_IF + 2)
 
 /**
  * Max number of deferred IP packets.
@@ -56,6 +206,12 @@
  */
 #define NSTACK_IP_DEFER_MAX 20
 
+/**
+ * Retry interval of the deferred IP packets [ms].
+ * The packets are also retried whenever an ARP message is received.
+ */
+#define NSTACK_IP_DEFER_RETRY_MSEC 1000
+
 /**
  * Unreachable destination IP.
  * + 0 = Drop silently
@@ -74,6 +230,23 @@
  */
 #define NSTACK_IP_FRAGMENT_TLB 15
 
+/**
+ * @}
+ */
+
+/**
+ * UDP Configuration.
+ * @{
+ */
+
+/**
+ * Verify the checksum of received datagrams.
+ * The payload is summed while it's copied to the socket. Datagrams sent by
+ * the local host over a veth pair arrive with the checksum only partially
+ * computed, so the verification is off by default.
+ */
+#define NSTACK_UDP_VERIFY_CSUM 0
+
 /**
  * @}
  */
@@ -0,0 +1,127 @@
+/**
+ * @brief   Shared memory doorbells
+ */
+
+/**
+ * @addtogroup doorbell
+ * A doorbell wakes up the consumer of a queue shared between processes.
+ * The consumer raises the sleeping flag and checks the queue once more before
+ * it waits on the futex word; The producer checks the flag after committing
+ * to the queue and only issues a wakeup if the consumer is sleeping, so
+ * neither side makes a syscall while the consumer keeps up with the queue.
+ * @{
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct nstack_doorbell {
+    uint32_t seq;      /*!< Futex word, bumped to wake up the consumer. */
+    uint32_t sleeping; /*!< The consumer is about to sleep on seq. */
+};
+
+/**
+ * Wake up the consumer whether it's sleeping or not.
+ */
+static inline void doorbell_kick(struct nstack_doorbell *db)
+{
+    __atomic_fetch_add(&db->seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &db->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Wake up the consumer if it's sleeping.
+ * Called by the producer after committing to the queue.
+ */
+static inline void doorbell_ring(struct nstack_doorbell *db)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&db->sleeping, __ATOMIC_RELAXED))
+        doorbell_kick(db);
+}
+
+/**
+ * Raise the sleeping flag.
+ * The consumer must check the queue after this and before waiting.
+ * @returns Returns the value to wait on.
+ */
+static inline uint32_t doorbell_prepare(struct nstack_doorbell *db)
+{
+    const uint32_t seq = __atomic_load_n(&db->seq, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&db->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return seq;
+}
+
+/**
+ * Clear the sleeping flag.
+ */
+static inline void doorbell_done(struct nstack_doorbell *db)
+{
+    __atomic_store_n(&db->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait until the doorbell rings or the timeout expires.
+ * @param[in] seq is the value returned by doorbell_prepare().
+ * @param[in] timeout is a relative timeout, NULL waits forever.
+ */
+static inline void doorbell_wait(struct nstack_doorbell *db,
+                                 uint32_t seq,
+                                 const struct timespec *timeout)
+{
+    syscall(SYS_futex, &db->seq, FUTEX_WAIT, seq, timeout, NULL, 0);
+}
+
+/**
+ * Wait until any of the doorbells rings or the timeout expires.
+ * The doorbells may be in different shared memory mappings.
+ * @param[in] seq is an array of the values to wait on.
+ * @param[in] nr is the number of doorbells, at most FUTEX_WAITV_MAX.
+ * @param[in] timeout is a relative timeout.
+ */
+static inline void doorbell_wait_any(struct nstack_doorbell *const db[],
+                                     const uint32_t seq[],
+                                     unsigned nr,
+                                     const struct timespec *timeout)
+{
+    struct futex_waitv waiters[nr];
+    struct timespec abstime;
+
+    for (unsigned i = 0; i < nr; i++) {
+        waiters[i] = (struct futex_waitv){
+            .val = seq[i],
+            .uaddr = (uintptr_t) &db[i]->seq,
+            .flags = FUTEX_32, /* Shared between processes. */
+        };
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &abstime);
+    abstime.tv_sec += timeout->tv_sec;
+    abstime.tv_nsec += timeout->tv_nsec;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    if (syscall(SYS_futex_waitv, waiters, nr, 0, &abstime, CLOCK_MONOTONIC) ==
+            -1 &&
+        errno == ENOSYS) {
+        /* Before Linux 5.16 the doorbells are polled. */
+        const struct timespec tick = {.tv_nsec = 1000000};
+
+        nanosleep(&tick, NULL);
+    }
+}
+
+/**
+ * @}
+ */
@@ -22,3 +22,20 @@ static inline void ip2str(in_addr_t ip, char *buf)
     bytes[3] = (ip >> 24) & 0xFF;
     sprintf(buf, "%d.%d.%d.%d", bytes[3], bytes[2], bytes[1], bytes[0]);
 }
+
+/**
+ * Convert an IP address from a C string to integer representation.
+ * @param[in] str is the IP address in dotted decimal form.
+ * @param[out] ip is the destination.
+ * @returns Returns 0 on success; Otherwise -1.
+ */
+static inline int str2ip(const char *str, in_addr_t *ip)
+{
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, str, &addr) != 1)
+        return -1;
+
+    *ip = ntohl(addr.s_addr);
+    return 0;
+}
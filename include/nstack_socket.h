@@ -10,6 +10,7 @@
 #include <sys/types.h>
 
 #include "linker_set.h"
+#include "nstack_doorbell.h"
 #include "nstack_in.h"
 #include "queue_r.h"
 
@@ -80,6 +81,8 @@ struct nstack_sockaddr {
 struct nstack_sock_ctrl {
     pid_t pid_inetd;
     pid_t pid_end;
+    struct nstack_doorbell ingress_db; /*!< Rung by the stack. */
+    struct nstack_doorbell egress_db;  /*!< Rung by the socket end. */
 };
 
 struct nstack_sock_info {
@@ -93,6 +93,26 @@ static inline bool queue_peek(queue_cb_t *cb, int *index)
     return true;
 }
 
+/**
+ * Peek the nth element from the read end of the queue.
+ * @param cb is a pointer to the queue control block.
+ * @param n is the position of the element, 0 is the oldest element.
+ * @param index is the location where element is located in the buffer.
+ * @return false if the queue has n or less elements; otherwise operation was
+ *         succeed.
+ */
+static inline bool queue_peek_nth(queue_cb_t *cb, size_t n, int *index)
+{
+    const size_t read = cb->m_read;
+    const size_t used = (cb->m_write + cb->a_len - read) % cb->a_len;
+
+    if (n >= used)
+        return false;
+
+    *index = ((read + n) % cb->a_len) * cb->b_size;
+    return true;
+}
+
 /**
  * Discard n number of elements in the queue from the read end.
  * @param cb is a pointer to the queue control block.
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "nstack_util.h"
@@ -9,14 +10,16 @@
 #include "nstack_ether.h"
 #include "nstack_internal.h"
 #include "nstack_ip.h"
+#include "nstack_timer.h"
 #include "tree.h"
 
-#define ARP_CACHE_AGE_MAX (20 * 60 * 60) /* Expiration time */
+#define ARP_CACHE_AGE_MAX (20 * 60 * 60) /* Expiration time [sec] */
 
 struct arp_cache_entry {
     in_addr_t ip_addr;
     mac_addr_t haddr;
-    int age;
+    enum arp_cache_entry_type type;
+    struct nstack_timer expire; /*!< Expiration of a dynamic entry. */
     RB_ENTRY(arp_cache_entry) _entry;
 };
 
@@ -24,6 +27,9 @@ RB_HEAD(arp_cache_tree, arp_cache_entry);
 
 static struct arp_cache_entry arp_cache[NSTACK_ARP_CACHE_SIZE];
 static struct arp_cache_tree arp_cache_head = RB_INITIALIZER();
+static struct nstack_timer_wheel arp_cache_timers;
+/* Protects the cache and its timers. */
+static pthread_mutex_t arp_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int arp_cache_cmp(struct arp_cache_entry *a, struct arp_cache_entry *b)
 {
@@ -32,6 +38,23 @@ static int arp_cache_cmp(struct arp_cache_entry *a, struct arp_cache_entry *b)
 
 RB_GENERATE_STATIC(arp_cache_tree, arp_cache_entry, _entry, arp_cache_cmp);
 
+static void arp_cache_expire(struct nstack_timer *timer, void *arg)
+{
+    struct arp_cache_entry *entry = arg;
+
+    RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
+    entry->type = ARP_CACHE_FREE;
+}
+
+__constructor static void arp_cache_init(void)
+{
+    for (size_t i = 0; i < num_elem(arp_cache); i++) {
+        arp_cache[i].type = ARP_CACHE_FREE;
+        nstack_timer_init(&arp_cache[i].expire, arp_cache_expire,
+                          &arp_cache[i]);
+    }
+}
+
 static int arp_request(int ether_handle, in_addr_t spa, in_addr_t tpa);
 static struct arp_cache_entry *arp_cache_get_entry(in_addr_t ip_addr);
 
@@ -61,42 +84,61 @@ static void arp_ntoh(const struct arp_ip *net, struct arp_ip *host)
     host->arp_tpa = ntohl(net->arp_tpa);
 }
 
+/**
+ * Set the type of an entry and restart the expiration of a dynamic entry.
+ */
+static void arp_cache_set_type(struct arp_cache_entry *entry,
+                               enum arp_cache_entry_type type)
+{
+    entry->type = type;
+    if (type == ARP_CACHE_DYN)
+        nstack_timer_arm(&arp_cache_timers, &entry->expire,
+                         NSTACK_TIMER_SEC(ARP_CACHE_AGE_MAX));
+    else
+        nstack_timer_cancel(&arp_cache_timers, &entry->expire);
+}
+
 int arp_cache_insert(in_addr_t ip_addr,
                      const mac_addr_t haddr,
                      enum arp_cache_entry_type type)
 {
-    struct arp_cache_entry *it;
     struct arp_cache_entry *entry = NULL;
 
     if (ip_addr == 0)
         return 0;
 
-    if ((entry = arp_cache_get_entry(ip_addr)) > 0) {
-        entry->age = (int) type;
+    pthread_mutex_lock(&arp_cache_lock);
+    if ((entry = arp_cache_get_entry(ip_addr))) {
+        arp_cache_set_type(entry, type);
+        pthread_mutex_unlock(&arp_cache_lock);
         return 0;
     }
 
-    it = arp_cache;
+    /* Take a free entry or the dynamic entry closest to its expiration. */
     for (size_t i = 0; i < num_elem(arp_cache); i++) {
-        if (it->age == ARP_CACHE_FREE) {
+        struct arp_cache_entry *it = &arp_cache[i];
+
+        if (it->type == ARP_CACHE_FREE) {
             entry = it;
-        } else if ((entry && entry->age > it->age) ||
-                   (!entry && it->age >= 0)) {
+            break;
+        } else if (it->type == ARP_CACHE_DYN &&
+                   (!entry || it->expire.expires < entry->expire.expires)) {
             entry = it;
         }
-        it++;
     }
     if (!entry) {
+        pthread_mutex_unlock(&arp_cache_lock);
         errno = ENOMEM;
         return -1;
     }
-    if (entry->age >= 0)
+    if (entry->type != ARP_CACHE_FREE)
         RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
 
     entry->ip_addr = ip_addr;
     memcpy(entry->haddr, haddr, sizeof(mac_addr_t));
-    entry->age = (int) type;
+    arp_cache_set_type(entry, type);
     RB_INSERT(arp_cache_tree, &arp_cache_head, entry);
+    pthread_mutex_unlock(&arp_cache_lock);
 
     return 0;
 }
@@ -112,22 +154,30 @@ static struct arp_cache_entry *arp_cache_get_entry(in_addr_t ip_addr)
 
 void arp_cache_remove(in_addr_t ip_addr)
 {
-    struct arp_cache_entry *entry = arp_cache_get_entry(ip_addr);
+    struct arp_cache_entry *entry;
 
-    RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
-    if (entry)
-        entry->age = ARP_CACHE_FREE;
+    pthread_mutex_lock(&arp_cache_lock);
+    entry = arp_cache_get_entry(ip_addr);
+    if (entry) {
+        RB_REMOVE(arp_cache_tree, &arp_cache_head, entry);
+        arp_cache_set_type(entry, ARP_CACHE_FREE);
+    }
+    pthread_mutex_unlock(&arp_cache_lock);
 }
 
 int arp_cache_get_haddr(in_addr_t iface, in_addr_t ip_addr, mac_addr_t haddr)
 {
-    struct arp_cache_entry *entry = arp_cache_get_entry(ip_addr);
+    struct arp_cache_entry *entry;
     struct ip_route route;
 
-    if (entry && entry->age >= 0) {
+    pthread_mutex_lock(&arp_cache_lock);
+    entry = arp_cache_get_entry(ip_addr);
+    if (entry) {
         memcpy(haddr, entry->haddr, sizeof(mac_addr_t));
+        pthread_mutex_unlock(&arp_cache_lock);
         return 0;
     }
+    pthread_mutex_unlock(&arp_cache_lock);
 
     if (!ip_route_find_by_iface(iface, &route) &&
         !arp_request(route.r_iface_handle, route.r_iface, ip_addr)) {
@@ -137,17 +187,11 @@ int arp_cache_get_haddr(in_addr_t iface, in_addr_t ip_addr, mac_addr_t haddr)
     return -1;
 }
 
-static void arp_cache_update(int delta_time)
+static void arp_cache_update(uint64_t now)
 {
-    for (size_t i = 0; i < num_elem(arp_cache); i++) {
-        struct arp_cache_entry *entry = &arp_cache[i];
-
-        if (entry->age > ARP_CACHE_AGE_MAX) {
-            entry->age = ARP_CACHE_FREE;
-        } else if (entry->age >= 0) {
-            entry->age += delta_time;
-        }
-    }
+    pthread_mutex_lock(&arp_cache_lock);
+    nstack_timer_run(&arp_cache_timers, now);
+    pthread_mutex_unlock(&arp_cache_lock);
 }
 NSTACK_PERIODIC_TASK(arp_cache_update);
 
@@ -171,13 +215,15 @@ static int arp_input(const struct ether_hdr *hdr __unused,
         arp_cache_insert(arp.arp_spa, arp.arp_sha, ARP_CACHE_DYN);
 
         /* Check for deferred IP packet transmissions */
-        ip_defer_handler(0);
+        ip_defer_handler();
 
         /* Process the opcode */
         switch (arp.arp_oper) {
         case ARP_OPER_REQUEST:
-            ip2str(arp.arp_tpa, str_ip);
-            LOG(LOG_DEBUG, "ARP request: %s", str_ip);
+            if (LOG_ENABLED(LOG_DEBUG)) {
+                ip2str(arp.arp_tpa, str_ip);
+                LOG(LOG_DEBUG, "ARP request: %s", str_ip);
+            }
 
             if (!ip_route_find_by_iface(arp.arp_tpa, &route)) {
                 arp_net->arp_oper = htons(ARP_OPER_REPLY);
@@ -229,7 +275,7 @@ static int arp_request(int ether_handle, in_addr_t spa, in_addr_t tpa)
 
     arp_hton(&msg, &msg);
     retval = ether_send(ether_handle, mac_broadcast_addr, ETHER_PROTO_ARP,
-                        (uint8_t *) (&msg), sizeof(msg));
+                        (uint8_t *) (&msg), sizeof(msg), NULL);
 
     return (retval < 0) ? retval : 0;
 }
@@ -256,7 +302,7 @@ int arp_gratuitous(int ether_handle, in_addr_t spa)
 
     arp_hton(&msg, &msg);
     retval = ether_send(ether_handle, mac_broadcast_addr, ETHER_PROTO_ARP,
-                        (uint8_t *) (&msg), sizeof(msg));
+                        (uint8_t *) (&msg), sizeof(msg), NULL);
     if (retval < 0) {
         char errmsg[40];
 
@@ -1,24 +1,67 @@
+#include <assert.h>
 #include <errno.h>
+#include <string.h>
+
+#include "nstack_util.h"
 
 #include "logger.h"
 #include "nstack_ether.h"
+#include "nstack_ip.h"
 
 SET_DECLARE(_ether_proto_handlers, struct _ether_proto_handler);
 
+/*
+ * EtherType dispatch table.
+ * An open addressed hash table built from _ether_proto_handlers at startup;
+ * A lookup normally takes a single probe.
+ */
+#define ETHER_PROTO_TABLE_SIZE 16 /* Must be a power of two. */
+static struct _ether_proto_handler *ether_proto_table[ETHER_PROTO_TABLE_SIZE];
+
 const mac_addr_t mac_broadcast_addr = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
-int ether_input(const struct ether_hdr *hdr, uint8_t *payload, size_t bsize)
+/*
+ * TX batch state of the calling thread.
+ */
+static __thread unsigned ether_tx_depth;
+static __thread uint32_t ether_tx_pending; /* A bitmap of handles. */
+
+static inline unsigned ether_proto_hash(uint16_t proto_id)
+{
+    return (proto_id ^ (proto_id >> 8)) & (ETHER_PROTO_TABLE_SIZE - 1);
+}
+
+__constructor static void ether_proto_table_init(void)
 {
     struct _ether_proto_handler **tmpp;
-    struct _ether_proto_handler *proto;
-    int retval;
+
+    /* A free slot terminates the lookups. */
+    assert(SET_COUNT(_ether_proto_handlers) < ETHER_PROTO_TABLE_SIZE);
 
     SET_FOREACH (tmpp, _ether_proto_handlers) {
-        proto = *tmpp;
-        if (proto->proto_id == hdr->h_proto)
-            break;
-        proto = NULL;
+        unsigned i = ether_proto_hash((*tmpp)->proto_id);
+
+        while (ether_proto_table[i])
+            i = (i + 1) & (ETHER_PROTO_TABLE_SIZE - 1);
+        ether_proto_table[i] = *tmpp;
     }
+}
+
+static struct _ether_proto_handler *ether_proto_lookup(uint16_t proto_id)
+{
+    unsigned i = ether_proto_hash(proto_id);
+    struct _ether_proto_handler *proto;
+
+    while ((proto = ether_proto_table[i]) && proto->proto_id != proto_id)
+        i = (i + 1) & (ETHER_PROTO_TABLE_SIZE - 1);
+
+    return proto;
+}
+
+int ether_input(const struct ether_hdr *hdr, uint8_t *payload, size_t bsize)
+{
+    struct _ether_proto_handler *proto = ether_proto_lookup(hdr->h_proto);
+    int retval;
 
     LOG(LOG_DEBUG, "proto id: 0x%x", (unsigned) hdr->h_proto);
 
@@ -36,6 +79,37 @@ int ether_input(const struct ether_hdr *hdr, uint8_t *payload, size_t bsize)
     return retval;
 }
 
+void ether_input_burst(struct ether_pkt *pkts[], unsigned n)
+{
+    unsigned run;
+
+    /* Runs of one EtherType go to the handler together. */
+    for (unsigned i = 0; i < n; i += run) {
+        const uint16_t proto_id = pkts[i]->hdr->h_proto;
+        struct _ether_proto_handler *proto = ether_proto_lookup(proto_id);
+
+        for (run = 1; i + run < n && pkts[i + run]->hdr->h_proto == proto_id;
+             run++)
+            ;
+
+        LOG(LOG_DEBUG, "proto id: 0x%x, %u frames", (unsigned) proto_id, run);
+
+        if (proto && proto->burst_fn) {
+            proto->burst_fn(pkts + i, run);
+            continue;
+        }
+
+        for (unsigned j = i; j < i + run; j++) {
+            struct ether_pkt *pkt = pkts[j];
+
+            if (j + 1 < i + run)
+                __builtin_prefetch(pkts[j + 1]->payload);
+            pkt->retval = proto ? proto->fn(pkt->hdr, pkt->payload, pkt->bsize)
+                                : -EPROTONOSUPPORT;
+        }
+    }
+}
+
 int ether_output_reply(int ether_handle,
                        const struct ether_hdr *hdr,
                        uint8_t *payload,
@@ -43,7 +117,8 @@ int ether_output_reply(int ether_handle,
 {
     int retval;
 
-    retval = ether_send(ether_handle, hdr->h_src, hdr->h_proto, payload, bsize);
+    retval = ether_send(ether_handle, hdr->h_src, hdr->h_proto, payload, bsize,
+                        NULL);
     if (retval < 0) {
         errno = -retval;
         retval = -1;
@@ -51,3 +126,112 @@ int ether_output_reply(int ether_handle,
 
     return retval;
 }
+
+int ether_send(int handle,
+               const mac_addr_t dst,
+               uint16_t proto,
+               uint8_t *buf,
+               size_t bsize,
+               const struct ether_offload *off)
+{
+    const struct iovec iov = {.iov_base = buf, .iov_len = bsize};
+
+    assert(buf != NULL);
+
+    return ether_sendv(handle, dst, proto, &iov, 1, off);
+}
+
+void ether_offload_csum(uint8_t *payload,
+                        size_t bsize,
+                        const struct ether_offload *off)
+{
+    uint16_t csum;
+
+    /* The pseudo-header sum in the checksum field is summed as well. */
+    csum = ip_checksum(payload + off->csum_start, bsize - off->csum_start);
+    memcpy(payload + off->csum_start + off->csum_offset, &csum, sizeof(csum));
+}
+
+const char *ether_arg(char *const args[], const char *name)
+{
+    const size_t len = strlen(name);
+
+    if (!args[0])
+        return NULL;
+
+    for (size_t i = 1; args[i]; i++) {
+        if (!strncmp(args[i], name, len) && args[i][len] == '=')
+            return args[i] + len + 1;
+    }
+
+    return NULL;
+}
+
+void ether_tx_begin(void)
+{
+    ether_tx_depth++;
+}
+
+int ether_tx_end(void)
+{
+    int retval = 0;
+
+    if (ether_tx_depth == 0 || --ether_tx_depth > 0)
+        return 0;
+
+    while (ether_tx_pending) {
+        const int handle = __builtin_ctz(ether_tx_pending);
+        int err;
+
+        ether_tx_pending &= ether_tx_pending - 1;
+        err = ether_flush(handle);
+        if (err < 0)
+            retval = err;
+    }
+
+    return retval;
+}
+
+int ether_tx_defer(int handle)
+{
+    if (ether_tx_depth == 0 || handle < 0 || handle >= 32)
+        return 0;
+
+    ether_tx_pending |= 1u << handle;
+    return 1;
+}
+
+void ether_offload_csumv(const struct iovec *iov,
+                         unsigned iovcnt,
+                         const struct ether_offload *off)
+{
+    size_t skip = off->csum_start;
+    uint32_t sum = 0;
+    int odd = 0;
+    uint16_t csum;
+
+    for (unsigned i = 0; i < iovcnt; i++) {
+        const uint8_t *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        uint32_t part;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        p += skip;
+        len -= skip;
+        skip = 0;
+
+        /* A segment at an odd offset has its words split across bytes. */
+        part = ip_csum_partial(p, len, 0);
+        if (odd)
+            part = ((part & 0xff) << 8) | (part >> 8);
+        sum = ip_csum_add(sum, part);
+        odd ^= len & 1;
+    }
+
+    csum = ip_csum_fold(sum);
+    memcpy((uint8_t *) iov[0].iov_base + off->csum_start + off->csum_offset,
+           &csum, sizeof(csum));
+}
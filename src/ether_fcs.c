@@ -1,19 +1,224 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-uint32_t ether_fcs(const void *data, size_t bsize)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ETHER_FCS_CLMUL
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define ETHER_FCS_ARMV8
+#endif
+
+#include "nstack_util.h"
+
+#include "nstack_ether.h"
+
+#define ETHER_FCS_POLY 0xEDB88320 /* Reversed 0x04C11DB7 */
+
+/*
+ * Slicing-by-8 tables.
+ * fcs_table[0] is the usual byte table and fcs_table[k][i] is the CRC of
+ * byte i followed by k zero bytes.
+ */
+static uint32_t fcs_table[8][256];
+
+/**
+ * CRC over bsize bytes.
+ * The crc argument and the return value are not inverted.
+ */
+typedef uint32_t ether_fcs_fn_t(uint32_t crc, const uint8_t *dp, size_t bsize);
+
+static uint32_t ether_fcs_slice8(uint32_t crc, const uint8_t *dp, size_t bsize)
 {
-    const uint8_t *dp = (uint8_t *) data;
-    const uint32_t crc_table[] = {
-        0x4DBDF21C, 0x500AE278, 0x76D3D2D4, 0x6B64C2B0, 0x3B61B38C, 0x26D6A3E8,
-        0x000F9344, 0x1DB88320, 0xA005713C, 0xBDB26158, 0x9B6B51F4, 0x86DC4190,
-        0xD6D930AC, 0xCB6E20C8, 0xEDB71064, 0xF0000000};
-    uint32_t crc = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (bsize >= 8) {
+        uint32_t lo, hi;
 
-    for (size_t i = 0; i < bsize; i++) {
-        crc = (crc >> 4) ^ crc_table[(crc ^ (dp[i] >> 0)) & 0x0F];
-        crc = (crc >> 4) ^ crc_table[(crc ^ (dp[i] >> 4)) & 0x0F];
+        memcpy(&lo, dp, sizeof(lo));
+        memcpy(&hi, dp + 4, sizeof(hi));
+        lo ^= crc;
+        crc = fcs_table[7][lo & 0xff] ^ fcs_table[6][(lo >> 8) & 0xff] ^
+              fcs_table[5][(lo >> 16) & 0xff] ^ fcs_table[4][lo >> 24] ^
+              fcs_table[3][hi & 0xff] ^ fcs_table[2][(hi >> 8) & 0xff] ^
+              fcs_table[1][(hi >> 16) & 0xff] ^ fcs_table[0][hi >> 24];
+        dp += 8;
+        bsize -= 8;
     }
+#endif
+    while (bsize--)
+        crc = (crc >> 8) ^ fcs_table[0][(crc ^ *dp++) & 0xff];
 
     return crc;
 }
+
+#ifdef ETHER_FCS_CLMUL
+/**
+ * Fold 16 byte blocks with carry-less multiplication and finish with a
+ * Barrett reduction, as described in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction".
+ * bsize must be a multiple of 16 and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+ether_fcs_clmul_fold(uint32_t crc, const uint8_t *dp, size_t bsize)
+{
+    /* Constants for the bit-reflected polynomial. */
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (dp + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (dp + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (dp + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (dp + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+    dp += 64;
+    bsize -= 64;
+
+    /* Fold four blocks in parallel. */
+    while (bsize >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *) (dp + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *) (dp + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *) (dp + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *) (dp + 0x30)));
+        dp += 64;
+        bsize -= 64;
+    }
+
+    /* Fold into a single block. */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (bsize >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *) dp));
+        dp += 16;
+        bsize -= 16;
+    }
+
+    /* Fold 128 bits to 64 bits. */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits. */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t ether_fcs_clmul(uint32_t crc, const uint8_t *dp, size_t bsize)
+{
+    if (bsize >= 64) {
+        const size_t n = bsize & ~(size_t) 15;
+
+        crc = ether_fcs_clmul_fold(crc, dp, n);
+        dp += n;
+        bsize -= n;
+    }
+
+    return ether_fcs_slice8(crc, dp, bsize);
+}
+#endif
+
+#ifdef ETHER_FCS_ARMV8
+__attribute__((target("+crc"))) static uint32_t ether_fcs_armv8(
+    uint32_t crc,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    while (bsize >= 8) {
+        uint64_t v;
+
+        memcpy(&v, dp, sizeof(v));
+        crc = __crc32d(crc, v);
+        dp += 8;
+        bsize -= 8;
+    }
+    while (bsize--)
+        crc = __crc32b(crc, *dp++);
+
+    return crc;
+}
+#endif
+
+static ether_fcs_fn_t *ether_fcs_fn = ether_fcs_slice8;
+
+__constructor static void ether_fcs_init(void)
+{
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (-(crc & 1) & ETHER_FCS_POLY);
+        fcs_table[0][i] = crc;
+    }
+    for (unsigned i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            const uint32_t prev = fcs_table[k - 1][i];
+
+            fcs_table[k][i] = (prev >> 8) ^ fcs_table[0][prev & 0xff];
+        }
+    }
+
+#if defined(ETHER_FCS_CLMUL)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        ether_fcs_fn = ether_fcs_clmul;
+#elif defined(ETHER_FCS_ARMV8)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        ether_fcs_fn = ether_fcs_armv8;
+#endif
+}
+
+uint32_t ether_fcs(const void *data, size_t bsize)
+{
+    return ~ether_fcs_fn(~0u, data, bsize);
+}
+
+size_t ether_fcs_append(uint8_t *frame, size_t frame_size)
+{
+    uint32_t fcs;
+
+    if (frame_size < ETHER_MINLEN) {
+        memset(frame + frame_size, 0, ETHER_MINLEN - frame_size);
+        frame_size = ETHER_MINLEN;
+    }
+    fcs = ether_fcs(frame, frame_size);
+    memcpy(frame + frame_size, &fcs, sizeof(fcs));
+
+    return frame_size + ETHER_FCS_LEN;
+}
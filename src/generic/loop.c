@@ -0,0 +1,359 @@
+/*
+ * Shared memory loopback ether driver.
+ *
+ * Two ends of a link are wired back-to-back through a pair of lock-free
+ * rings in a shared memory file, so that two stacks, or two handles of one
+ * stack, can exchange frames without the kernel. The file is given in place
+ * of the interface name and the side option selects the end of the link.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstack_util.h"
+#include "queue_r.h"
+
+#include "../logger.h"
+#include "../nstack_ether.h"
+
+#define ETHER_MAX_IF NSTACK_ETHER_MAX_IF
+
+#define LOOP_MAGIC 0x6e6c6f6f /* "nloo" */
+
+/**
+ * A frame slot in a ring.
+ * The frame is lent to the receiver in place.
+ */
+struct loop_slot {
+    uint16_t len;
+    uint8_t frame[ETHER_MAXLEN + ETHER_RX_TAILROOM];
+} __attribute__((aligned(16)));
+
+/**
+ * Frames sent by one end of the link.
+ */
+struct loop_ring {
+    queue_cb_t cb;
+    uint32_t seq;     /*!< Futex word, bumped to wake up the receiver. */
+    uint32_t waiting; /*!< The receiver is about to sleep on seq. */
+    struct loop_slot slot[NSTACK_ETHER_LOOP_FRAME_NR];
+};
+
+/**
+ * Layout of the shared memory file.
+ */
+struct loop_link {
+    uint32_t magic;
+    struct loop_ring ring[2]; /*!< ring[i] carries the frames of side i. */
+};
+
+struct ether_loop {
+    mac_addr_t el_mac;
+    struct loop_link *el_link;
+    struct loop_ring *el_rx;
+    struct loop_ring *el_tx;
+    pthread_mutex_t el_tx_lock; /*!< Keeps el_tx single producer. */
+};
+
+static struct ether_loop ether_if[ETHER_MAX_IF];
+static int ether_next_handle;
+
+static struct ether_loop *ether_handle2eth(int handle)
+{
+    if (handle < 0 || handle >= ether_next_handle) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_if[handle];
+}
+
+int ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_loop *eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    memcpy(addr, eth->el_mac, sizeof(mac_addr_t));
+    return 0;
+}
+
+unsigned ether_handle2caps(int handle)
+{
+    return 0;
+}
+
+unsigned ether_handle2queues(int handle)
+{
+    return ether_handle2eth(handle) ? 1 : 0;
+}
+
+int ether_handle2fd(int handle, unsigned queue)
+{
+    /* The receiver sleeps on a futex. */
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ether_addr2handle(const mac_addr_t addr)
+{
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        if (!memcmp(ether_if[handle].el_mac, addr, sizeof(mac_addr_t)))
+            return handle;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+static void loop_ether_ring_init(struct loop_ring *ring)
+{
+    ring->cb = queue_create(sizeof(struct loop_slot), sizeof(ring->slot));
+    ring->seq = 0;
+    ring->waiting = 0;
+}
+
+/**
+ * Map the link and initialize it if we are the first user.
+ */
+static struct loop_link *loop_ether_map(const char *path)
+{
+    struct loop_link *link;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+        return NULL;
+
+    if (flock(fd, LOCK_EX) || ftruncate(fd, sizeof(struct loop_link))) {
+        close(fd);
+        return NULL;
+    }
+
+    link = mmap(NULL, sizeof(struct loop_link), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (link != MAP_FAILED && link->magic != LOOP_MAGIC) {
+        loop_ether_ring_init(&link->ring[0]);
+        loop_ether_ring_init(&link->ring[1]);
+        link->magic = LOOP_MAGIC;
+    }
+
+    /* The mapping would keep the lock held after close(). */
+    flock(fd, LOCK_UN);
+    close(fd);
+    return link == MAP_FAILED ? NULL : link;
+}
+
+int ether_init(char *const args[])
+{
+    const int handle = ether_next_handle;
+    struct ether_loop *eth;
+    const char *value;
+    unsigned side;
+
+    if (handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+    eth = &ether_if[handle];
+    ether_next_handle++;
+
+    if (!args[0]) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    value = ether_arg(args, "side");
+    side = value ? (unsigned) strtoul(value, NULL, 0) : 0;
+    if (side > 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(eth->el_link = loop_ether_map(args[0])))
+        return -1;
+    pthread_mutex_init(&eth->el_tx_lock, NULL);
+    eth->el_tx = &eth->el_link->ring[side];
+    eth->el_rx = &eth->el_link->ring[!side];
+
+    /* Drop anything left from an earlier run. */
+    queue_clear_from_pop_end(&eth->el_rx->cb);
+
+    eth->el_mac[0] = 0x02; /* Locally administered */
+    eth->el_mac[4] = handle;
+    eth->el_mac[5] = side + 1;
+
+    return handle;
+}
+
+void ether_deinit(int handle)
+{
+    struct ether_loop *eth;
+
+    if (!(eth = ether_handle2eth(handle)) || !eth->el_link)
+        return;
+
+    munmap(eth->el_link, sizeof(struct loop_link));
+    eth->el_link = NULL;
+}
+
+static long loop_ether_futex(uint32_t *uaddr,
+                             int op,
+                             uint32_t val,
+                             const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/**
+ * Wake up the receiver of a ring if it's sleeping.
+ */
+static void loop_ether_kick(struct loop_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&ring->seq, 1, __ATOMIC_RELEASE);
+        loop_ether_futex(&ring->seq, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+static void loop_ether_release(struct ether_frame *frame)
+{
+    struct loop_ring *ring = frame->priv;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue_discard(&ring->cb, 1);
+}
+
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame)
+{
+    const struct timespec timeout = {.tv_sec = NSTACK_PERIODIC_EVENT_SEC};
+    struct ether_loop *eth;
+    struct loop_ring *ring;
+    struct loop_slot *slot;
+    const struct ether_hdr *frame_hdr;
+    int index;
+
+    assert(frame != NULL);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ring = eth->el_rx;
+
+    while (!queue_peek(&ring->cb, &index)) {
+        const uint32_t seq = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+        long retval;
+
+        /* The sender checks waiting after committing a frame. */
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (queue_peek(&ring->cb, &index)) {
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        retval = loop_ether_futex(&ring->seq, FUTEX_WAIT, seq, &timeout);
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        if (retval == -1 && (errno == ETIMEDOUT || errno == EINTR))
+            return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    slot = (struct loop_slot *) ((uint8_t *) ring->slot + index);
+    frame_hdr = (struct ether_hdr *) slot->frame;
+    memcpy(frame->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+    memcpy(frame->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+    frame->hdr.h_proto = ntohs(frame_hdr->h_proto);
+    frame->data = slot->frame + ETHER_HEADER_LEN;
+    frame->len = slot->len - ETHER_HEADER_LEN;
+    frame->release = loop_ether_release;
+    frame->priv = ring;
+
+    return 1;
+}
+
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr)
+{
+    /* Frames are released from the head of the ring, one at a time. */
+    return nr > 0 ? ether_receive(handle, queue, frames) : 0;
+}
+
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *iov,
+                unsigned iovcnt,
+                const struct ether_offload *off)
+{
+    struct ether_loop *eth;
+    struct loop_ring *ring;
+    struct loop_slot *slot;
+    struct ether_hdr *frame_hdr;
+    const size_t frame_size = ETHER_HEADER_LEN + ether_iov_len(iov, iovcnt);
+    int index;
+
+    assert(iovcnt > 0 && iovcnt <= ETHER_IOV_MAX);
+
+    if (frame_size > ETHER_MAXLEN)
+        return -EMSGSIZE;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+    ring = eth->el_tx;
+
+    pthread_mutex_lock(&eth->el_tx_lock);
+    if ((index = queue_alloc(&ring->cb)) == -1) {
+        pthread_mutex_unlock(&eth->el_tx_lock);
+        loop_ether_kick(ring);
+        return -ENOBUFS;
+    }
+
+    slot = (struct loop_slot *) ((uint8_t *) ring->slot + index);
+    frame_hdr = (struct ether_hdr *) slot->frame;
+    memcpy(frame_hdr->h_dst, dst, sizeof(mac_addr_t));
+    memcpy(frame_hdr->h_src, eth->el_mac, sizeof(mac_addr_t));
+    frame_hdr->h_proto = htons(proto);
+    ether_iov_copy(slot->frame + ETHER_HEADER_LEN, iov, iovcnt);
+    slot->len = frame_size;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue_commit(&ring->cb);
+    pthread_mutex_unlock(&eth->el_tx_lock);
+
+    if (!ether_tx_defer(handle))
+        loop_ether_kick(ring);
+
+    return (int) frame_size;
+}
+
+int ether_flush(int handle)
+{
+    struct ether_loop *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    loop_ether_kick(eth->el_tx);
+
+    return 0;
+}
@@ -0,0 +1,561 @@
+/*
+ * pcap ether driver.
+ *
+ * Frames are replayed from a pcap file given in place of the interface name,
+ * either as fast as possible or at the pace they were recorded, and the
+ * transmitted frames are written to another pcap file. No network or
+ * privileges are needed, which makes runs reproducible for benchmarking.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstack_util.h"
+
+#include "../logger.h"
+#include "../nstack_ether.h"
+
+#define ETHER_MAX_IF NSTACK_ETHER_MAX_IF
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN 65535
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_frac; /*!< usec or nsec depending on the magic. */
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+struct ether_pcap {
+    mac_addr_t ep_mac;
+    unsigned ep_caps;
+
+    const uint8_t *ep_in; /*!< Mapped input file. */
+    size_t ep_in_size;    /*!< Size of ep_in. */
+    size_t ep_in_off;     /*!< Offset of the next record. */
+    int ep_in_swap;       /*!< The file is in the other byte order. */
+    unsigned ep_ts_mult;  /*!< ts_frac to nsec. */
+    int ep_timed;         /*!< Replay at the recorded pace. */
+    unsigned ep_loops;    /*!< Number of replays left. */
+    uint64_t ep_ts_first; /*!< Timestamp of the first record [ns]. */
+    uint64_t ep_start;    /*!< Start time of the current replay [ns]. */
+    uint64_t ep_rx_start; /*!< Start time of the first replay [ns]. */
+    uint64_t ep_rx_frames;
+    int ep_rx_done;
+    uint8_t ep_rx_buffer[NSTACK_ETHER_RX_BURST]
+                        [ETHER_MAXLEN + ETHER_RX_TAILROOM]
+        __attribute__((aligned));
+
+    pthread_mutex_t ep_tx_lock;
+    FILE *ep_out; /*!< Output file or NULL if frames are discarded. */
+    uint8_t ep_tx_frame[ETHER_MAXLEN + ETHER_FCS_LEN];
+};
+
+static struct ether_pcap ether_if[ETHER_MAX_IF];
+static int ether_next_handle;
+
+static struct ether_pcap *ether_handle2eth(int handle)
+{
+    if (handle < 0 || handle >= ether_next_handle) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_if[handle];
+}
+
+int ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_pcap *eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    memcpy(addr, eth->ep_mac, sizeof(mac_addr_t));
+    return 0;
+}
+
+unsigned ether_handle2caps(int handle)
+{
+    struct ether_pcap *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return 0;
+
+    return eth->ep_caps;
+}
+
+unsigned ether_handle2queues(int handle)
+{
+    return ether_handle2eth(handle) ? 1 : 0;
+}
+
+int ether_handle2fd(int handle, unsigned queue)
+{
+    /* Frames are read from a file, which is always readable. */
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ether_addr2handle(const mac_addr_t addr)
+{
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        if (!memcmp(ether_if[handle].ep_mac, addr, sizeof(mac_addr_t)))
+            return handle;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+static uint64_t pcap_ether_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t pcap_ether_u32(const struct ether_pcap *eth, uint32_t v)
+{
+    return eth->ep_in_swap ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * Read the next record header of the input file.
+ * @returns Returns a pointer to the frame or NULL at the end of the file.
+ */
+static const uint8_t *pcap_ether_peek(const struct ether_pcap *eth,
+                                      struct pcap_rec_hdr *rec)
+{
+    const size_t off = eth->ep_in_off;
+
+    if (off + sizeof(*rec) > eth->ep_in_size)
+        return NULL;
+
+    memcpy(rec, eth->ep_in + off, sizeof(*rec));
+    rec->ts_sec = pcap_ether_u32(eth, rec->ts_sec);
+    rec->ts_frac = pcap_ether_u32(eth, rec->ts_frac);
+    rec->incl_len = pcap_ether_u32(eth, rec->incl_len);
+    rec->orig_len = pcap_ether_u32(eth, rec->orig_len);
+    if (rec->incl_len > eth->ep_in_size - off - sizeof(*rec))
+        return NULL; /* Truncated file */
+
+    return eth->ep_in + off + sizeof(*rec);
+}
+
+static uint64_t pcap_ether_ts(const struct ether_pcap *eth,
+                              const struct pcap_rec_hdr *rec)
+{
+    return (uint64_t) rec->ts_sec * 1000000000 +
+           (uint64_t) rec->ts_frac * eth->ep_ts_mult;
+}
+
+static void pcap_ether_rewind(struct ether_pcap *eth)
+{
+    struct pcap_rec_hdr rec;
+
+    eth->ep_in_off = sizeof(struct pcap_file_hdr);
+    eth->ep_start = pcap_ether_now();
+    eth->ep_ts_first =
+        pcap_ether_peek(eth, &rec) ? pcap_ether_ts(eth, &rec) : 0;
+}
+
+static int pcap_ether_open_input(struct ether_pcap *eth, const char *path)
+{
+    struct pcap_file_hdr hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    eth->ep_in = map;
+    eth->ep_in_size = st.st_size;
+
+    memcpy(&hdr, eth->ep_in, sizeof(hdr));
+    eth->ep_in_swap = 0;
+    switch (hdr.magic) {
+    case PCAP_MAGIC_USEC:
+        eth->ep_ts_mult = 1000;
+        break;
+    case PCAP_MAGIC_NSEC:
+        eth->ep_ts_mult = 1;
+        break;
+    default:
+        eth->ep_in_swap = 1;
+        switch (pcap_ether_u32(eth, hdr.magic)) {
+        case PCAP_MAGIC_USEC:
+            eth->ep_ts_mult = 1000;
+            break;
+        case PCAP_MAGIC_NSEC:
+            eth->ep_ts_mult = 1;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (pcap_ether_u32(eth, hdr.linktype) != PCAP_LINKTYPE_ETHERNET) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Use the destination of the first unicast frame as our address.
+ */
+static void pcap_ether_default_mac(struct ether_pcap *eth)
+{
+    static const mac_addr_t local = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    struct pcap_rec_hdr rec;
+    const uint8_t *frame;
+
+    memcpy(eth->ep_mac, local, sizeof(mac_addr_t));
+    for (eth->ep_in_off = sizeof(struct pcap_file_hdr);
+         (frame = pcap_ether_peek(eth, &rec));
+         eth->ep_in_off += sizeof(rec) + rec.incl_len) {
+        if (rec.incl_len >= ETHER_HEADER_LEN && !(frame[0] & 0x01)) {
+            memcpy(eth->ep_mac, frame, sizeof(mac_addr_t));
+            break;
+        }
+    }
+}
+
+static int pcap_ether_open_output(struct ether_pcap *eth, const char *path)
+{
+    const struct pcap_file_hdr hdr = {
+        .magic = PCAP_MAGIC_USEC,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = PCAP_SNAPLEN,
+        .linktype = PCAP_LINKTYPE_ETHERNET,
+    };
+
+    if (!(eth->ep_out = fopen(path, "w")))
+        return -1;
+    if (fwrite(&hdr, sizeof(hdr), 1, eth->ep_out) != 1)
+        return -1;
+
+    return 0;
+}
+
+static void pcap_ether_free(struct ether_pcap *eth)
+{
+    if (eth->ep_in)
+        munmap((void *) eth->ep_in, eth->ep_in_size);
+    eth->ep_in = NULL;
+    if (eth->ep_out)
+        fclose(eth->ep_out);
+    eth->ep_out = NULL;
+}
+
+int ether_init(char *const args[])
+{
+    const int handle = ether_next_handle;
+    struct ether_pcap *eth;
+    const char *value;
+
+    if (handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+    eth = &ether_if[handle];
+    ether_next_handle++;
+
+    if (!args[0]) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    value = ether_arg(args, "loop");
+    eth->ep_loops = value ? (unsigned) strtoul(value, NULL, 0) : 1;
+    value = ether_arg(args, "timed");
+    eth->ep_timed = value ? !!strtoul(value, NULL, 0) : 0;
+    value = ether_arg(args, "fcs");
+    eth->ep_caps = (value && strtoul(value, NULL, 0)) ? ETHER_CAP_SW_FCS : 0;
+    pthread_mutex_init(&eth->ep_tx_lock, NULL);
+
+    if (pcap_ether_open_input(eth, args[0]))
+        goto fail;
+
+    value = ether_arg(args, "mac");
+    if (value) {
+        uint8_t *mac = eth->ep_mac;
+
+        if (sscanf(value, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+                   &mac[2], &mac[3], &mac[4], &mac[5]) != 6) {
+            errno = EINVAL;
+            goto fail;
+        }
+    } else {
+        pcap_ether_default_mac(eth);
+    }
+
+    value = ether_arg(args, "out");
+    if (value && pcap_ether_open_output(eth, value))
+        goto fail;
+
+    pcap_ether_rewind(eth);
+    eth->ep_rx_start = eth->ep_start;
+
+    return handle;
+fail:
+    pcap_ether_free(eth);
+    return -1;
+}
+
+void ether_deinit(int handle)
+{
+    struct ether_pcap *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return;
+
+    pthread_mutex_lock(&eth->ep_tx_lock);
+    pcap_ether_free(eth);
+    pthread_mutex_unlock(&eth->ep_tx_lock);
+}
+
+static void pcap_ether_sleep(uint64_t ns)
+{
+    const struct timespec ts = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+
+    nanosleep(&ts, NULL);
+}
+
+static void pcap_ether_release(struct ether_frame *frame)
+{
+    /* The frame is in an ep_rx_buffer. */
+}
+
+/**
+ * Read the next frame into buf.
+ * @param[in] wait tells whether to wait for the frame if it's not due yet,
+ *                 or after the end of the capture.
+ * @returns Returns 1 if a frame was read; Otherwise 0.
+ */
+static int pcap_ether_next(struct ether_pcap *eth,
+                           struct ether_frame *frame,
+                           uint8_t *buf,
+                           int wait)
+{
+    const uint64_t period = (uint64_t) NSTACK_PERIODIC_EVENT_SEC * 1000000000;
+    struct pcap_rec_hdr rec;
+    const uint8_t *data;
+    const struct ether_hdr *frame_hdr;
+
+    while (1) {
+        if (!(data = pcap_ether_peek(eth, &rec))) {
+            if (eth->ep_loops > 1) {
+                eth->ep_loops--;
+                pcap_ether_rewind(eth);
+                continue;
+            }
+            if (!wait)
+                return 0;
+            if (!eth->ep_rx_done) {
+                const double sec =
+                    (double) (pcap_ether_now() - eth->ep_rx_start) / 1e9;
+
+                LOG(LOG_INFO, "End of capture: %llu frames, %.0f frames/s",
+                    (unsigned long long) eth->ep_rx_frames,
+                    sec > 0 ? eth->ep_rx_frames / sec : 0);
+                eth->ep_rx_done = 1;
+            }
+            pcap_ether_sleep(period);
+            return 0;
+        }
+
+        if (eth->ep_timed) {
+            const uint64_t due =
+                eth->ep_start + (pcap_ether_ts(eth, &rec) - eth->ep_ts_first);
+            const uint64_t now = pcap_ether_now();
+
+            if (due > now && !wait)
+                return 0;
+            if (due > now + period) {
+                pcap_ether_sleep(period);
+                return 0;
+            }
+            if (due > now)
+                pcap_ether_sleep(due - now);
+        }
+
+        eth->ep_in_off += sizeof(rec) + rec.incl_len;
+        /* Skip runts and frames aggregated by the capturing host. */
+        if (rec.incl_len >= ETHER_HEADER_LEN && rec.incl_len <= ETHER_MAXLEN)
+            break;
+    }
+    eth->ep_rx_frames++;
+
+    /* The file mapping is read-only so the frame is copied once. */
+    memcpy(buf, data, rec.incl_len);
+    frame_hdr = (struct ether_hdr *) buf;
+    memcpy(frame->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+    memcpy(frame->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+    frame->hdr.h_proto = ntohs(frame_hdr->h_proto);
+    frame->data = buf + ETHER_HEADER_LEN;
+    frame->len = rec.incl_len - ETHER_HEADER_LEN;
+    frame->release = pcap_ether_release;
+    frame->priv = eth;
+
+    return 1;
+}
+
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame)
+{
+    struct ether_pcap *eth;
+
+    assert(frame != NULL);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return pcap_ether_next(eth, frame, eth->ep_rx_buffer[0], 1);
+}
+
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr)
+{
+    struct ether_pcap *eth;
+    unsigned n;
+
+    assert(frames != NULL && nr <= NSTACK_ETHER_RX_BURST);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Each frame of a burst has its own buffer. */
+    for (n = 0; n < nr; n++) {
+        if (!pcap_ether_next(eth, &frames[n], eth->ep_rx_buffer[n], n == 0))
+            break;
+    }
+
+    return n;
+}
+
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *iov,
+                unsigned iovcnt,
+                const struct ether_offload *off)
+{
+    const size_t bsize = ether_iov_len(iov, iovcnt);
+    struct ether_pcap *eth;
+    struct ether_hdr *frame_hdr;
+    struct pcap_rec_hdr rec;
+    struct timeval tv;
+    size_t frame_size;
+    int retval;
+
+    assert(iovcnt > 0 && iovcnt <= ETHER_IOV_MAX);
+
+    if (ETHER_HEADER_LEN + bsize > ETHER_MAXLEN)
+        return -EMSGSIZE;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->ep_tx_lock);
+    frame_hdr = (struct ether_hdr *) eth->ep_tx_frame;
+    memcpy(frame_hdr->h_dst, dst, sizeof(mac_addr_t));
+    memcpy(frame_hdr->h_src, eth->ep_mac, sizeof(mac_addr_t));
+    frame_hdr->h_proto = htons(proto);
+    ether_iov_copy(eth->ep_tx_frame + ETHER_HEADER_LEN, iov, iovcnt);
+    frame_size = ETHER_HEADER_LEN + bsize;
+    if (eth->ep_caps & ETHER_CAP_SW_FCS)
+        frame_size = ether_fcs_append(eth->ep_tx_frame, frame_size);
+    retval = (int) frame_size;
+
+    if (!eth->ep_out)
+        goto out;
+
+    gettimeofday(&tv, NULL);
+    rec = (struct pcap_rec_hdr){
+        .ts_sec = tv.tv_sec,
+        .ts_frac = tv.tv_usec,
+        .incl_len = frame_size,
+        .orig_len = frame_size,
+    };
+    if (fwrite(&rec, sizeof(rec), 1, eth->ep_out) != 1 ||
+        fwrite(eth->ep_tx_frame, frame_size, 1, eth->ep_out) != 1 ||
+        (!ether_tx_defer(handle) && fflush(eth->ep_out)))
+        retval = -EIO;
+out:
+    pthread_mutex_unlock(&eth->ep_tx_lock);
+    return retval;
+}
+
+int ether_flush(int handle)
+{
+    struct ether_pcap *eth;
+    int retval = 0;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->ep_tx_lock);
+    if (eth->ep_out && fflush(eth->ep_out))
+        retval = -EIO;
+    pthread_mutex_unlock(&eth->ep_tx_lock);
+
+    return retval;
+}
@@ -25,6 +25,7 @@ static int icmp_input(const struct ip_hdr *ip_hdr __unused,
 {
     struct icmp *net_msg = (struct icmp *) payload;
     struct icmp hdr;
+    uint16_t from, to;
 
     if (bsize < sizeof(struct icmp)) {
         LOG(LOG_ERR, "Invalid ICMP message size");
@@ -37,9 +38,11 @@ static int icmp_input(const struct ip_hdr *ip_hdr __unused,
     LOG(LOG_DEBUG, "ICMP type: %d", hdr.icmp_type);
     switch (hdr.icmp_type) {
     case ICMP_TYPE_ECHO_REQUEST:
+        /* Only the type changes, so the payload isn't summed again. */
+        memcpy(&from, net_msg, sizeof(from));
         net_msg->icmp_type = ICMP_TYPE_ECHO_REPLY;
-        net_msg->icmp_csum = 0;
-        net_msg->icmp_csum = ip_checksum(net_msg, bsize);
+        memcpy(&to, net_msg, sizeof(to));
+        net_msg->icmp_csum = ip_csum_update16(net_msg->icmp_csum, from, to);
 
         return bsize;
     default:
@@ -78,6 +81,9 @@ int icmp_generate_dest_unreachable(struct ip_hdr *hdr,
     hdr->ip_tos = IP_TOS_DEFAULT;
     hdr->ip_proto = IP_PROTO_ICMP;
     msg_size += ip_reply_header(hdr, msg_size);
+    /* The header was rewritten, so its checksum is computed again. */
+    hdr->ip_csum = 0;
+    hdr->ip_csum = ip_checksum(hdr, ip_hdr_hlen(hdr));
 
     return msg_size;
 }
@@ -1,18 +1,40 @@
+#include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 
 #include "nstack_in.h"
+#include "nstack_util.h"
 
 #include "ip_defer.h"
 #include "logger.h"
 #include "nstack_arp.h"
 #include "nstack_icmp.h"
 #include "nstack_ip.h"
+#include "nstack_mbuf.h"
 
 SET_DECLARE(_ip_proto_handlers, struct _ip_proto_handler);
 
+/*
+ * IP protocol dispatch table built from _ip_proto_handlers at startup.
+ */
+static struct _ip_proto_handler *ip_proto_table[256];
+
 static unsigned ip_global_id; /* Global ID for IP packets. */
 
+__constructor static void ip_proto_table_init(void)
+{
+    struct _ip_proto_handler **tmpp;
+
+    SET_FOREACH (tmpp, _ip_proto_handlers) {
+        const uint16_t proto_id = (*tmpp)->proto_id;
+
+        /* The first registration of a protocol wins. */
+        if (proto_id < num_elem(ip_proto_table) && !ip_proto_table[proto_id])
+            ip_proto_table[proto_id] = *tmpp;
+    }
+}
+
 int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask)
 {
     mac_addr_t mac;
@@ -27,7 +49,8 @@ int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask)
     ether_handle2addr(ether_handle, mac);
     arp_cache_insert(ip_addr, mac, ARP_CACHE_STATIC);
 
-    ip_route_update(&route);
+    if (ip_route_update(&route))
+        return -1;
 
     /* Announce that we are online. */
     for (size_t i = 0; i < 3; i++)
@@ -36,35 +59,11 @@ int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask)
     return 0;
 }
 
-uint16_t ip_checksum(void *dp, size_t bsize)
-{
-    uint8_t *data = (uint8_t *) dp;
-    uint32_t acc = 0xffff;
-    size_t i;
-    uint16_t word;
-
-    for (i = 0; i + 1 < bsize; i += 2) {
-        memcpy(&word, data + i, 2);
-        acc += word;
-        if (acc > 0xffff)
-            acc -= ntohs(0xffff);
-    }
-
-    if (bsize & 1) {
-        word = 0;
-        memcpy(&word, data + bsize - 1, 1);
-        acc += word;
-        if (acc > 0xffff)
-            acc -= ntohs(0xffff);
-    }
-
-    return ~acc;
-}
-
-void ip_hton(const struct ip_hdr *host, struct ip_hdr *net)
+/**
+ * Convert a header to network byte order without the checksum.
+ */
+static void ip_hton_fields(const struct ip_hdr *host, struct ip_hdr *net)
 {
-    size_t hlen = ip_hdr_hlen(host);
-
     net->ip_vhl = host->ip_vhl;
     net->ip_tos = host->ip_tos;
     net->ip_len = htons(host->ip_len);
@@ -75,7 +74,13 @@ void ip_hton(const struct ip_hdr *host, struct ip_hdr *net)
     net->ip_csum = host->ip_csum;
     net->ip_src = htonl(host->ip_src);
     net->ip_dst = htonl(host->ip_dst);
+}
+
+void ip_hton(const struct ip_hdr *host, struct ip_hdr *net)
+{
+    size_t hlen = ip_hdr_hlen(host);
 
+    ip_hton_fields(host, net);
     net->ip_csum = 0;
     net->ip_csum = ip_checksum(net, hlen);
 }
@@ -99,9 +104,11 @@ size_t ip_ntoh(const struct ip_hdr *net, struct ip_hdr *host)
 size_t ip_reply_header(struct ip_hdr *host_ip_hdr, size_t bsize)
 {
     struct ip_hdr *const ip = host_ip_hdr;
+    const uint16_t ttl_proto = htons(ip->ip_ttl << 8 | ip->ip_proto);
+    const uint16_t len = htons(ip->ip_len);
     in_addr_t tmp;
 
-    /* Swap source and destination. */
+    /* Swap source and destination. The sum stays the same. */
     tmp = ip->ip_src;
     ip->ip_src = ip->ip_dst;
     ip->ip_dst = tmp;
@@ -110,50 +117,60 @@ size_t ip_reply_header(struct ip_hdr *host_ip_hdr, size_t bsize)
     bsize += ip_hdr_hlen(ip);
     ip->ip_len = bsize;
 
+    ip->ip_csum = ip_csum_update16(ip->ip_csum, ttl_proto,
+                                   htons(ip->ip_ttl << 8 | ip->ip_proto));
+    ip->ip_csum = ip_csum_update16(ip->ip_csum, len, htons(ip->ip_len));
+
     /* Back to network order */
-    ip_hton(ip, ip);
+    ip_hton_fields(ip, ip);
 
     return bsize;
 }
 
-int ip_input(const struct ether_hdr *e_hdr, uint8_t *payload, size_t bsize)
+/**
+ * Check the header of a received IP packet.
+ * @param[out] retval is set to the result of the packet if it doesn't go on
+ *                    to its protocol handler.
+ * @returns Returns true if the packet should be passed to its protocol
+ *          handler; Otherwise false.
+ */
+static bool ip_input_head(const struct ether_hdr *e_hdr,
+                          uint8_t *payload,
+                          size_t bsize,
+                          int *retval)
 {
     struct ip_hdr *ip = (struct ip_hdr *) payload;
-    struct _ip_proto_handler **tmpp;
-    struct _ip_proto_handler *proto;
     size_t hlen;
 
+    *retval = 0;
+
     if (e_hdr) {
+        /* The replies only update the checksum, so it must be valid. */
+        hlen = ip_hdr_hlen(ip);
+        if (hlen > bsize || ip_checksum(ip, hlen) != 0) {
+            LOG(LOG_ERR, "Drop due to an invalid checksum");
+            return false;
+        }
         ip_ntoh(ip, ip);
     }
 
     if ((ip->ip_vhl & 0x40) != 0x40) {
         LOG(LOG_ERR, "Unsupported IP packet version: 0x%x", ip->ip_vhl);
-        return 0;
+        return false;
     }
 
     hlen = ip_hdr_hlen(ip);
     if (hlen < 20) {
         LOG(LOG_ERR, "Incorrect packet header length: %d", (int) hlen);
-        return 0;
+        return false;
     }
 
     if (ip->ip_len != bsize) {
         LOG(LOG_ERR, "Packet size mismatch. iplen = %d, bsize = %d",
             (int) ip->ip_len, (int) bsize);
-        return 0;
+        return false;
     }
 
-/*
- * RFE The packet header is already modified with ntoh so this wont work.
- */
-#if 0
-    if (ip_checksum(ip, hlen) != 0) {
-        LOG(LOG_ERR, "Drop due to an invalid checksum");
-        return;
-    }
-#endif
-
     if (ip->ip_tos != IP_TOS_DEFAULT) {
         LOG(LOG_INFO, "Unsupported IP type of service or ECN: 0x%x",
             ip->ip_tos);
@@ -171,10 +188,10 @@ int ip_input(const struct ether_hdr *e_hdr, uint8_t *payload, size_t bsize)
         LOG(LOG_WARN, "Invalid destination address %s", dst_str);
 
         if (NSTACK_IP_SEND_HOSTUNREAC) {
-            return icmp_generate_dest_unreachable(ip, ICMP_CODE_HOSTUNREAC,
-                                                  payload + hlen, bsize - hlen);
+            *retval = icmp_generate_dest_unreachable(
+                ip, ICMP_CODE_HOSTUNREAC, payload + hlen, bsize - hlen);
         }
-        return 0;
+        return false;
     }
 
     if (ip_fragment_is_frag(ip)) {
@@ -183,39 +200,136 @@ int ip_input(const struct ether_hdr *e_hdr, uint8_t *payload, size_t bsize)
          */
         ip_fragment_input(ip, payload + hlen);
 
-        return 0;
+        return false;
     }
 
-    SET_FOREACH (tmpp, _ip_proto_handlers) {
-        proto = *tmpp;
-        if (proto->proto_id == ip->ip_proto)
-            break;
-        proto = NULL;
+    return true;
+}
+
+/**
+ * Finish a packet after its protocol handler.
+ * @param[in] proto is the protocol handler or NULL if there is none.
+ * @param[in] payload is the payload after the IP header.
+ * @param[in] bsize is the size of the payload.
+ * @param[in] retval is the result of the protocol handler.
+ */
+static int ip_input_tail(const struct _ip_proto_handler *proto,
+                         struct ip_hdr *ip,
+                         uint8_t *payload,
+                         size_t bsize,
+                         int retval)
+{
+    if (!proto) {
+        LOG(LOG_INFO, "Unsupported protocol");
+
+        return icmp_generate_dest_unreachable(ip, ICMP_CODE_PROTOUNREAC,
+                                              payload, bsize);
     }
 
-    LOG(LOG_DEBUG, "proto id: 0x%x", ip->ip_proto);
+    if (retval > 0)
+        retval = ip_reply_header(ip, retval);
+    if (retval == -ENOTSOCK) {
+        LOG(LOG_INFO, "Unreachable port");
 
-    if (proto) {
-        int retval;
+        return icmp_generate_dest_unreachable(ip, ICMP_CODE_PORTUNREAC,
+                                              payload, bsize);
+    }
+    return retval;
+}
 
+int ip_input(const struct ether_hdr *e_hdr, uint8_t *payload, size_t bsize)
+{
+    struct ip_hdr *ip = (struct ip_hdr *) payload;
+    struct _ip_proto_handler *proto;
+    size_t hlen;
+    int retval;
+
+    if (!ip_input_head(e_hdr, payload, bsize, &retval))
+        return retval;
+
+    hlen = ip_hdr_hlen(ip);
+    proto = ip_proto_table[ip->ip_proto];
+
+    LOG(LOG_DEBUG, "proto id: 0x%x", ip->ip_proto);
+
+    if (proto)
         retval = proto->fn(ip, payload + hlen, bsize - hlen);
-        if (retval > 0)
-            retval = ip_reply_header(ip, retval);
-        if (retval == -ENOTSOCK) {
-            LOG(LOG_INFO, "Unreachable port");
+    return ip_input_tail(proto, ip, payload + hlen, bsize - hlen, retval);
+}
 
-            return icmp_generate_dest_unreachable(ip, ICMP_CODE_PORTUNREAC,
-                                                  payload + hlen, bsize - hlen);
+/**
+ * Pass checked packets to their protocols in runs of the same protocol.
+ */
+static void ip_input_run(struct ether_pkt *pkts[], unsigned n)
+{
+    unsigned run;
+
+    for (unsigned i = 0; i < n; i += run) {
+        const uint8_t proto_id = pkts[i]->ip_hdr->ip_proto;
+        const struct _ip_proto_handler *proto = ip_proto_table[proto_id];
+
+        for (run = 1;
+             i + run < n && pkts[i + run]->ip_hdr->ip_proto == proto_id; run++)
+            ;
+
+        LOG(LOG_DEBUG, "proto id: 0x%x, %u packets", proto_id, run);
+
+        if (proto && proto->burst_fn) {
+            proto->burst_fn(pkts + i, run);
+        } else if (proto) {
+            for (unsigned j = i; j < i + run; j++) {
+                struct ether_pkt *pkt = pkts[j];
+
+                if (j + 1 < i + run)
+                    __builtin_prefetch(pkts[j + 1]->payload);
+                pkt->retval = proto->fn(pkt->ip_hdr, pkt->payload, pkt->bsize);
+            }
         }
-        return retval;
-    } else {
-        LOG(LOG_INFO, "Unsupported protocol");
 
-        return icmp_generate_dest_unreachable(ip, ICMP_CODE_PROTOUNREAC,
-                                              payload + hlen, bsize - hlen);
+        for (unsigned j = i; j < i + run; j++) {
+            struct ether_pkt *pkt = pkts[j];
+
+            pkt->retval = ip_input_tail(proto, pkt->ip_hdr, pkt->payload,
+                                        pkt->bsize, pkt->retval);
+        }
+    }
+}
+
+/**
+ * IP input chain for a burst of packets.
+ * The headers are checked first and the packets left are passed to their
+ * protocols together. A fragment may complete a packet that is passed to its
+ * protocol right away, so the packets before it are passed first.
+ */
+static void ip_input_burst(struct ether_pkt *pkts[], unsigned n)
+{
+    struct ether_pkt *next[NSTACK_ETHER_RX_BURST];
+    unsigned nr_next = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_pkt *pkt = pkts[i];
+        size_t hlen;
+
+        if (i + 1 < n)
+            __builtin_prefetch(pkts[i + 1]->payload);
+        if (nr_next > 0 && (ntohs(((struct ip_hdr *) pkt->payload)->ip_foff) &
+                            (IP_FLAGS_MF | 0x1fff))) {
+            ip_input_run(next, nr_next);
+            nr_next = 0;
+        }
+        if (!ip_input_head(pkt->hdr, pkt->payload, pkt->bsize, &pkt->retval))
+            continue;
+
+        pkt->ip_hdr = (struct ip_hdr *) pkt->payload;
+        hlen = ip_hdr_hlen(pkt->ip_hdr);
+        pkt->payload += hlen;
+        pkt->bsize -= hlen;
+        next[nr_next++] = pkt;
     }
+
+    ip_input_run(next, nr_next);
 }
-ETHER_PROTO_INPUT_HANDLER(ETHER_PROTO_IPV4, ip_input);
+ETHER_PROTO_INPUT_BURST_HANDLER(ETHER_PROTO_IPV4, ip_input, ip_input_burst);
 
 static inline size_t ip_off_round(size_t plen)
 {
@@ -241,14 +355,14 @@ static int ip_send_fragments(int ether_handle,
     struct ip_hdr ip_hdr;
     uint8_t *data;
     size_t hlen, bytes, offset = 0;
-    int retval = 0;
+    int eret, retval = 0;
 
     hlen = ip_ntoh(ip_hdr_net, &ip_hdr);
     data = payload + hlen;
     bytes = bsize - hlen;
+    ether_tx_begin();
     do {
         size_t plen;
-        int eret;
 
         plen = next_fragment_size(bytes, hlen, ETHER_DATA_LEN);
         bytes -= plen;
@@ -258,16 +372,60 @@ static int ip_send_fragments(int ether_handle,
         ip_hton(&ip_hdr, ip_hdr_net);
         memmove(data, data + offset, plen);
         eret = ether_send(ether_handle, dst_mac, ETHER_PROTO_IPV4, payload,
-                          ip_hdr.ip_len);
-        if (eret < 0)
+                          ip_hdr.ip_len, NULL);
+        if (eret < 0) {
+            ether_tx_end();
             return eret;
+        }
         retval += eret;
         offset += plen;
     } while (bytes > 0);
 
+    eret = ether_tx_end();
+    if (eret < 0)
+        return eret;
+
     return retval;
 }
 
+/**
+ * Store the pseudo-header sum of an L4 segment to its checksum field.
+ * @param[in] hdr is the IP header in host byte order.
+ */
+static void ip_pseudo_sum(const struct ip_hdr *hdr, size_t bsize, uint8_t *csum)
+{
+    const uint16_t word =
+        ip_csum_pseudo(hdr->ip_src, hdr->ip_dst, hdr->ip_proto, bsize);
+
+    memcpy(csum, &word, sizeof(word));
+}
+
+/**
+ * Do the offloads the interface can't do in software.
+ * @param[in] iov is the packet; the L4 header must be in the first segment.
+ * @returns Returns the offloads left for ether_sendv().
+ */
+static const struct ether_offload *ip_offload(int ether_handle,
+                                              const struct iovec *iov,
+                                              unsigned iovcnt,
+                                              size_t packet_size,
+                                              struct ether_offload *off)
+{
+    const unsigned caps = ether_handle2caps(ether_handle);
+
+    /* Without TSO a large packet is fragmented instead. */
+    if (packet_size <= ETHER_DATA_LEN || !(caps & ETHER_CAP_TSO))
+        off->gso_size = 0;
+
+    /* The checksum of a packet to be fragmented must be complete. */
+    if ((caps & ETHER_CAP_TX_CSUM) &&
+        (off->gso_size || packet_size <= ETHER_DATA_LEN))
+        return off;
+
+    ether_offload_csumv(iov, iovcnt, off);
+    return NULL;
+}
+
 static const struct ip_hdr ip_hdr_template = {
     .ip_vhl = IP_VHL_DEFAULT,
     .ip_tos = IP_TOS_DEFAULT,
@@ -275,13 +433,16 @@ static const struct ip_hdr ip_hdr_template = {
     .ip_ttl = IP_TTL_DEFAULT,
 };
 
-int ip_send(in_addr_t dst, uint8_t proto, const uint8_t *buf, size_t bsize)
+/**
+ * Find the interface and the MAC address of a destination.
+ * @retval  0 the destination was resolved;
+ * @retval  1 the MAC address is being resolved and the packet should be
+ *            deferred;
+ * @retval -1 an error occurred, errno is set.
+ */
+static int ip_resolve(in_addr_t dst, struct ip_route *route, mac_addr_t dst_mac)
 {
-    mac_addr_t dst_mac;
-    size_t packet_size = sizeof(struct ip_hdr) + bsize;
-    struct ip_route route;
-
-    if (ip_route_find_by_network(dst, &route)) {
+    if (ip_route_find_by_network(dst, route)) {
         char ip_str[IP_STR_LEN];
 
         ip2str(dst, ip_str);
@@ -290,55 +451,199 @@ int ip_send(in_addr_t dst, uint8_t proto, const uint8_t *buf, size_t bsize)
         return -1;
     }
 
-    if (arp_cache_get_haddr(route.r_iface, dst, dst_mac)) {
-        int retval = 0;
-
-        if (errno == EHOSTUNREACH) {
-            /*
-             * We must defer the operation for now because we are waiting for
-             * the receiver's MAC addr to be resolved.
-             */
-            retval = ip_defer_push(dst, proto, buf, bsize);
-            if (retval == 0 || (retval == -EALREADY)) {
-                retval = 0; /* Return 0 to indicate a deferred operation. */
-            } else {        /* else an error occurred. */
-                errno = -retval;
-                retval = -1;
-            }
-        }
-        return retval;
+    if (arp_cache_get_haddr(route->r_iface, dst, dst_mac))
+        return (errno == EHOSTUNREACH) ? 1 : -1;
+
+    return 0;
+}
+
+/**
+ * Defer a packet until the MAC address of its destination is resolved.
+ * @returns Returns 0 to indicate a deferred operation;
+ *          Otherwise -1 and errno is set.
+ */
+static int ip_defer(in_addr_t dst,
+                    uint8_t proto,
+                    const uint8_t *buf,
+                    size_t bsize,
+                    const struct ether_offload *off)
+{
+    int retval;
+
+    /*
+     * We must defer the operation for now because we are waiting for the
+     * receiver's MAC addr to be resolved.
+     */
+    retval = ip_defer_push(dst, proto, buf, bsize, off);
+    if (retval == 0 || (retval == -EALREADY))
+        return 0;
+
+    errno = -retval;
+    return -1;
+}
+
+/**
+ * Fill in the IP header of a packet and request its offloads.
+ * @param[in,out] hdr is the header, followed by the L4 header.
+ * @param[in] iov is the packet starting with hdr.
+ * @param[out] ip_off is set to the offloads relative to the IP header.
+ * @returns Returns the offloads left for ether_sendv().
+ */
+static const struct ether_offload *ip_output_hdr(
+    struct ip_hdr *hdr,
+    const struct ip_route *route,
+    in_addr_t dst,
+    uint8_t proto,
+    const struct iovec *iov,
+    unsigned iovcnt,
+    size_t packet_size,
+    const struct ether_offload *off,
+    struct ether_offload *ip_off)
+{
+    memcpy(hdr, &ip_hdr_template, sizeof(ip_hdr_template));
+    hdr->ip_len = packet_size;
+    hdr->ip_id = __sync_fetch_and_add(&ip_global_id, 1);
+    hdr->ip_src = route->r_iface;
+    hdr->ip_dst = dst;
+    hdr->ip_proto = proto;
+    if (off) {
+        *ip_off = *off;
+        ip_off->csum_start += sizeof(ip_hdr_template);
+        ip_pseudo_sum(hdr, packet_size - sizeof(ip_hdr_template),
+                      (uint8_t *) hdr + ip_off->csum_start +
+                          ip_off->csum_offset);
+        off = ip_offload(route->r_iface_handle, iov, iovcnt, packet_size,
+                         ip_off);
     }
+    ip_hton(hdr, hdr);
 
-    {
-        uint8_t packet[packet_size];
-        struct ip_hdr *hdr = (struct ip_hdr *) packet;
-        int retval;
-
-        memcpy(hdr, &ip_hdr_template, sizeof(ip_hdr_template));
-        hdr->ip_len = packet_size;
-        hdr->ip_id = ip_global_id++;
-        hdr->ip_src = route.r_iface;
-        hdr->ip_dst = dst;
-        hdr->ip_proto = proto;
-        memcpy(packet + sizeof(ip_hdr_template), buf, bsize);
-        ip_hton(hdr, hdr);
-
-        if (bsize <= ETHER_DATA_LEN) {
-            retval = ether_send(route.r_iface_handle, dst_mac, ETHER_PROTO_IPV4,
-                                packet, packet_size);
-        } else if (1) { /* Check DF flag */
-            retval = ip_send_fragments(route.r_iface_handle, dst_mac, packet,
-                                       packet_size);
-            if (retval < 0) {
-                errno = -retval;
-                retval = -1;
-            }
-        } else {
-            /* TODO Fail properly */
-            errno = EMSGSIZE;
+    return off;
+}
+
+int ip_send_mbuf(in_addr_t dst,
+                 uint8_t proto,
+                 struct mbuf *m,
+                 const struct ether_offload *off)
+{
+    mac_addr_t dst_mac;
+    struct ip_route route;
+    struct ether_offload ip_off;
+    struct iovec iov;
+    int retval;
+
+    retval = ip_resolve(dst, &route, dst_mac);
+    if (retval < 0)
+        goto out;
+    if (retval > 0) {
+        retval = ip_defer(dst, proto, m->data, m->len, off);
+        goto out;
+    }
+
+    /* The header is prepended to the segment in place. */
+    mbuf_prepend(m, sizeof(ip_hdr_template));
+    iov = (struct iovec){.iov_base = m->data, .iov_len = m->len};
+    off = ip_output_hdr((struct ip_hdr *) m->data, &route, dst, proto, &iov, 1,
+                        m->len, off, &ip_off);
+
+    if (m->len <= ETHER_DATA_LEN || (off && off->gso_size)) {
+        retval = ether_send(route.r_iface_handle, dst_mac, ETHER_PROTO_IPV4,
+                            m->data, m->len, off);
+    } else if (1) { /* Check DF flag */
+        retval = ip_send_fragments(route.r_iface_handle, dst_mac, m->data,
+                                   m->len);
+        if (retval < 0) {
+            errno = -retval;
             retval = -1;
         }
+    } else {
+        /* TODO Fail properly */
+        errno = EMSGSIZE;
+        retval = -1;
+    }
+
+out:
+    mbuf_free(m);
+    return retval;
+}
 
+int ip_sendv(in_addr_t dst,
+             uint8_t proto,
+             const struct iovec *iov,
+             unsigned iovcnt,
+             const struct ether_offload *off)
+{
+    const size_t bsize = ether_iov_len(iov, iovcnt);
+    const size_t packet_size = sizeof(struct ip_hdr) + bsize;
+    uint8_t hdr_buf[sizeof(struct ip_hdr) + IP_SENDV_HDR_MAX]
+        __attribute__((aligned(4)));
+    struct iovec chain[ETHER_IOV_MAX];
+    struct ether_offload ip_off;
+    mac_addr_t dst_mac;
+    struct ip_route route;
+    struct mbuf *m;
+    int retval;
+
+    assert(iovcnt > 0 && iovcnt <= ETHER_IOV_MAX);
+    assert(iov[0].iov_len <= IP_SENDV_HDR_MAX);
+
+    if (bsize > IP_DATA_MAX_BYTES) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    retval = ip_resolve(dst, &route, dst_mac);
+    if (retval < 0)
+        return -1;
+
+    /* A packet to be deferred or fragmented is needed in one piece. */
+    if (retval > 0 ||
+        (packet_size > ETHER_DATA_LEN &&
+         !(off && off->gso_size &&
+           (ether_handle2caps(route.r_iface_handle) & ETHER_CAP_TSO)))) {
+        if (!(m = mbuf_alloc()))
+            return -1;
+        ether_iov_copy(mbuf_append(m, bsize), iov, iovcnt);
+        if (retval == 0)
+            return ip_send_mbuf(dst, proto, m, off);
+
+        retval = ip_defer(dst, proto, m->data, m->len, off);
+        mbuf_free(m);
         return retval;
     }
+
+    /*
+     * Only the L4 header is copied behind the IP header, the rest of the
+     * chain is passed to the driver as is.
+     */
+    memcpy(hdr_buf + sizeof(struct ip_hdr), iov[0].iov_base, iov[0].iov_len);
+    chain[0] = (struct iovec){
+        .iov_base = hdr_buf,
+        .iov_len = sizeof(struct ip_hdr) + iov[0].iov_len,
+    };
+    memcpy(chain + 1, iov + 1, (iovcnt - 1) * sizeof(*iov));
+    off = ip_output_hdr((struct ip_hdr *) hdr_buf, &route, dst, proto, chain,
+                        iovcnt, packet_size, off, &ip_off);
+
+    return ether_sendv(route.r_iface_handle, dst_mac, ETHER_PROTO_IPV4, chain,
+                       iovcnt, off);
+}
+
+int ip_send(in_addr_t dst,
+            uint8_t proto,
+            const uint8_t *buf,
+            size_t bsize,
+            const struct ether_offload *off)
+{
+    struct mbuf *m;
+
+    if (bsize > IP_DATA_MAX_BYTES) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!(m = mbuf_alloc()))
+        return -1;
+    memcpy(mbuf_append(m, bsize), buf, bsize);
+
+    return ip_send_mbuf(dst, proto, m, off);
 }
@@ -0,0 +1,327 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IP_CSUM_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define IP_CSUM_NEON
+#endif
+
+#include "nstack_util.h"
+
+#include "nstack_ip.h"
+
+/**
+ * Sum the 16-bit words of a buffer into a 64-bit accumulator.
+ * The words are loaded in the byte order of the CPU, which the one's
+ * complement sum doesn't care about as long as the result is stored back
+ * the same way.
+ */
+typedef uint64_t ip_csum_fn_t(uint64_t acc, const uint8_t *dp, size_t bsize);
+
+/**
+ * Copy a buffer and sum its 16-bit words on the way.
+ */
+typedef uint64_t ip_csum_copy_fn_t(uint64_t acc,
+                                   uint8_t *dst,
+                                   const uint8_t *dp,
+                                   size_t bsize);
+
+/*
+ * Each kernel is written once with a copy flag and a destination; The flag
+ * is a constant in the callers, so the copy costs nothing when it's off and
+ * the data loaded for the sum is stored from the same registers when it's on.
+ */
+#define __ip_csum_body static inline __attribute__((always_inline))
+
+/**
+ * Fold a 64-bit accumulator to 16 bits with end-around carries.
+ */
+static uint32_t ip_csum_fold64(uint64_t acc)
+{
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffff) + (acc >> 16);
+    acc = (acc & 0xffff) + (acc >> 16);
+
+    return acc;
+}
+
+__ip_csum_body uint64_t ip_csum_scalar_body(uint64_t acc,
+                                            const int copy,
+                                            uint8_t *dst,
+                                            const uint8_t *dp,
+                                            size_t bsize)
+{
+    uint64_t v;
+    uint32_t w;
+    uint16_t h;
+
+    /* A carry out of the accumulator is added back in. */
+    while (bsize >= 8) {
+        memcpy(&v, dp, sizeof(v));
+        if (copy) {
+            memcpy(dst, &v, sizeof(v));
+            dst += 8;
+        }
+        acc += v;
+        acc += acc < v;
+        dp += 8;
+        bsize -= 8;
+    }
+    if (bsize >= 4) {
+        memcpy(&w, dp, sizeof(w));
+        if (copy) {
+            memcpy(dst, &w, sizeof(w));
+            dst += 4;
+        }
+        acc += w;
+        acc += acc < w;
+        dp += 4;
+        bsize -= 4;
+    }
+    if (bsize >= 2) {
+        memcpy(&h, dp, sizeof(h));
+        if (copy) {
+            memcpy(dst, &h, sizeof(h));
+            dst += 2;
+        }
+        acc += h;
+        acc += acc < h;
+        dp += 2;
+        bsize -= 2;
+    }
+    if (bsize) {
+        h = 0;
+        memcpy(&h, dp, 1);
+        if (copy)
+            *dst = *dp;
+        acc += h;
+        acc += acc < h;
+    }
+
+    return acc;
+}
+
+static uint64_t ip_csum_scalar(uint64_t acc, const uint8_t *dp, size_t bsize)
+{
+    return ip_csum_scalar_body(acc, 0, NULL, dp, bsize);
+}
+
+static uint64_t ip_csum_copy_scalar(uint64_t acc,
+                                    uint8_t *dst,
+                                    const uint8_t *dp,
+                                    size_t bsize)
+{
+    return ip_csum_scalar_body(acc, 1, dst, dp, bsize);
+}
+
+/*
+ * The vector kernels add the 16-bit words to 32-bit lanes, which could
+ * overflow after 0x10000 words, so the lanes are flushed to the 64-bit
+ * accumulator every IP_CSUM_VEC_BLOCK bytes.
+ */
+#define IP_CSUM_VEC_BLOCK 0x20000
+
+/*
+ * Bytes of a buffer the next block of a vector kernel covers.
+ */
+#define IP_CSUM_VEC_LEN(_bsize_, _align_)                              \
+    (((_bsize_) < IP_CSUM_VEC_BLOCK ? (_bsize_) : IP_CSUM_VEC_BLOCK) & \
+     ~(size_t) ((_align_) - 1))
+
+#ifdef IP_CSUM_X86
+__attribute__((target("sse2"))) __ip_csum_body uint64_t ip_csum_sse2_body(
+    uint64_t acc,
+    const int copy,
+    uint8_t *dst,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    while (bsize >= 16) {
+        const size_t n = IP_CSUM_VEC_LEN(bsize, 16);
+        __m128i lanes = zero;
+        uint32_t part[4];
+
+        for (size_t i = 0; i < n; i += 16) {
+            const __m128i x = _mm_loadu_si128((const __m128i *) (dp + i));
+
+            if (copy)
+                _mm_storeu_si128((__m128i *) (dst + i), x);
+            lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(x, zero));
+            lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(x, zero));
+        }
+        _mm_storeu_si128((__m128i *) part, lanes);
+        acc += (uint64_t) part[0] + part[1] + part[2] + part[3];
+        dst += copy ? n : 0;
+        dp += n;
+        bsize -= n;
+    }
+
+    return ip_csum_scalar_body(acc, copy, dst, dp, bsize);
+}
+
+__attribute__((target("sse2"))) static uint64_t ip_csum_sse2(
+    uint64_t acc,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    return ip_csum_sse2_body(acc, 0, NULL, dp, bsize);
+}
+
+__attribute__((target("sse2"))) static uint64_t ip_csum_copy_sse2(
+    uint64_t acc,
+    uint8_t *dst,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    return ip_csum_sse2_body(acc, 1, dst, dp, bsize);
+}
+
+__attribute__((target("avx2"))) __ip_csum_body uint64_t ip_csum_avx2_body(
+    uint64_t acc,
+    const int copy,
+    uint8_t *dst,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (bsize >= 32) {
+        const size_t n = IP_CSUM_VEC_LEN(bsize, 32);
+        __m256i lanes = zero;
+        uint32_t part[8];
+
+        for (size_t i = 0; i < n; i += 32) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *) (dp + i));
+
+            if (copy)
+                _mm256_storeu_si256((__m256i *) (dst + i), x);
+            lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(x, zero));
+            lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(x, zero));
+        }
+        _mm256_storeu_si256((__m256i *) part, lanes);
+        for (int i = 0; i < 8; i++)
+            acc += part[i];
+        dst += copy ? n : 0;
+        dp += n;
+        bsize -= n;
+    }
+
+    return ip_csum_sse2_body(acc, copy, dst, dp, bsize);
+}
+
+__attribute__((target("avx2"))) static uint64_t ip_csum_avx2(
+    uint64_t acc,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    return ip_csum_avx2_body(acc, 0, NULL, dp, bsize);
+}
+
+__attribute__((target("avx2"))) static uint64_t ip_csum_copy_avx2(
+    uint64_t acc,
+    uint8_t *dst,
+    const uint8_t *dp,
+    size_t bsize)
+{
+    return ip_csum_avx2_body(acc, 1, dst, dp, bsize);
+}
+#endif
+
+#ifdef IP_CSUM_NEON
+__ip_csum_body uint64_t ip_csum_neon_body(uint64_t acc,
+                                          const int copy,
+                                          uint8_t *dst,
+                                          const uint8_t *dp,
+                                          size_t bsize)
+{
+    while (bsize >= 16) {
+        const size_t n = IP_CSUM_VEC_LEN(bsize, 16);
+        uint32x4_t lanes = vdupq_n_u32(0);
+
+        /* Pairwise add of the words to the 32-bit lanes. */
+        for (size_t i = 0; i < n; i += 16) {
+            const uint16x8_t x = vld1q_u16((const uint16_t *) (dp + i));
+
+            if (copy)
+                vst1q_u16((uint16_t *) (dst + i), x);
+            lanes = vpadalq_u16(lanes, x);
+        }
+        acc += vaddlvq_u32(lanes);
+        dst += copy ? n : 0;
+        dp += n;
+        bsize -= n;
+    }
+
+    return ip_csum_scalar_body(acc, copy, dst, dp, bsize);
+}
+
+static uint64_t ip_csum_neon(uint64_t acc, const uint8_t *dp, size_t bsize)
+{
+    return ip_csum_neon_body(acc, 0, NULL, dp, bsize);
+}
+
+static uint64_t ip_csum_copy_neon(uint64_t acc,
+                                  uint8_t *dst,
+                                  const uint8_t *dp,
+                                  size_t bsize)
+{
+    return ip_csum_neon_body(acc, 1, dst, dp, bsize);
+}
+#endif
+
+static ip_csum_fn_t *ip_csum_fn = ip_csum_scalar;
+static ip_csum_copy_fn_t *ip_csum_copy_fn = ip_csum_copy_scalar;
+
+__constructor static void ip_csum_init(void)
+{
+#if defined(IP_CSUM_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ip_csum_fn = ip_csum_avx2;
+        ip_csum_copy_fn = ip_csum_copy_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        ip_csum_fn = ip_csum_sse2;
+        ip_csum_copy_fn = ip_csum_copy_sse2;
+    }
+#elif defined(IP_CSUM_NEON)
+    if (getauxval(AT_HWCAP) & HWCAP_ASIMD) {
+        ip_csum_fn = ip_csum_neon;
+        ip_csum_copy_fn = ip_csum_copy_neon;
+    }
+#endif
+}
+
+uint32_t ip_csum_partial(const void *dp, size_t bsize, uint32_t sum)
+{
+    return ip_csum_fold64(ip_csum_fn(sum, dp, bsize));
+}
+
+uint32_t ip_csum_copy(void *dst, const void *src, size_t bsize, uint32_t sum)
+{
+    return ip_csum_fold64(ip_csum_copy_fn(sum, dst, src, bsize));
+}
+
+uint32_t ip_csum_pseudo(in_addr_t src,
+                        in_addr_t dst,
+                        uint8_t proto,
+                        size_t bsize)
+{
+    uint64_t sum = (uint64_t) src + dst + proto + bsize;
+
+    /* Summed in host byte order, then swapped to the order of the loads. */
+    return htons(ip_csum_fold64(sum));
+}
+
+uint16_t ip_checksum(const void *dp, size_t bsize)
+{
+    return ip_csum_fold(ip_csum_partial(dp, bsize, 0));
+}
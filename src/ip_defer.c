@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "nstack_in.h"
@@ -7,11 +8,14 @@
 #include "nstack_ether.h"
 #include "nstack_internal.h"
 #include "nstack_ip.h"
+#include "nstack_timer.h"
 
 struct ip_defer {
     int tries;
     in_addr_t dst;
     uint8_t proto;
+    bool offload; /* off is in use. */
+    struct ether_offload off;
     size_t buf_size;
     uint8_t buf[IP_DATA_MAX_BYTES];
 };
@@ -20,36 +24,55 @@ struct ip_defer {
  * This is used to inhibit defers if it's the ip deferring code itself causing
  * defer push.
  */
-static bool defer_inhibit = false;
+static __thread bool defer_inhibit = false;
+
+static void ip_defer_timeout(struct nstack_timer *timer, void *arg);
 
 static struct ip_defer ip_defer_queue[NSTACK_IP_DEFER_MAX];
 static size_t q_rd, q_wr;
+static struct nstack_timer_wheel ip_defer_timers;
+static struct nstack_timer ip_defer_timer =
+    NSTACK_TIMER_INITIALIZER(ip_defer_timeout, NULL);
+/* Protects the queue and the retry timer. */
+static pthread_mutex_t ip_defer_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int ip_defer_push(in_addr_t dst,
                   uint8_t proto,
                   const uint8_t *buf,
-                  size_t bsize)
+                  size_t bsize,
+                  const struct ether_offload *off)
 {
-    const size_t next = (q_wr + 1) % num_elem(ip_defer_queue);
+    size_t next;
     struct ip_defer *slot;
 
     if (defer_inhibit)
         return -EALREADY;
 
-    if (next == q_rd)
-        return -ENOBUFS;
-    slot = ip_defer_queue + q_wr;
-
     if (bsize > IP_DATA_MAX_BYTES)
         return -EMSGSIZE;
 
+    pthread_mutex_lock(&ip_defer_lock);
+    next = (q_wr + 1) % num_elem(ip_defer_queue);
+    if (next == q_rd) {
+        pthread_mutex_unlock(&ip_defer_lock);
+        return -ENOBUFS;
+    }
+    slot = ip_defer_queue + q_wr;
+
     slot->tries = 0;
     slot->dst = dst;
     slot->proto = proto;
+    slot->offload = !!off;
+    if (off)
+        slot->off = *off;
     slot->buf_size = bsize;
     memcpy(slot->buf, buf, bsize);
 
     q_wr = next;
+    if (!nstack_timer_pending(&ip_defer_timer))
+        nstack_timer_arm(&ip_defer_timers, &ip_defer_timer,
+                         NSTACK_TIMER_MSEC(NSTACK_IP_DEFER_RETRY_MSEC));
+    pthread_mutex_unlock(&ip_defer_lock);
     return 0;
 }
 
@@ -69,15 +92,17 @@ static void ip_defer_drop(void)
     q_rd = (q_rd + 1) % num_elem(ip_defer_queue);
 }
 
-void ip_defer_handler(int delta_time __unused)
+/**
+ * Retry the deferred packets.
+ * Must be called with ip_defer_lock held.
+ */
+static void ip_defer_retry(void)
 {
     defer_inhibit = true;
     while (1) {
         struct ip_defer *ipd = ip_defer_peek();
-        if (!ipd) {
-            defer_inhibit = false;
-            return;
-        }
+        if (!ipd)
+            break;
 
         if (ipd->tries++ > 3) { /* Drop the packet after couple of tries. */
             char str_ip[IP_STR_LEN];
@@ -88,14 +113,41 @@ void ip_defer_handler(int delta_time __unused)
             continue;
         }
 
-        if (ip_send(ipd->dst, ipd->proto, ipd->buf, ipd->buf_size) == -1) {
+        if (ip_send(ipd->dst, ipd->proto, ipd->buf, ipd->buf_size,
+                    ipd->offload ? &ipd->off : NULL) == -1) {
             if (errno == EHOSTUNREACH) {
                 ipd->tries++; /* Try again later. */
-                defer_inhibit = false;
-                return;
+                break;
             }
         }
         ip_defer_drop();
     }
+    defer_inhibit = false;
+
+    if (ip_defer_peek() && !nstack_timer_pending(&ip_defer_timer))
+        nstack_timer_arm(&ip_defer_timers, &ip_defer_timer,
+                         NSTACK_TIMER_MSEC(NSTACK_IP_DEFER_RETRY_MSEC));
+}
+
+static void ip_defer_timeout(struct nstack_timer *timer, void *arg)
+{
+    ip_defer_retry();
+}
+
+void ip_defer_handler(void)
+{
+    /* Someone else is already retrying the deferred packets. */
+    if (pthread_mutex_trylock(&ip_defer_lock))
+        return;
+
+    ip_defer_retry();
+    pthread_mutex_unlock(&ip_defer_lock);
+}
+
+static void ip_defer_task(uint64_t now)
+{
+    pthread_mutex_lock(&ip_defer_lock);
+    nstack_timer_run(&ip_defer_timers, now);
+    pthread_mutex_unlock(&ip_defer_lock);
 }
-NSTACK_PERIODIC_TASK(ip_defer_handler);
+NSTACK_PERIODIC_TASK(ip_defer_task);
@@ -7,14 +7,20 @@
 
 #pragma once
 
+#include "nstack_ether.h"
 #include "nstack_in.h"
 
 int ip_defer_push(in_addr_t dst,
                   uint8_t proto,
                   const uint8_t *buf,
-                  size_t bsize);
+                  size_t bsize,
+                  const struct ether_offload *off);
 
-void ip_defer_handler(int delta_time);
+/**
+ * Retry the transmission of the deferred packets.
+ * The packets are also retried every NSTACK_IP_DEFER_RETRY_MSEC.
+ */
+void ip_defer_handler(void);
 
 /**
  * @}
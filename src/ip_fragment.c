@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -6,7 +7,9 @@
 #include "nstack_in.h"
 
 #include "logger.h"
+#include "nstack_internal.h"
 #include "nstack_ip.h"
+#include "nstack_timer.h"
 #include "tree.h"
 
 #define FRAG_MAX 8192
@@ -20,7 +23,7 @@ struct fragment_map {
 
 struct packet_buf {
     int reserved;
-    int timer;
+    struct nstack_timer timer; /*!< Gives up the reassembly. */
     struct fragment_map fragmap;
     struct ip_hdr ip_hdr;
     uint8_t payload[IP_MAX_BYTES];
@@ -31,10 +34,13 @@ RB_HEAD(packet_buf_tree, packet_buf);
 
 static struct packet_buf packet_buffer[4];
 static struct packet_buf_tree packet_buffer_head = RB_INITIALIZER();
+static struct nstack_timer_wheel packet_buffer_timers;
 
 /*
- * TODO Timer for giving up
+ * Protects the packet buffers and their timers. Held while a reassembled
+ * packet is processed so the timer can't release the buffer under us.
  */
+static pthread_mutex_t packet_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int packet_buf_cmp(struct packet_buf *a, struct packet_buf *b)
 {
@@ -88,10 +94,17 @@ static inline int fragmap_tst(struct fragment_map *map, unsigned i)
 
 static inline void release_packet_buffer(struct packet_buf *p)
 {
+    nstack_timer_cancel(&packet_buffer_timers, &p->timer);
     RB_REMOVE(packet_buf_tree, &packet_buffer_head, p);
     __sync_lock_release(&p->reserved);
 }
 
+static void packet_buffer_timeout(struct nstack_timer *timer, void *arg)
+{
+    LOG(LOG_DEBUG, "Fragment reassembly timed out");
+    release_packet_buffer(arg);
+}
+
 struct packet_buf *get_packet_buffer(struct ip_hdr *hdr)
 {
     struct packet_buf find = {
@@ -119,7 +132,9 @@ struct packet_buf *get_packet_buffer(struct ip_hdr *hdr)
 
         if (old == 0) {
             fragmap_init(&p->fragmap);
-            p->timer = NSTACK_IP_FRAGMENT_TLB;
+            nstack_timer_init(&p->timer, packet_buffer_timeout, p);
+            nstack_timer_arm(&packet_buffer_timers, &p->timer,
+                             NSTACK_TIMER_SEC(NSTACK_IP_FRAGMENT_TLB));
             p->ip_hdr = *hdr; /* RFE Clear things that aren't needed. */
             p->ip_hdr.ip_foff = 0;
             p->ip_hdr.ip_len = 0;
@@ -146,8 +161,10 @@ int ip_fragment_input(struct ip_hdr *ip_hdr, uint8_t *rx_packet)
     if (off > IP_MAX_BYTES)
         return -EMSGSIZE;
 
+    pthread_mutex_lock(&packet_buffer_lock);
     p = get_packet_buffer(ip_hdr);
     if (!p) {
+        pthread_mutex_unlock(&packet_buffer_lock);
         LOG(LOG_WARN, "Out of fragment buffers");
         return -ENOBUFS;
     }
@@ -182,7 +199,7 @@ int ip_fragment_input(struct ip_hdr *ip_hdr, uint8_t *rx_packet)
 
             ip_ntoh(&p->ip_hdr, &p->ip_hdr);
             retval = ip_send(p->ip_hdr.ip_dst, p->ip_hdr.ip_proto, p->payload,
-                             retval);
+                             retval, NULL);
             if (retval < 0) {
                 LOG(LOG_ERR, "Failed to send fragments");
             }
@@ -198,21 +215,15 @@ int ip_fragment_input(struct ip_hdr *ip_hdr, uint8_t *rx_packet)
 #if 0
     p->timer = imax(ip->ip_hdr.ip_ttl, p->timer);
 #endif
+    pthread_mutex_unlock(&packet_buffer_lock);
 
     return 0;
 }
 
-void ip_fragment_timer(int delta_time)
+static void ip_fragment_timer(uint64_t now)
 {
-    for (size_t i = 0; i < num_elem(packet_buffer); i++) {
-        struct packet_buf *p = &packet_buffer[i];
-
-        /* TODO not actually as thread safe as the allocation. */
-        if (!p->reserved)
-            continue;
-
-        p->timer -= delta_time;
-        if (p->timer <= 0)
-            release_packet_buffer(p);
-    }
+    pthread_mutex_lock(&packet_buffer_lock);
+    nstack_timer_run(&packet_buffer_timers, now);
+    pthread_mutex_unlock(&packet_buffer_lock);
 }
+NSTACK_PERIODIC_TASK(ip_fragment_timer);
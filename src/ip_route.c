@@ -8,6 +8,11 @@
 #include "nstack_ip.h"
 #include "tree.h"
 
+/*
+ * A network route is in rib_routetree, and the address of an interface in
+ * rib_sourcetree, each in its own entry, so that interfaces on the same
+ * network share a route but keep their own addresses.
+ */
 struct ip_route_entry {
     struct ip_route route;
     RB_ENTRY(ip_route_entry) _rib_rtree_entry; /*!< Network tree. */
@@ -48,12 +53,17 @@ RB_GENERATE_STATIC(rib_sourcetree,
 
 /**
  * Get a new route entry from the free list.
+ * @returns Returns NULL and errno is set to ENOMEM if the RIB is full.
  */
 static struct ip_route_entry *ip_route_entry_alloc(void)
 {
     struct ip_route_entry *entry;
 
     entry = SLIST_FIRST(&rib_freelist);
+    if (!entry) {
+        errno = ENOMEM;
+        return NULL;
+    }
     SLIST_REMOVE_HEAD(&rib_freelist, _rib_freelist_entry);
 
     return entry;
@@ -64,50 +74,41 @@ static struct ip_route_entry *ip_route_entry_alloc(void)
  */
 static void ip_route_entry_free(struct ip_route_entry *entry)
 {
+    memset(entry, 0, sizeof(struct ip_route_entry));
     SLIST_INSERT_HEAD(&rib_freelist, entry, _rib_freelist_entry);
 }
 
-static void ip_route_tree_insert(struct ip_route_entry *entry)
-{
-    RB_INSERT(rib_routetree, &rib_routetree, entry);
-    RB_INSERT(rib_sourcetree, &rib_sourcetree, entry);
-}
-
-static void ip_route_tree_remove(struct ip_route_entry *entry)
+int ip_route_update(struct ip_route *route)
 {
-    RB_REMOVE(rib_routetree, &rib_routetree, entry);
-    RB_REMOVE(rib_sourcetree, &rib_sourcetree, entry);
-}
+    struct ip_route_entry *net, *src;
 
-static int ip_route_add(struct ip_route *route)
-{
-    struct ip_route_entry *entry;
+    net =
+        RB_FIND(rib_routetree, &rib_routetree, (struct ip_route_entry *) route);
+    src = RB_FIND(rib_sourcetree, &rib_sourcetree,
+                  (struct ip_route_entry *) route);
 
-    entry = ip_route_entry_alloc();
-    if (!entry) {
+    if (net) { /* Update an existing entry. */
+        RB_REMOVE(rib_routetree, &rib_routetree, net);
+    } else if (!(net = ip_route_entry_alloc())) {
+        return -1;
+    } else if (!src && SLIST_EMPTY(&rib_freelist)) {
+        ip_route_entry_free(net);
         errno = ENOMEM;
         return -1;
     }
+    net->route = *route;
+    RB_INSERT(rib_routetree, &rib_routetree, net);
 
-    entry->route = *route;
-    ip_route_tree_insert(entry);
-
-    return 0;
-}
-
-int ip_route_update(struct ip_route *route)
-{
-    struct ip_route_entry *entry;
-
-    entry =
-        RB_FIND(rib_routetree, &rib_routetree, (struct ip_route_entry *) route);
-    if (entry) { /* Update an existing entry. */
-        ip_route_tree_remove(entry);
-        entry->route = *route;
-        ip_route_tree_insert(entry);
-    } else { /* Route not found so we insert it. */
-        if (ip_route_add(route))
+    if (!src) {
+        if (!(src = ip_route_entry_alloc())) {
+            RB_REMOVE(rib_routetree, &rib_routetree, net);
+            ip_route_entry_free(net);
             return -1;
+        }
+        src->route = *route;
+        RB_INSERT(rib_sourcetree, &rib_sourcetree, src);
+    } else {
+        src->route = *route;
     }
 
     return 0;
@@ -117,13 +118,19 @@ int ip_route_remove(struct ip_route *route)
 {
     struct ip_route_entry *entry =
         RB_FIND(rib_routetree, &rib_routetree, (struct ip_route_entry *) route);
+    struct ip_route_entry *src;
+
     if (!entry) {
         errno = ENOENT;
         return -1;
     }
 
-    ip_route_tree_remove(entry);
-    memset(entry, 0, sizeof(struct ip_route_entry));
+    src = RB_FIND(rib_sourcetree, &rib_sourcetree, entry);
+    if (src && src->route.r_iface_handle == entry->route.r_iface_handle) {
+        RB_REMOVE(rib_sourcetree, &rib_sourcetree, src);
+        ip_route_entry_free(src);
+    }
+    RB_REMOVE(rib_routetree, &rib_routetree, entry);
     ip_route_entry_free(entry);
 
     return 0;
@@ -183,6 +190,16 @@ int ip_route_find_by_iface(in_addr_t addr, struct ip_route *route)
     return 0;
 }
 
+unsigned ip_route_caps(in_addr_t addr)
+{
+    struct ip_route route;
+
+    if (ip_route_find_by_network(addr, &route))
+        return 0;
+
+    return ether_handle2caps(route.r_iface_handle);
+}
+
 __constructor void ip_route_init(void)
 {
     RB_INIT(&rib_routetree);
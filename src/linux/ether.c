@@ -1,29 +1,118 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <linux/filter.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "nstack_util.h"
 
 #include "../logger.h"
 #include "../nstack_ether.h"
+#include "vnet_hdr.h"
 
 #define DEFAULT_IF "eth0"
-#define ETHER_MAX_IF 1
+#define ETHER_MAX_IF NSTACK_ETHER_MAX_IF
+#define ETHER_MAX_QUEUES 16
+
+#define ETHER_TX_FRAME_SIZE 2048
+#define ETHER_RX_HEADROOM 2 /*!< Aligns the payload after the header. */
+
+/**
+ * TPACKET_V3 RX ring.
+ */
+struct ether_linux_ring {
+    uint8_t *map;              /*!< Mapped ring or NULL if not in use. */
+    struct tpacket_req3 req;   /*!< Ring geometry. */
+    unsigned block;            /*!< Index of the current block. */
+    struct tpacket3_hdr *next; /*!< Next frame in the current block. */
+    struct tpacket3_hdr next_hdr; /*!< Copy of *next. */
+    unsigned frames_left;         /*!< Frames left in the current block. */
+    unsigned lent; /*!< Frames of the current block not yet released. */
+};
+
+/**
+ * TPACKET_V3 TX ring.
+ */
+struct ether_linux_txring {
+    uint8_t *map;            /*!< Mapped ring or NULL if not in use. */
+    struct tpacket_req3 req; /*!< Ring geometry. */
+    unsigned head;           /*!< Index of the next free frame. */
+    unsigned pending;        /*!< Frames waiting for a flush. */
+};
+
+/**
+ * sendmmsg() TX batch used if there is no TX ring.
+ */
+struct ether_linux_txbatch {
+    unsigned count;
+    struct mmsghdr msg[NSTACK_ETHER_TX_BATCH];
+    struct iovec iov[NSTACK_ETHER_TX_BATCH];
+    struct sockaddr_ll addr[NSTACK_ETHER_TX_BATCH];
+    uint8_t frame[NSTACK_ETHER_TX_BATCH]
+                 [sizeof(struct virtio_net_hdr) + ETHER_MAXLEN + ETHER_FCS_LEN]
+        __attribute__((aligned));
+};
+
+/**
+ * RX wakeup statistics, kept if the rx_stats option is set.
+ */
+struct ether_linux_rxstats {
+    uint64_t start;       /*!< Time the queue was opened [ns]. */
+    uint64_t frames;      /*!< Frames received. */
+    uint64_t spin_hits;   /*!< Frames found while spinning. */
+    uint64_t sleeps;      /*!< Waits that blocked in the kernel. */
+    uint64_t spin_ns;     /*!< Time spent spinning. */
+    uint64_t latency_ns;  /*!< Sum of the kernel to ingress thread latencies. */
+    uint64_t latency_max; /*!< Max latency [ns]. */
+};
+
+/**
+ * RX queue.
+ * Each queue has its own socket; if there are more than one queue the
+ * sockets are joined to a PACKET_FANOUT group.
+ */
+struct ether_linux_queue {
+    int fd;
+    uint8_t *map;    /*!< Mapping of the RX and TX rings. */
+    size_t map_size; /*!< Size of map. */
+    struct ether_linux_ring rx_ring;
+    int nonblock; /*!< Don't wait for frames, the caller uses epoll. */
+    struct ether_linux_rxstats stats;
+    /**
+     * Receive buffers used without an RX ring, or if a ring frame has no
+     * tailroom left; One for each frame of a burst.
+     */
+    uint8_t rx_buffer[NSTACK_ETHER_RX_BURST]
+                     [ETHER_RX_HEADROOM + ETHER_MAXLEN + ETHER_RX_TAILROOM]
+        __attribute__((aligned));
+};
 
 struct ether_linux {
-    int el_fd;
     mac_addr_t el_mac;
     struct ifreq el_if_idx;
+    unsigned el_caps; /*!< ETHER_CAP_ flags. */
+    size_t el_vnet_len; /*!< Size of the virtio-net header or 0 if unused. */
+    unsigned el_busy_poll; /*!< Busy-poll budget [us] or 0 if not used. */
+    int el_rx_stats;       /*!< Keep the RX wakeup statistics. */
+    unsigned el_nr_queues;
+    struct ether_linux_queue el_queue[ETHER_MAX_QUEUES];
+    pthread_mutex_t el_tx_lock;
+    struct ether_linux_txring el_tx_ring; /*!< TX ring of the first queue. */
+    struct ether_linux_txbatch el_tx_batch;
 };
 
 static struct ether_linux ether_if[ETHER_MAX_IF];
@@ -31,7 +120,7 @@ static int ether_next_handle;
 
 static struct ether_linux *ether_handle2eth(int handle)
 {
-    if (handle >= ETHER_MAX_IF) {
+    if (handle < 0 || handle >= ether_next_handle) {
         errno = ENODEV;
         return NULL;
     }
@@ -51,12 +140,56 @@ int ether_handle2addr(int handle, mac_addr_t addr)
     return 0;
 }
 
-int ether_addr2handle(const mac_addr_t addr __unused)
+unsigned ether_handle2caps(int handle)
 {
-    return 0; /* TODO Implementation of ether_get_handle() */
+    struct ether_linux *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return 0;
+
+    return eth->el_caps;
 }
 
-static int linux_ether_bind(struct ether_linux *eth)
+unsigned ether_handle2queues(int handle)
+{
+    struct ether_linux *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return 0;
+
+    return eth->el_nr_queues;
+}
+
+int ether_handle2fd(int handle, unsigned queue)
+{
+    struct ether_linux *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue >= eth->el_nr_queues) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The socket is left blocking as it's also used for TX. */
+    eth->el_queue[queue].nonblock = 1;
+    return eth->el_queue[queue].fd;
+}
+
+int ether_addr2handle(const mac_addr_t addr)
+{
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        if (!memcmp(ether_if[handle].el_mac, addr, sizeof(mac_addr_t)))
+            return handle;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+static int linux_ether_bind(struct ether_linux *eth,
+                            struct ether_linux_queue *q)
 {
     struct ifreq ifopts = {0};
     struct sockaddr_ll socket_address = {0};
@@ -64,12 +197,12 @@ static int linux_ether_bind(struct ether_linux *eth)
 
     /* Set the interface to promiscuous mode. */
     strncpy(ifopts.ifr_name, eth->el_if_idx.ifr_name, IFNAMSIZ - 1);
-    ioctl(eth->el_fd, SIOCGIFFLAGS, &ifopts);
+    ioctl(q->fd, SIOCGIFFLAGS, &ifopts);
     ifopts.ifr_flags |= IFF_PROMISC;
-    ioctl(eth->el_fd, SIOCSIFFLAGS, &ifopts);
+    ioctl(q->fd, SIOCSIFFLAGS, &ifopts);
     /* Allow the socket to be reused. */
-    retval = setsockopt(eth->el_fd, SOL_SOCKET, SO_REUSEADDR, &sockopt,
-                        sizeof(sockopt));
+    retval =
+        setsockopt(q->fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
     if (retval == -1)
         return -1;
 
@@ -87,28 +220,543 @@ static int linux_ether_bind(struct ether_linux *eth)
     socket_address.sll_addr[4] = eth->el_mac[4],
     socket_address.sll_addr[5] = eth->el_mac[5],
     socket_address.sll_hatype = 0x0000;
-    bind(eth->el_fd, (struct sockaddr *) &socket_address,
-         sizeof(socket_address));
+    bind(q->fd, (struct sockaddr *) &socket_address, sizeof(socket_address));
 
     return 0;
 }
 
-static int linux_ether_set_rxtimeout(struct ether_linux *eth)
+static int linux_ether_set_rxtimeout(struct ether_linux_queue *q)
 {
     struct timeval tv = {
         .tv_sec = NSTACK_PERIODIC_EVENT_SEC,
     };
 
-    return setsockopt(eth->el_fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv,
+    return setsockopt(q->fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv,
                       sizeof(struct timeval));
 }
 
+/**
+ * Setup busy-polling and the RX timestamps used by the statistics.
+ * SO_BUSY_POLL makes the kernel also poll the device while we wait for a
+ * frame; the spinning itself is done in userspace, so the option is not
+ * required.
+ */
+static int linux_ether_set_rxpoll(struct ether_linux *eth,
+                                  struct ether_linux_queue *q)
+{
+    const int busy_poll = eth->el_busy_poll;
+    const int on = 1;
+
+    if (busy_poll &&
+        setsockopt(q->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(busy_poll)) &&
+        errno != ENOPROTOOPT)
+        return -1;
+
+    /* The RX ring has the timestamps in the frame headers. */
+    if (eth->el_rx_stats && !q->rx_ring.map &&
+        setsockopt(q->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Attach a socket filter accepting only frames for us.
+ * The interface is in promiscuous mode, so without the filter every frame
+ * on the segment, including the frames we send ourselves, would be copied
+ * to userspace. Frames sent from our MAC are dropped; ARP, group addressed
+ * (broadcast and multicast) and frames sent to our MAC are accepted.
+ */
+static int linux_ether_filter(struct ether_linux *eth,
+                              struct ether_linux_queue *q)
+{
+    const uint8_t *mac = eth->el_mac;
+    const uint32_t mac_hi =
+        (uint32_t) mac[0] << 24 | mac[1] << 16 | mac[2] << 8 | mac[3];
+    const uint32_t mac_lo = mac[4] << 8 | mac[5];
+    struct sock_filter code[] = {
+        /* Drop if h_src is our MAC. */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_hi, 0, 2),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 10),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_lo, 9, 0),
+        /* Accept ARP. */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHER_PROTO_ARP, 6, 0),
+        /* Accept broadcast and multicast. */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x01, 4, 0),
+        /* Accept if h_dst is our MAC. */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_hi, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac_lo, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    const struct sock_fprog prog = {
+        .len = num_elem(code),
+        .filter = code,
+    };
+
+    return setsockopt(q->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                      sizeof(prog));
+}
+
+/**
+ * Join the queue to the PACKET_FANOUT group of the interface.
+ * Frames are distributed by the flow hash, so all frames of a flow are
+ * received by the same queue. IP fragments carry no ports and they are
+ * hashed by the addresses only, thus fragments of a datagram end up in the
+ * same queue as well.
+ */
+static int linux_ether_fanout(struct ether_linux *eth,
+                              struct ether_linux_queue *q)
+{
+    const int id = (getpid() ^ eth->el_if_idx.ifr_ifindex) & 0xffff;
+    const int fanout = id | (PACKET_FANOUT_HASH << 16);
+
+    return setsockopt(q->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                      sizeof(fanout));
+}
+
+static unsigned linux_ether_arg(char *const args[],
+                                const char *name,
+                                unsigned def)
+{
+    const char *value = ether_arg(args, name);
+
+    return value ? (unsigned) strtoul(value, NULL, 0) : def;
+}
+
+/**
+ * Setup TPACKET_V3 RX and TX rings for the socket of a queue.
+ * A ring is only set up if its number of blocks or frames is non-zero.
+ * Only the first queue has a TX ring.
+ */
+static int linux_ether_rings(struct ether_linux *eth,
+                             struct ether_linux_queue *q,
+                             char *const args[])
+{
+    struct tpacket_req3 *rx = &q->rx_ring.req;
+    struct tpacket_req3 tx_req = {0};
+    struct tpacket_req3 *tx =
+        (q == &eth->el_queue[0]) ? &eth->el_tx_ring.req : &tx_req;
+    const unsigned tx_frames =
+        linux_ether_arg(args, "tx_frames", NSTACK_ETHER_TX_RING_FRAMES);
+    const unsigned page_size = sysconf(_SC_PAGESIZE);
+    const int version = TPACKET_V3;
+    const int loss = 1;
+    void *map;
+
+    *rx = (struct tpacket_req3){
+        .tp_block_size = linux_ether_arg(args, "rx_block_size",
+                                         NSTACK_ETHER_RX_BLOCK_SIZE),
+        .tp_block_nr =
+            linux_ether_arg(args, "rx_blocks", NSTACK_ETHER_RX_BLOCK_NR),
+        .tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + ETHER_MAXLEN),
+        .tp_retire_blk_tov =
+            linux_ether_arg(args, "rx_block_tmo", NSTACK_ETHER_RX_BLOCK_TMO),
+    };
+    if (rx->tp_block_nr > 0) {
+        if (rx->tp_block_size < rx->tp_frame_size) {
+            errno = EINVAL;
+            return -1;
+        }
+        rx->tp_frame_nr =
+            (rx->tp_block_size / rx->tp_frame_size) * rx->tp_block_nr;
+    }
+
+    *tx = (struct tpacket_req3){
+        .tp_block_size = max(page_size, ETHER_TX_FRAME_SIZE),
+        .tp_frame_size = ETHER_TX_FRAME_SIZE,
+    };
+    if (tx_frames > 0 && tx != &tx_req) {
+        const unsigned per_block = tx->tp_block_size / tx->tp_frame_size;
+
+        tx->tp_block_nr = (tx_frames + per_block - 1) / per_block;
+        tx->tp_frame_nr = tx->tp_block_nr * per_block;
+    }
+
+    if (rx->tp_block_nr == 0 && tx->tp_block_nr == 0)
+        return 0;
+
+    if (setsockopt(q->fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)))
+        return -1;
+    /*
+     * Without PACKET_LOSS the kernel would stop at a malformed frame in the
+     * TX ring and never consume the rest of it. Must be set before the rings.
+     */
+    if (tx->tp_block_nr > 0 &&
+        setsockopt(q->fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)))
+        return -1;
+    if (rx->tp_block_nr > 0 &&
+        setsockopt(q->fd, SOL_PACKET, PACKET_RX_RING, rx, sizeof(*rx)))
+        return -1;
+    if (tx->tp_block_nr > 0 &&
+        setsockopt(q->fd, SOL_PACKET, PACKET_TX_RING, tx, sizeof(*tx)))
+        return -1;
+
+    /* Both rings are mapped with a single mmap(), RX ring first. */
+    q->map_size = (size_t) rx->tp_block_size * rx->tp_block_nr +
+                  (size_t) tx->tp_block_size * tx->tp_block_nr;
+    map = mmap(NULL, q->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    q->map = map;
+
+    if (rx->tp_block_nr > 0) {
+        q->rx_ring.map = map;
+        q->rx_ring.block = 0;
+        q->rx_ring.next = NULL;
+        q->rx_ring.frames_left = 0;
+        q->rx_ring.lent = 0;
+    }
+    if (tx->tp_block_nr > 0) {
+        eth->el_tx_ring.map =
+            q->map + (size_t) rx->tp_block_size * rx->tp_block_nr;
+        eth->el_tx_ring.head = 0;
+        eth->el_tx_ring.pending = 0;
+    }
+
+    return 0;
+}
+
+static void linux_ether_rings_free(struct ether_linux *eth,
+                                   struct ether_linux_queue *q)
+{
+    if (!q->map)
+        return;
+
+    munmap(q->map, q->map_size);
+    q->map = NULL;
+    q->rx_ring.map = NULL;
+    if (q == &eth->el_queue[0])
+        eth->el_tx_ring.map = NULL;
+}
+
+static inline struct tpacket_block_desc *linux_ether_ring_block(
+    struct ether_linux_ring *ring)
+{
+    return (struct tpacket_block_desc *) (ring->map + (size_t) ring->block *
+                                                          ring->req.tp_block_size);
+}
+
+static uint64_t linux_ether_now(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Check if the busy-poll budget that started at spin_start is left.
+ * @param[in,out] spin_start is the start time or 0 if the spinning hasn't
+ *                started yet.
+ * @returns Returns 1 while the budget lasts; 0 once it's spent and the
+ *          caller should block.
+ */
+static int linux_ether_spin(const struct ether_linux *eth,
+                            struct ether_linux_queue *q,
+                            uint64_t *spin_start)
+{
+    const uint64_t now = linux_ether_now(CLOCK_MONOTONIC);
+
+    if (!*spin_start)
+        *spin_start = now;
+    if (now - *spin_start < (uint64_t) eth->el_busy_poll * 1000)
+        return 1;
+
+    if (eth->el_rx_stats) {
+        q->stats.spin_ns += now - *spin_start;
+        q->stats.sleeps++;
+    }
+    *spin_start = 0;
+    return 0;
+}
+
+/**
+ * Account a received frame.
+ * @param[in] spin_start is the start of the spinning that found the frame
+ *            or 0.
+ * @param[in] ts is the time the kernel received the frame.
+ */
+static void linux_ether_rx_stats(struct ether_linux_queue *q,
+                                 uint64_t spin_start,
+                                 const struct timespec *ts)
+{
+    struct ether_linux_rxstats *stats = &q->stats;
+    const uint64_t rx_time = (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+    const uint64_t now = linux_ether_now(CLOCK_REALTIME);
+    const uint64_t latency = (now > rx_time) ? now - rx_time : 0;
+
+    if (spin_start) {
+        stats->spin_ns += linux_ether_now(CLOCK_MONOTONIC) - spin_start;
+        stats->spin_hits++;
+    }
+    stats->frames++;
+    stats->latency_ns += latency;
+    if (latency > stats->latency_max)
+        stats->latency_max = latency;
+}
+
+/**
+ * Get the next frame from the RX ring.
+ * We only poll() if the next block is still owned by the kernel and the
+ * busy-poll budget is spent.
+ * @param[out] frame is set to the frame.
+ * @param[out] frame_hdr is set to a copy of the frame header.
+ * @param[in,out] spin_start is the start of the busy-polling or 0.
+ * @param[in] wait tells whether to wait for a frame.
+ * @returns Returns 1 and sets frame if a frame was received;
+ *          0 if the poll timed out or there was no frame to take without
+ *          waiting; -1 on error.
+ */
+static int linux_ether_ring_next(const struct ether_linux *eth,
+                                 struct ether_linux_queue *q,
+                                 uint8_t **frame,
+                                 struct tpacket3_hdr *frame_hdr,
+                                 uint64_t *spin_start,
+                                 int wait)
+{
+    struct ether_linux_ring *ring = &q->rx_ring;
+
+    /* The block is used up but some of its frames are still lent. */
+    if (ring->next && ring->frames_left == 0)
+        return 0;
+
+    while (!ring->next) {
+        struct tpacket_block_desc *bd = linux_ether_ring_block(ring);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+              TP_STATUS_USER)) {
+            struct pollfd pfd = {
+                .fd = q->fd,
+                .events = POLLIN | POLLERR,
+            };
+            int retval;
+
+            if (!wait || q->nonblock)
+                return 0;
+            if (eth->el_busy_poll && linux_ether_spin(eth, q, spin_start))
+                continue;
+            retval = poll(&pfd, 1, NSTACK_PERIODIC_EVENT_SEC * 1000);
+            if (retval == 0 || (retval == -1 && errno == EINTR))
+                return 0;
+            else if (retval == -1)
+                return -1;
+            continue;
+        }
+
+        ring->frames_left = bd->hdr.bh1.num_pkts;
+        ring->next = (struct tpacket3_hdr *) ((uint8_t *) bd +
+                                              bd->hdr.bh1.offset_to_first_pkt);
+        ring->next_hdr = *ring->next;
+    }
+
+    *frame = (uint8_t *) ring->next;
+    *frame_hdr = ring->next_hdr;
+    /*
+     * The header of the next frame is read now as the caller may overwrite
+     * it with the tailroom of this frame.
+     */
+    if (--ring->frames_left > 0) {
+        ring->next = (struct tpacket3_hdr *) ((uint8_t *) ring->next +
+                                              frame_hdr->tp_next_offset);
+        ring->next_hdr = *ring->next;
+    }
+
+    return 1;
+}
+
+/**
+ * Return the current block to the kernel once all of its frames have been
+ * consumed and released.
+ */
+static void linux_ether_ring_done(struct ether_linux_ring *ring)
+{
+    if (ring->frames_left > 0 || ring->lent > 0)
+        return;
+
+    ring->next = NULL;
+    __atomic_store_n(&linux_ether_ring_block(ring)->hdr.bh1.block_status,
+                     TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->block = (ring->block + 1) % ring->req.tp_block_nr;
+}
+
+static void linux_ether_ring_release(struct ether_frame *frame)
+{
+    struct ether_linux_queue *q = frame->priv;
+
+    q->rx_ring.lent--;
+    linux_ether_ring_done(&q->rx_ring);
+}
+
+static void linux_ether_release(struct ether_frame *frame)
+{
+    /* The frame is in a queue rx_buffer. */
+}
+
+static void linux_ether_lend(struct ether_frame *frame,
+                             uint8_t *buf,
+                             size_t len)
+{
+    const struct ether_hdr *frame_hdr = (struct ether_hdr *) buf;
+
+    memcpy(frame->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+    memcpy(frame->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+    frame->hdr.h_proto = ntohs(frame_hdr->h_proto);
+    frame->data = buf + ETHER_HEADER_LEN;
+    frame->len = len - ETHER_HEADER_LEN;
+}
+
+/**
+ * Handle the virtio-net header of a received frame.
+ * Super-frames merged by GRO don't fit in the receive buffers and they are
+ * dropped.
+ * @returns Returns 0 if the frame is valid; -1 if it should be dropped.
+ */
+static int linux_ether_vnet_rx(const struct ether_linux *eth,
+                               const void *vnet,
+                               uint8_t *buf,
+                               size_t len)
+{
+    struct virtio_net_hdr vh;
+
+    if (!eth->el_vnet_len)
+        return 0;
+
+    memcpy(&vh, vnet, sizeof(vh));
+    if (vh.gso_type != VIRTIO_NET_HDR_GSO_NONE)
+        return -1;
+
+    return vnet_hdr_rx(&vh, buf, len);
+}
+
+/**
+ * Receive a frame from the RX ring.
+ * @param[in] copy_buf is the buffer the frame is copied to if it has no
+ *                     tailroom left in the ring.
+ * @param[in] wait tells whether to wait for a frame.
+ */
+static int linux_ether_ring_receive(struct ether_linux *eth,
+                                    struct ether_linux_queue *q,
+                                    struct ether_frame *frame,
+                                    uint8_t *copy_buf,
+                                    int wait)
+{
+    struct ether_linux_ring *ring = &q->rx_ring;
+    struct tpacket3_hdr frame_hdr;
+    uint8_t *ring_frame, *buf, *end;
+    uint64_t spin_start = 0;
+    int retval;
+
+    /* Our own frames were already dropped by the socket filter. */
+    while (1) {
+        retval = linux_ether_ring_next(eth, q, &ring_frame, &frame_hdr,
+                                       &spin_start, wait);
+        if (retval <= 0)
+            return retval;
+        /* The virtio-net header is right before the frame. */
+        buf = ring_frame + frame_hdr.tp_mac;
+        if (frame_hdr.tp_snaplen >= ETHER_HEADER_LEN &&
+            !linux_ether_vnet_rx(eth, buf - eth->el_vnet_len, buf,
+                                 frame_hdr.tp_snaplen))
+            break;
+        linux_ether_ring_done(ring);
+    }
+
+    /*
+     * The tailroom may overwrite the header of the next frame but not its
+     * data. The last frame of a block is copied if it's too close to the
+     * end of the block.
+     */
+    if (ring->frames_left > 0)
+        end = (uint8_t *) ring->next + ring->next_hdr.tp_mac -
+              eth->el_vnet_len;
+    else
+        end = (uint8_t *) linux_ether_ring_block(ring) +
+              ring->req.tp_block_size;
+    if (buf + frame_hdr.tp_snaplen + ETHER_RX_TAILROOM > end) {
+        memcpy(copy_buf + ETHER_RX_HEADROOM, buf, frame_hdr.tp_snaplen);
+        linux_ether_ring_done(ring);
+        buf = copy_buf + ETHER_RX_HEADROOM;
+        frame->release = linux_ether_release;
+    } else {
+        ring->lent++;
+        frame->release = linux_ether_ring_release;
+    }
+
+    linux_ether_lend(frame, buf, frame_hdr.tp_snaplen);
+    frame->priv = q;
+
+    if (eth->el_rx_stats) {
+        const struct timespec ts = {
+            .tv_sec = frame_hdr.tp_sec,
+            .tv_nsec = frame_hdr.tp_nsec,
+        };
+
+        linux_ether_rx_stats(q, spin_start, &ts);
+    }
+
+    return 1;
+}
+
+static int linux_ether_queue_init(struct ether_linux *eth,
+                                  struct ether_linux_queue *q,
+                                  char *const args[])
+{
+    const int vnet_hdr = 1;
+
+    /* Must be set before the rings. */
+    if (eth->el_vnet_len && setsockopt(q->fd, SOL_PACKET, PACKET_VNET_HDR,
+                                       &vnet_hdr, sizeof(vnet_hdr)))
+        return -1;
+
+    if (linux_ether_rings(eth, q, args))
+        return -1;
+
+    /* The socket doesn't receive anything before it's bound. */
+    if (linux_ether_filter(eth, q))
+        return -1;
+
+    if (linux_ether_bind(eth, q))
+        return -1;
+
+    if (linux_ether_set_rxtimeout(q) || linux_ether_set_rxpoll(eth, q))
+        return -1;
+    memset(&q->stats, 0, sizeof(q->stats));
+    q->stats.start = linux_ether_now(CLOCK_MONOTONIC);
+
+    if (eth->el_nr_queues > 1 && linux_ether_fanout(eth, q))
+        return -1;
+
+    return 0;
+}
+
+static void linux_ether_queues_free(struct ether_linux *eth)
+{
+    for (unsigned i = 0; i < eth->el_nr_queues; i++) {
+        struct ether_linux_queue *q = &eth->el_queue[i];
+
+        if (q->fd == -1)
+            continue;
+        linux_ether_rings_free(eth, q);
+        close(q->fd);
+        q->fd = -1;
+    }
+}
+
 int ether_init(char *const args[])
 {
     const int handle = ether_next_handle;
     struct ether_linux *eth;
     char if_name[IFNAMSIZ];
     struct ifreq if_mac;
+    int fd;
 
     if (handle >= ETHER_MAX_IF) {
         errno = EAGAIN;
@@ -117,7 +765,6 @@ int ether_init(char *const args[])
     eth = &ether_if[handle];
     ether_next_handle++;
 
-    /* TODO Parse args */
     if (args[0]) { /* Non-default IF */
         /* prevent buffer overflow */
         if (strnlen(args[0], IFNAMSIZ) >= IFNAMSIZ)
@@ -127,26 +774,45 @@ int ether_init(char *const args[])
         strcpy(if_name, DEFAULT_IF);
     }
 
-    if ((eth->el_fd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1)
+    eth->el_nr_queues = linux_ether_arg(args, "queues", NSTACK_ETHER_QUEUES);
+    if (eth->el_nr_queues < 1 || eth->el_nr_queues > ETHER_MAX_QUEUES) {
+        errno = EINVAL;
         return -1;
+    }
+    eth->el_caps = linux_ether_arg(args, "fcs", 0) ? ETHER_CAP_SW_FCS : 0;
+    eth->el_vnet_len = 0;
+    if (linux_ether_arg(args, "vnet_hdr", 0)) {
+        eth->el_vnet_len = sizeof(struct virtio_net_hdr);
+        /* Super-frames are sent directly, which a TX ring doesn't allow. */
+        eth->el_caps |= ETHER_CAP_TX_CSUM;
+        if (!linux_ether_arg(args, "tx_frames", NSTACK_ETHER_TX_RING_FRAMES))
+            eth->el_caps |= ETHER_CAP_TSO;
+    }
+    eth->el_busy_poll =
+        linux_ether_arg(args, "busy_poll", NSTACK_ETHER_BUSY_POLL_USEC);
+    eth->el_rx_stats = !!linux_ether_arg(args, "rx_stats", 0);
+    for (unsigned i = 0; i < eth->el_nr_queues; i++) {
+        eth->el_queue[i].fd = -1;
+        eth->el_queue[i].nonblock = 0;
+    }
+
+    for (unsigned i = 0; i < eth->el_nr_queues; i++) {
+        if ((fd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1)
+            goto fail;
+        eth->el_queue[i].fd = fd;
+    }
+    fd = eth->el_queue[0].fd;
 
     /* Get the index of the interface */
     memset(&eth->el_if_idx, 0, sizeof(struct ifreq));
     strncpy(eth->el_if_idx.ifr_name, if_name, IFNAMSIZ - 1);
-    if (ioctl(eth->el_fd, SIOCGIFINDEX, &eth->el_if_idx) < 0)
+    if (ioctl(fd, SIOCGIFINDEX, &eth->el_if_idx) < 0)
         goto fail;
 
     /* Get the MAC address of the interface */
-    if (args[0] && args[1]) { /* MAC addr given by the user */
-        /* TODO Parse MAC addr */
-        errno = ENOTSUP;
-        return -1;
-    }
-
-    /* Use the default MAC addr */
     memset(&if_mac, 0, sizeof(struct ifreq));
     strncpy(if_mac.ifr_name, if_name, IFNAMSIZ - 1);
-    if (ioctl(eth->el_fd, SIOCGIFHWADDR, &if_mac) < 0)
+    if (ioctl(fd, SIOCGIFHWADDR, &if_mac) < 0)
         goto fail;
     eth->el_mac[0] = ((uint8_t *) &if_mac.ifr_hwaddr.sa_data)[0];
     eth->el_mac[1] = ((uint8_t *) &if_mac.ifr_hwaddr.sa_data)[1];
@@ -155,18 +821,45 @@ int ether_init(char *const args[])
     eth->el_mac[4] = ((uint8_t *) &if_mac.ifr_hwaddr.sa_data)[4];
     eth->el_mac[5] = ((uint8_t *) &if_mac.ifr_hwaddr.sa_data)[5];
 
-    if (linux_ether_bind(eth))
-        goto fail;
+    pthread_mutex_init(&eth->el_tx_lock, NULL);
 
-    if (linux_ether_set_rxtimeout(eth))
-        goto fail;
+    for (unsigned i = 0; i < eth->el_nr_queues; i++) {
+        if (linux_ether_queue_init(eth, &eth->el_queue[i], args))
+            goto fail;
+    }
 
     return handle;
 fail:
-    close(eth->el_fd);
+    linux_ether_queues_free(eth);
     return -1;
 }
 
+/**
+ * Report the RX wakeup statistics of a queue.
+ * The time spent spinning is the CPU burned by busy-polling.
+ */
+static void linux_ether_rx_report(const struct ether_linux *eth,
+                                  unsigned queue)
+{
+    const struct ether_linux_rxstats *stats = &eth->el_queue[queue].stats;
+    const uint64_t elapsed = linux_ether_now(CLOCK_MONOTONIC) - stats->start;
+    const unsigned long long latency_avg =
+        stats->frames ? stats->latency_ns / stats->frames / 1000 : 0;
+
+    LOG(LOG_INFO, "%s queue %u: %llu frames, latency avg %llu us max %llu us",
+        eth->el_if_idx.ifr_name, queue, (unsigned long long) stats->frames,
+        latency_avg, (unsigned long long) (stats->latency_max / 1000));
+    if (eth->el_busy_poll) {
+        LOG(LOG_INFO,
+            "%s queue %u: busy-poll %u us, %llu spin hits, %llu sleeps, "
+            "spun %.1f%% of %.1f s",
+            eth->el_if_idx.ifr_name, queue, eth->el_busy_poll,
+            (unsigned long long) stats->spin_hits,
+            (unsigned long long) stats->sleeps,
+            elapsed ? 100.0 * stats->spin_ns / elapsed : 0, elapsed / 1e9);
+    }
+}
+
 void ether_deinit(int handle)
 {
     struct ether_linux *eth;
@@ -174,99 +867,504 @@ void ether_deinit(int handle)
     if (!(eth = ether_handle2eth(handle)))
         return;
 
-    close(eth->el_fd);
+    if (eth->el_rx_stats) {
+        for (unsigned i = 0; i < eth->el_nr_queues; i++)
+            linux_ether_rx_report(eth, i);
+    }
+    linux_ether_queues_free(eth);
 }
 
-int ether_receive(int handle, struct ether_hdr *hdr, uint8_t *buf, size_t bsize)
+/**
+ * Control message of a frame read with SO_TIMESTAMPNS set.
+ */
+union linux_ether_control {
+    struct cmsghdr hdr;
+    uint8_t buf[CMSG_SPACE(sizeof(struct timespec))];
+};
+
+/**
+ * Get the time a frame read with recvmsg() was received by the kernel.
+ */
+static void linux_ether_msg_tstamp(const struct msghdr *msg,
+                                   struct timespec *ts)
 {
-    struct ether_linux *eth;
-    uint8_t frame[ETHER_MAXLEN] __attribute__((aligned));
-    struct ether_hdr *frame_hdr = (struct ether_hdr *) frame;
-    int retval;
+    const struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
 
-    assert(hdr != NULL);
-    assert(buf != NULL);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+    else
+        clock_gettime(CLOCK_REALTIME, ts);
+}
 
-    if (!(eth = ether_handle2eth(handle)))
-        return -1;
+/**
+ * Receive a frame from the socket into the first rx_buffer of the queue.
+ */
+static int linux_ether_recv(struct ether_linux *eth,
+                            struct ether_linux_queue *q,
+                            struct ether_frame *frame)
+{
+    struct virtio_net_hdr vh;
+    union linux_ether_control control;
+    struct msghdr msg;
+    uint64_t spin_start = 0;
+    uint8_t *buf;
+    ssize_t retval;
 
+    /* Our own frames were already dropped by the socket filter. */
+    buf = q->rx_buffer[0] + ETHER_RX_HEADROOM;
     do {
-        retval =
-            (int) recvfrom(eth->el_fd, frame, sizeof(frame), 0, NULL, NULL);
-        if (retval == -1 &&
-            (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+        struct iovec iov[] = {
+            {.iov_base = &vh, .iov_len = eth->el_vnet_len},
+            {.iov_base = buf, .iov_len = ETHER_MAXLEN},
+        };
+        const int spin =
+            eth->el_busy_poll && linux_ether_spin(eth, q, &spin_start);
+
+        msg = (struct msghdr){
+            .msg_iov = iov,
+            .msg_iovlen = num_elem(iov),
+            .msg_control = eth->el_rx_stats ? &control : NULL,
+            .msg_controllen = eth->el_rx_stats ? sizeof(control) : 0,
+        };
+
+        retval = recvmsg(q->fd, &msg,
+                         (spin || q->nonblock) ? MSG_DONTWAIT : 0);
+        if (retval == -1 && spin && errno == EAGAIN) {
+            continue;
+        } else if (retval == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                                    errno == EINPROGRESS)) {
             return 0;
         } else if (retval == -1) {
             return -1;
         }
-    } while (!memcmp(frame_hdr->h_src, eth->el_mac, sizeof(mac_addr_t)));
+        retval -= eth->el_vnet_len;
+    } while (retval < ETHER_HEADER_LEN ||
+             linux_ether_vnet_rx(eth, &vh, buf, retval));
 
-    memcpy(hdr->h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
-    memcpy(hdr->h_src, frame_hdr->h_src, sizeof(mac_addr_t));
-    hdr->h_proto = ntohs(frame_hdr->h_proto);
+    linux_ether_lend(frame, buf, retval);
+    frame->release = linux_ether_release;
+    frame->priv = q;
 
-    retval -= ETHER_HEADER_LEN;
-    memcpy(buf, frame + ETHER_HEADER_LEN, min(retval, bsize));
+    if (eth->el_rx_stats) {
+        struct timespec ts;
 
-    return retval;
+        linux_ether_msg_tstamp(&msg, &ts);
+        linux_ether_rx_stats(q, spin_start, &ts);
+    }
+
+    return 1;
+}
+
+/**
+ * Receive the frames already queued on the socket, without waiting.
+ * frames[i] is read into rx_buffer[i + 1] of the queue.
+ * @returns Returns the number of frames received.
+ */
+static unsigned linux_ether_recv_more(struct ether_linux *eth,
+                                      struct ether_linux_queue *q,
+                                      struct ether_frame frames[],
+                                      unsigned nr)
+{
+    struct mmsghdr msg[NSTACK_ETHER_RX_BURST - 1];
+    struct iovec iov[NSTACK_ETHER_RX_BURST - 1][2];
+    struct virtio_net_hdr vh[NSTACK_ETHER_RX_BURST - 1];
+    union linux_ether_control control[NSTACK_ETHER_RX_BURST - 1];
+    unsigned n = 0;
+    int retval;
+
+    for (unsigned i = 0; i < nr; i++) {
+        iov[i][0] = (struct iovec){
+            .iov_base = &vh[i],
+            .iov_len = eth->el_vnet_len,
+        };
+        iov[i][1] = (struct iovec){
+            .iov_base = q->rx_buffer[i + 1] + ETHER_RX_HEADROOM,
+            .iov_len = ETHER_MAXLEN,
+        };
+        msg[i].msg_hdr = (struct msghdr){
+            .msg_iov = iov[i],
+            .msg_iovlen = num_elem(iov[i]),
+            .msg_control = eth->el_rx_stats ? &control[i] : NULL,
+            .msg_controllen = eth->el_rx_stats ? sizeof(control[i]) : 0,
+        };
+    }
+
+    retval = recvmmsg(q->fd, msg, nr, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < retval; i++) {
+        uint8_t *buf = iov[i][1].iov_base;
+        const ssize_t len = (ssize_t) msg[i].msg_len - eth->el_vnet_len;
+
+        if (len < ETHER_HEADER_LEN ||
+            linux_ether_vnet_rx(eth, &vh[i], buf, len))
+            continue;
+
+        linux_ether_lend(&frames[n], buf, len);
+        frames[n].release = linux_ether_release;
+        frames[n].priv = q;
+        n++;
+
+        if (eth->el_rx_stats) {
+            struct timespec ts;
+
+            linux_ether_msg_tstamp(&msg[i].msg_hdr, &ts);
+            linux_ether_rx_stats(q, 0, &ts);
+        }
+    }
+
+    return n;
 }
 
-int ether_send(int handle,
-               const mac_addr_t dst,
-               uint16_t proto,
-               uint8_t *buf,
-               size_t bsize)
+static struct ether_linux_queue *linux_ether_queue(int handle,
+                                                   unsigned queue,
+                                                   struct ether_linux **ethp)
 {
     struct ether_linux *eth;
-    struct sockaddr_ll socket_address;
-    const size_t frame_size = ETHER_HEADER_LEN +
-                              max(bsize, ETHER_MINLEN - ETHER_FCS_LEN) +
-                              ETHER_FCS_LEN;
-    uint8_t frame[frame_size] __attribute__((aligned));
-    uint32_t fcs;
-    uint8_t *data = frame + ETHER_HEADER_LEN;
-    struct ether_hdr *frame_hdr = (struct ether_hdr *) frame;
-    uint32_t *fcs_p = (uint32_t *) &frame[frame_size - ETHER_FCS_LEN];
+
+    if (!(eth = ether_handle2eth(handle)))
+        return NULL;
+
+    if (queue >= eth->el_nr_queues) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    *ethp = eth;
+    return &eth->el_queue[queue];
+}
+
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame)
+{
+    struct ether_linux *eth;
+    struct ether_linux_queue *q;
+
+    assert(frame != NULL);
+
+    if (!(q = linux_ether_queue(handle, queue, &eth)))
+        return -1;
+
+    if (q->rx_ring.map)
+        return linux_ether_ring_receive(eth, q, frame, q->rx_buffer[0], 1);
+
+    return linux_ether_recv(eth, q, frame);
+}
+
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr)
+{
+    struct ether_linux *eth;
+    struct ether_linux_queue *q;
     int retval;
+    unsigned n;
 
-    assert(buf != NULL);
+    assert(frames != NULL && nr <= NSTACK_ETHER_RX_BURST);
 
-    if (frame_size > ETHER_MAXLEN + ETHER_FCS_LEN) {
-        retval = -EMSGSIZE;
-        goto out;
+    if (!(q = linux_ether_queue(handle, queue, &eth)))
+        return -1;
+
+    if (nr == 0)
+        return 0;
+
+    if (q->rx_ring.map) {
+        /* The frames are lent in place until the end of the block. */
+        for (n = 0; n < nr; n++) {
+            retval = linux_ether_ring_receive(eth, q, &frames[n],
+                                              q->rx_buffer[n], n == 0);
+            if (retval <= 0)
+                break;
+        }
+        return n > 0 ? (int) n : retval;
     }
 
-    if (!(eth = ether_handle2eth(handle))) {
-        retval = -errno;
-        goto out;
+    retval = linux_ether_recv(eth, q, &frames[0]);
+    if (retval <= 0 || nr == 1)
+        return retval;
+
+    return 1 + linux_ether_recv_more(eth, q, frames + 1, nr - 1);
+}
+
+/**
+ * Build a frame to a TX buffer.
+ * The kernel pads the frame and the NIC appends the FCS unless a software
+ * FCS was requested.
+ * @returns Returns the size of the frame including the virtio-net header.
+ */
+static size_t linux_ether_frame(struct ether_linux *eth,
+                                uint8_t *frame,
+                                const mac_addr_t dst,
+                                uint16_t proto,
+                                const struct iovec *iov,
+                                unsigned iovcnt,
+                                const struct ether_offload *off)
+{
+    struct ether_hdr *frame_hdr;
+    size_t frame_size;
+
+    if (eth->el_vnet_len) {
+        vnet_hdr_tx((struct virtio_net_hdr *) frame, iov[0].iov_base, off);
+        frame += eth->el_vnet_len;
+    }
+    frame_hdr = (struct ether_hdr *) frame;
+    memcpy(frame_hdr->h_dst, dst, ETHER_ALEN);
+    memcpy(frame_hdr->h_src, eth->el_mac, ETHER_ALEN);
+    frame_hdr->h_proto = htons(proto);
+    frame_size = ETHER_HEADER_LEN +
+                 ether_iov_copy(frame + ETHER_HEADER_LEN, iov, iovcnt);
+    if (eth->el_caps & ETHER_CAP_SW_FCS)
+        frame_size = ether_fcs_append(frame, frame_size);
+
+    return eth->el_vnet_len + frame_size;
+}
+
+static inline struct tpacket3_hdr *linux_ether_txring_frame(
+    struct ether_linux_txring *ring,
+    unsigned i)
+{
+    const unsigned per_block = ring->req.tp_block_size / ring->req.tp_frame_size;
+
+    return (struct tpacket3_hdr *) (ring->map +
+                                    (size_t) (i / per_block) *
+                                        ring->req.tp_block_size +
+                                    (i % per_block) * ring->req.tp_frame_size);
+}
+
+/**
+ * Transmit all queued frames.
+ * el_tx_lock must be held.
+ */
+static int linux_ether_flush(struct ether_linux *eth)
+{
+    struct ether_linux_txbatch *batch = &eth->el_tx_batch;
+    unsigned sent = 0;
+
+    if (eth->el_tx_ring.map) {
+        if (eth->el_tx_ring.pending == 0)
+            return 0;
+
+        /* A blocking send() returns once the kernel has consumed the ring. */
+        eth->el_tx_ring.pending = 0;
+        if (send(eth->el_queue[0].fd, NULL, 0, 0) == -1)
+            return -errno;
+        return 0;
+    }
+
+    while (sent < batch->count) {
+        int retval;
+
+        retval = sendmmsg(eth->el_queue[0].fd, batch->msg + sent,
+                          batch->count - sent, 0);
+        if (retval == -1 && errno == EINTR)
+            continue;
+        if (retval == -1) {
+            batch->count = 0;
+            return -errno;
+        }
+        sent += retval;
     }
+    batch->count = 0;
 
-    socket_address = (struct sockaddr_ll){
+    return 0;
+}
+
+/**
+ * Get a free TX buffer for the next frame.
+ * el_tx_lock must be held.
+ */
+static uint8_t *linux_ether_tx_alloc(struct ether_linux *eth)
+{
+    struct ether_linux_txring *ring = &eth->el_tx_ring;
+    struct ether_linux_txbatch *batch = &eth->el_tx_batch;
+
+    if (ring->map) {
+        struct tpacket3_hdr *hdr = linux_ether_txring_frame(ring, ring->head);
+        const unsigned busy = TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING;
+
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & busy) {
+            /* The ring is full. */
+            linux_ether_flush(eth);
+            if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & busy) {
+                errno = ENOBUFS;
+                return NULL;
+            }
+        }
+
+        return (uint8_t *) hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+    }
+
+    if (batch->count == num_elem(batch->frame)) {
+        int retval = linux_ether_flush(eth);
+
+        if (retval < 0) {
+            errno = -retval;
+            return NULL;
+        }
+    }
+
+    return batch->frame[batch->count];
+}
+
+/**
+ * Queue the frame in the buffer returned by linux_ether_tx_alloc().
+ * el_tx_lock must be held.
+ */
+static void linux_ether_tx_commit(struct ether_linux *eth,
+                                  uint16_t proto,
+                                  size_t frame_size)
+{
+    struct ether_linux_txring *ring = &eth->el_tx_ring;
+    struct ether_linux_txbatch *batch = &eth->el_tx_batch;
+
+    if (ring->map) {
+        struct tpacket3_hdr *hdr = linux_ether_txring_frame(ring, ring->head);
+
+        hdr->tp_len = frame_size;
+        hdr->tp_next_offset = 0;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                         __ATOMIC_RELEASE);
+        ring->head = (ring->head + 1) % ring->req.tp_frame_nr;
+        ring->pending++;
+    } else {
+        const unsigned i = batch->count++;
+
+        batch->addr[i] = (struct sockaddr_ll){
+            .sll_family = AF_PACKET,
+            .sll_protocol = htons(proto),
+            .sll_ifindex = eth->el_if_idx.ifr_ifindex,
+        };
+        batch->iov[i] = (struct iovec){
+            .iov_base = batch->frame[i],
+            .iov_len = frame_size,
+        };
+        batch->msg[i] = (struct mmsghdr){
+            .msg_hdr.msg_name = &batch->addr[i],
+            .msg_hdr.msg_namelen = sizeof(batch->addr[i]),
+            .msg_hdr.msg_iov = &batch->iov[i],
+            .msg_hdr.msg_iovlen = 1,
+        };
+    }
+}
+
+/**
+ * Send a frame directly from the segments of the caller.
+ * Used for super-frames and for the frames that aren't batched. The queued
+ * frames are flushed first to keep the order.
+ * el_tx_lock must be held.
+ * @returns Returns the size of the frame or a negative errno code.
+ */
+static int linux_ether_send_direct(struct ether_linux *eth,
+                                   const mac_addr_t dst,
+                                   uint16_t proto,
+                                   const struct iovec *chain,
+                                   unsigned chaincnt,
+                                   size_t bsize,
+                                   const struct ether_offload *off)
+{
+    struct virtio_net_hdr vh;
+    struct ether_hdr frame_hdr;
+    struct sockaddr_ll addr = {
         .sll_family = AF_PACKET,
         .sll_protocol = htons(proto),
         .sll_ifindex = eth->el_if_idx.ifr_ifindex,
-        .sll_halen = ETHER_ALEN,
-        .sll_addr[0] = dst[0],
-        .sll_addr[1] = dst[1],
-        .sll_addr[2] = dst[2],
-        .sll_addr[3] = dst[3],
-        .sll_addr[4] = dst[4],
-        .sll_addr[5] = dst[5],
     };
+    struct iovec iov[2 + ETHER_IOV_MAX];
+    const struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = iov,
+        .msg_iovlen = 2 + chaincnt,
+    };
+    int retval;
 
-    memcpy(frame_hdr->h_dst, dst, ETHER_ALEN);
-    memcpy(frame_hdr->h_src, eth->el_mac, ETHER_ALEN);
-    frame_hdr->h_proto = htons(proto);
-    memcpy(data, buf, bsize);
-    memset(data + bsize, 0, frame_size - ETHER_HEADER_LEN - bsize);
-    fcs = ether_fcs(frame, frame_size - ETHER_FCS_LEN);
-    memcpy(fcs_p, &fcs, sizeof(uint32_t));
-
-    retval = (int) sendto(eth->el_fd, frame, frame_size, 0,
-                          (struct sockaddr *) (&socket_address),
-                          sizeof(socket_address));
+    retval = linux_ether_flush(eth);
     if (retval < 0)
+        return retval;
+
+    iov[0] = (struct iovec){.iov_base = &vh, .iov_len = eth->el_vnet_len};
+    iov[1] = (struct iovec){
+        .iov_base = &frame_hdr,
+        .iov_len = ETHER_HEADER_LEN,
+    };
+    memcpy(iov + 2, chain, chaincnt * sizeof(*chain));
+    if (eth->el_vnet_len)
+        vnet_hdr_tx(&vh, chain[0].iov_base, off);
+    memcpy(frame_hdr.h_dst, dst, ETHER_ALEN);
+    memcpy(frame_hdr.h_src, eth->el_mac, ETHER_ALEN);
+    frame_hdr.h_proto = htons(proto);
+    while (sendmsg(eth->el_queue[0].fd, &msg, 0) == -1) {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return ETHER_HEADER_LEN + bsize;
+}
+
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *iov,
+                unsigned iovcnt,
+                const struct ether_offload *off)
+{
+    const size_t bsize = ether_iov_len(iov, iovcnt);
+    struct ether_linux *eth;
+    uint8_t *frame;
+    int retval;
+
+    assert(iovcnt > 0 && iovcnt <= ETHER_IOV_MAX);
+
+    if (ETHER_HEADER_LEN + bsize > ETHER_MAXLEN && !(off && off->gso_size))
+        return -EMSGSIZE;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->el_tx_lock);
+    /*
+     * A frame that isn't batched is sent without copying it, unless it's
+     * completed with a software FCS.
+     */
+    if (ETHER_HEADER_LEN + bsize > ETHER_MAXLEN ||
+        (!eth->el_tx_ring.map && !ether_tx_defer(handle) &&
+         !(eth->el_caps & ETHER_CAP_SW_FCS))) {
+        retval =
+            linux_ether_send_direct(eth, dst, proto, iov, iovcnt, bsize, off);
+        goto out;
+    }
+
+    frame = linux_ether_tx_alloc(eth);
+    if (!frame) {
         retval = -errno;
+        goto out;
+    }
+
+    retval = (int) linux_ether_frame(eth, frame, dst, proto, iov, iovcnt, off);
+    linux_ether_tx_commit(eth, proto, retval);
+    retval -= eth->el_vnet_len;
+
+    if (!ether_tx_defer(handle)) {
+        const int err = linux_ether_flush(eth);
+
+        if (err < 0)
+            retval = err;
+    }
 out:
+    pthread_mutex_unlock(&eth->el_tx_lock);
+    return retval;
+}
+
+int ether_flush(int handle)
+{
+    struct ether_linux *eth;
+    int retval;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->el_tx_lock);
+    retval = linux_ether_flush(eth);
+    pthread_mutex_unlock(&eth->el_tx_lock);
+
     return retval;
 }
@@ -0,0 +1,340 @@
+/*
+ * TAP ether driver.
+ *
+ * Frames are exchanged with the host through a TAP device. The device is
+ * opened with IFF_VNET_HDR, so that every frame carries a virtio-net header:
+ * the host kernel completes the checksums and segments the TCP super-frames
+ * we send, and passes us the TCP frames it merged with GRO.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "nstack_util.h"
+
+#include "../logger.h"
+#include "../nstack_ether.h"
+#include "vnet_hdr.h"
+
+#define ETHER_MAX_IF NSTACK_ETHER_MAX_IF
+#define ETHER_RX_HEADROOM 2 /*!< Aligns the payload after the header. */
+
+struct ether_tap {
+    mac_addr_t et_mac;
+    unsigned et_caps; /*!< ETHER_CAP_ flags. */
+    int et_fd;
+    int et_nonblock;    /*!< Don't wait for frames, the caller uses epoll. */
+    size_t et_vnet_len; /*!< Size of the virtio-net header or 0 if unused. */
+    uint8_t et_rx_buffer[ETHER_RX_HEADROOM + ETHER_HEADER_LEN +
+                         ETHER_GSO_MAXLEN + ETHER_RX_TAILROOM]
+        __attribute__((aligned));
+};
+
+static struct ether_tap ether_if[ETHER_MAX_IF];
+static int ether_next_handle;
+
+static struct ether_tap *ether_handle2eth(int handle)
+{
+    if (handle < 0 || handle >= ether_next_handle) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_if[handle];
+}
+
+int ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_tap *eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    memcpy(addr, eth->et_mac, sizeof(mac_addr_t));
+    return 0;
+}
+
+unsigned ether_handle2caps(int handle)
+{
+    struct ether_tap *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return 0;
+
+    return eth->et_caps;
+}
+
+unsigned ether_handle2queues(int handle)
+{
+    return ether_handle2eth(handle) ? 1 : 0;
+}
+
+int ether_handle2fd(int handle, unsigned queue)
+{
+    struct ether_tap *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    eth->et_nonblock = 1;
+    return eth->et_fd;
+}
+
+int ether_addr2handle(const mac_addr_t addr)
+{
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        if (!memcmp(ether_if[handle].et_mac, addr, sizeof(mac_addr_t)))
+            return handle;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+/**
+ * Tell the kernel which offloads we accept in the frames it passes to us.
+ */
+static int tap_ether_offload(struct ether_tap *eth)
+{
+    const int vnet_len = sizeof(struct virtio_net_hdr);
+
+    if (ioctl(eth->et_fd, TUNSETVNETHDRSZ, &vnet_len) ||
+        ioctl(eth->et_fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4))
+        return -1;
+
+    eth->et_vnet_len = vnet_len;
+    eth->et_caps = ETHER_CAP_TX_CSUM | ETHER_CAP_TSO;
+
+    return 0;
+}
+
+/**
+ * Bring the host side of the device up.
+ */
+static int tap_ether_up(const char *if_name)
+{
+    struct ifreq ifr = {0};
+    int fd, retval;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+        return -1;
+
+    strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+    retval = ioctl(fd, SIOCGIFFLAGS, &ifr);
+    if (!retval && !(ifr.ifr_flags & IFF_UP)) {
+        ifr.ifr_flags |= IFF_UP;
+        retval = ioctl(fd, SIOCSIFFLAGS, &ifr);
+    }
+    close(fd);
+
+    return retval;
+}
+
+int ether_init(char *const args[])
+{
+    const int handle = ether_next_handle;
+    struct ether_tap *eth;
+    struct ifreq ifr = {0};
+    const char *value;
+    int vnet_hdr;
+
+    if (handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+    eth = &ether_if[handle];
+    ether_next_handle++;
+
+    if (!args[0] || strnlen(args[0], IFNAMSIZ) >= IFNAMSIZ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    value = ether_arg(args, "vnet_hdr");
+    vnet_hdr = value ? !!strtoul(value, NULL, 0) : 1;
+
+    eth->et_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (eth->et_fd == -1)
+        return -1;
+
+    /* Creates the device unless it's persistent. */
+    strncpy(ifr.ifr_name, args[0], IFNAMSIZ - 1);
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | (vnet_hdr ? IFF_VNET_HDR : 0);
+    if (ioctl(eth->et_fd, TUNSETIFF, &ifr))
+        goto fail;
+
+    eth->et_nonblock = 0;
+    eth->et_vnet_len = 0;
+    eth->et_caps = 0;
+    if (vnet_hdr && tap_ether_offload(eth))
+        goto fail;
+
+    if (tap_ether_up(ifr.ifr_name))
+        goto fail;
+
+    eth->et_mac[0] = 0x02; /* Locally administered */
+    eth->et_mac[4] = handle;
+    eth->et_mac[5] = 0x02;
+
+    return handle;
+fail:
+    close(eth->et_fd);
+    eth->et_fd = -1;
+    return -1;
+}
+
+void ether_deinit(int handle)
+{
+    struct ether_tap *eth;
+
+    if (!(eth = ether_handle2eth(handle)) || eth->et_fd == -1)
+        return;
+
+    close(eth->et_fd);
+    eth->et_fd = -1;
+}
+
+static void tap_ether_release(struct ether_frame *frame)
+{
+    /* The frame is in the et_rx_buffer. */
+}
+
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame)
+{
+    struct ether_tap *eth;
+    struct virtio_net_hdr vh;
+    const struct ether_hdr *frame_hdr;
+    uint8_t *buf;
+    ssize_t retval;
+
+    assert(frame != NULL);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    buf = eth->et_rx_buffer + ETHER_RX_HEADROOM;
+    while (1) {
+        struct iovec iov[] = {
+            {.iov_base = &vh, .iov_len = eth->et_vnet_len},
+            {.iov_base = buf, .iov_len = ETHER_HEADER_LEN + ETHER_GSO_MAXLEN},
+        };
+        struct pollfd pfd = {
+            .fd = eth->et_fd,
+            .events = POLLIN,
+        };
+
+        /* Only poll() if there is nothing to read. */
+        retval = readv(eth->et_fd, iov, num_elem(iov));
+        if (retval == -1 && errno == EAGAIN) {
+            if (eth->et_nonblock)
+                return 0;
+            retval = poll(&pfd, 1, NSTACK_PERIODIC_EVENT_SEC * 1000);
+            if (retval == 0 || (retval == -1 && errno == EINTR))
+                return 0;
+            else if (retval == -1)
+                return -1;
+            continue;
+        } else if (retval == -1) {
+            return (errno == EINTR) ? 0 : -1;
+        }
+
+        retval -= eth->et_vnet_len;
+        if (retval >= ETHER_HEADER_LEN &&
+            !(eth->et_vnet_len && vnet_hdr_rx(&vh, buf, retval)))
+            break;
+    }
+
+    frame_hdr = (struct ether_hdr *) buf;
+    memcpy(frame->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+    memcpy(frame->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+    frame->hdr.h_proto = ntohs(frame_hdr->h_proto);
+    frame->data = buf + ETHER_HEADER_LEN;
+    frame->len = retval - ETHER_HEADER_LEN;
+    frame->release = tap_ether_release;
+    frame->priv = eth;
+
+    return 1;
+}
+
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr)
+{
+    /* Frames are read into a single buffer. */
+    return nr > 0 ? ether_receive(handle, queue, frames) : 0;
+}
+
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *chain,
+                unsigned chaincnt,
+                const struct ether_offload *off)
+{
+    const size_t bsize = ether_iov_len(chain, chaincnt);
+    struct ether_tap *eth;
+    struct virtio_net_hdr vh;
+    struct ether_hdr frame_hdr;
+    struct iovec iov[2 + ETHER_IOV_MAX];
+    ssize_t retval;
+
+    assert(chaincnt > 0 && chaincnt <= ETHER_IOV_MAX);
+
+    if (ETHER_HEADER_LEN + bsize > ETHER_MAXLEN && !(off && off->gso_size))
+        return -EMSGSIZE;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    /* The frame is written from the segments of the caller without copying. */
+    iov[0] = (struct iovec){.iov_base = &vh, .iov_len = eth->et_vnet_len};
+    iov[1] = (struct iovec){
+        .iov_base = &frame_hdr,
+        .iov_len = ETHER_HEADER_LEN,
+    };
+    memcpy(iov + 2, chain, chaincnt * sizeof(*chain));
+
+    if (eth->et_vnet_len)
+        vnet_hdr_tx(&vh, chain[0].iov_base, off);
+    memcpy(frame_hdr.h_dst, dst, sizeof(mac_addr_t));
+    memcpy(frame_hdr.h_src, eth->et_mac, sizeof(mac_addr_t));
+    frame_hdr.h_proto = htons(proto);
+
+    do {
+        retval = writev(eth->et_fd, iov, 2 + chaincnt);
+    } while (retval == -1 && errno == EINTR);
+    if (retval == -1)
+        return -errno;
+
+    return (int) (ETHER_HEADER_LEN + bsize);
+}
+
+int ether_flush(int handle)
+{
+    /* Frames are written to the device right away. */
+    return ether_handle2eth(handle) ? 0 : -errno;
+}
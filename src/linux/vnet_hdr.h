@@ -0,0 +1,71 @@
+/*
+ * virtio-net header handling shared by the Linux drivers.
+ *
+ * The header precedes each frame exchanged with a TAP device opened with
+ * IFF_VNET_HDR, or with a packet socket with PACKET_VNET_HDR, and carries
+ * the checksum and segmentation offloads of the frame.
+ */
+
+#pragma once
+
+#include <linux/virtio_net.h>
+#include <string.h>
+
+#include "../nstack_ether.h"
+
+/**
+ * Build the virtio-net header of an outgoing frame.
+ * @param[out] vh is the header.
+ * @param[in] buf is the payload of the frame.
+ * @param[in] off is the offloads given to ether_send().
+ */
+static inline void vnet_hdr_tx(struct virtio_net_hdr *vh,
+                               const uint8_t *buf,
+                               const struct ether_offload *off)
+{
+    memset(vh, 0, sizeof(*vh));
+    if (!off)
+        return;
+
+    vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh->csum_start = ETHER_HEADER_LEN + off->csum_start;
+    vh->csum_offset = off->csum_offset;
+    if (off->gso_size) {
+        /* The TCP data offset is in the upper nibble of byte 12. */
+        const unsigned tcp_hlen = (buf[off->csum_start + 12] >> 4) * 4;
+
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vh->gso_size = off->gso_size;
+        vh->hdr_len = vh->csum_start + tcp_hlen;
+    }
+}
+
+/**
+ * Complete a received frame as told by its virtio-net header.
+ * Frames from the local host may have a partial checksum.
+ * @param[in] vh is the header.
+ * @param[in,out] frame is the frame.
+ * @param[in] len is the length of the frame.
+ * @returns Returns 0 if the frame is valid; -1 if it should be dropped.
+ */
+static inline int vnet_hdr_rx(const struct virtio_net_hdr *vh,
+                              uint8_t *frame,
+                              size_t len)
+{
+    struct ether_offload off;
+
+    if (!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+        return 0;
+
+    if (vh->csum_start < ETHER_HEADER_LEN ||
+        (size_t) vh->csum_start + vh->csum_offset + 2 > len)
+        return -1;
+
+    off = (struct ether_offload){
+        .csum_start = vh->csum_start - ETHER_HEADER_LEN,
+        .csum_offset = vh->csum_offset,
+    };
+    ether_offload_csum(frame + ETHER_HEADER_LEN, len - ETHER_HEADER_LEN, &off);
+
+    return 0;
+}
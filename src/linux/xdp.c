@@ -0,0 +1,725 @@
+/*
+ * AF_XDP ether driver.
+ *
+ * Frames are redirected to an AF_XDP socket by a small XDP program attached
+ * in generic (SKB) mode, so the driver works on any interface including
+ * veth. The UMEM is split in two halves; the first half is handed to the
+ * kernel over the fill ring and the second half is used for TX.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "nstack_util.h"
+
+#include "../logger.h"
+#include "../nstack_ether.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define DEFAULT_IF "eth0"
+#define ETHER_MAX_IF NSTACK_ETHER_MAX_IF
+
+#define XDP_FRAME_SIZE 2048
+
+/**
+ * An AF_XDP producer/consumer ring.
+ */
+struct ether_xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    void *desc;
+    uint32_t mask;
+    uint32_t cached; /*!< Local copy of the index we own. */
+    void *map;
+    size_t map_size;
+};
+
+struct ether_xdp {
+    int ex_fd;
+    int ex_prog_fd;
+    int ex_map_fd;
+    int ex_link_fd;
+    mac_addr_t ex_mac;
+    unsigned ex_ifindex;
+    unsigned ex_queue;
+    int ex_nonblock; /*!< Don't wait for frames, the caller uses epoll. */
+
+    uint8_t *ex_umem;    /*!< UMEM area. */
+    size_t ex_umem_size; /*!< Size of ex_umem. */
+    unsigned ex_frames;  /*!< Number of frames in ex_umem. */
+
+    struct ether_xdp_ring ex_fill;
+    struct ether_xdp_ring ex_rx;
+
+    pthread_mutex_t ex_tx_lock;
+    struct ether_xdp_ring ex_comp;
+    struct ether_xdp_ring ex_tx;
+    uint64_t *ex_tx_free; /*!< Stack of free TX frames. */
+    unsigned ex_tx_nfree;
+    unsigned ex_tx_pending; /*!< Frames waiting for a flush. */
+};
+
+static struct ether_xdp ether_if[ETHER_MAX_IF];
+static int ether_next_handle;
+
+static struct ether_xdp *ether_handle2eth(int handle)
+{
+    if (handle < 0 || handle >= ether_next_handle) {
+        errno = ENODEV;
+        return NULL;
+    }
+    return &ether_if[handle];
+}
+
+int ether_handle2addr(int handle, mac_addr_t addr)
+{
+    struct ether_xdp *eth;
+
+    if (!(eth = ether_handle2eth(handle))) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    memcpy(addr, eth->ex_mac, sizeof(mac_addr_t));
+    return 0;
+}
+
+unsigned ether_handle2caps(int handle)
+{
+    /* The NIC pads the frame and appends the FCS. */
+    return 0;
+}
+
+unsigned ether_handle2queues(int handle)
+{
+    return ether_handle2eth(handle) ? 1 : 0;
+}
+
+int ether_handle2fd(int handle, unsigned queue)
+{
+    struct ether_xdp *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    eth->ex_nonblock = 1;
+    return eth->ex_fd;
+}
+
+int ether_addr2handle(const mac_addr_t addr)
+{
+    for (int handle = 0; handle < ether_next_handle; handle++) {
+        if (!memcmp(ether_if[handle].ex_mac, addr, sizeof(mac_addr_t)))
+            return handle;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+static unsigned xdp_ether_arg(char *const args[],
+                              const char *name,
+                              unsigned def)
+{
+    const char *value = ether_arg(args, name);
+
+    return value ? (unsigned) strtoul(value, NULL, 0) : def;
+}
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+    return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Redirect all frames received on our queue to the XSK map.
+ * Frames are passed to the kernel if no socket is bound to the queue.
+ */
+static int xdp_ether_load_prog(struct ether_xdp *eth)
+{
+    static const char license[] = "Dual MIT/GPL";
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = eth->ex_queue + 1;
+    eth->ex_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (eth->ex_map_fd == -1)
+        return -1;
+
+    const struct bpf_insn prog[] = {
+        /* r2 = ctx->rx_queue_index */
+        {
+            .code = BPF_LDX | BPF_MEM | BPF_W,
+            .dst_reg = BPF_REG_2,
+            .src_reg = BPF_REG_1,
+            .off = offsetof(struct xdp_md, rx_queue_index),
+        },
+        /* r1 = map */
+        {
+            .code = BPF_LD | BPF_DW | BPF_IMM,
+            .dst_reg = BPF_REG_1,
+            .src_reg = BPF_PSEUDO_MAP_FD,
+            .imm = eth->ex_map_fd,
+        },
+        {0},
+        /* r3 = XDP_PASS, the action if the lookup fails */
+        {
+            .code = BPF_ALU64 | BPF_MOV | BPF_K,
+            .dst_reg = BPF_REG_3,
+            .imm = XDP_PASS,
+        },
+        {
+            .code = BPF_JMP | BPF_CALL,
+            .imm = BPF_FUNC_redirect_map,
+        },
+        {
+            .code = BPF_JMP | BPF_EXIT,
+        },
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) prog;
+    attr.insn_cnt = num_elem(prog);
+    attr.license = (uintptr_t) license;
+    eth->ex_prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (eth->ex_prog_fd == -1)
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = eth->ex_prog_fd;
+    attr.link_create.target_ifindex = eth->ex_ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (fd == -1)
+        return -1;
+    eth->ex_link_fd = fd;
+
+    return 0;
+}
+
+static int xdp_ether_map_ring(struct ether_xdp *eth,
+                              struct ether_xdp_ring *ring,
+                              const struct xdp_ring_offset *off,
+                              size_t desc_size,
+                              unsigned nr,
+                              off_t pgoff)
+{
+    void *map;
+
+    ring->map_size = off->desc + nr * desc_size;
+    map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, eth->ex_fd, pgoff);
+    if (map == MAP_FAILED)
+        return -1;
+
+    ring->map = map;
+    ring->producer = (uint32_t *) ((uint8_t *) map + off->producer);
+    ring->consumer = (uint32_t *) ((uint8_t *) map + off->consumer);
+    ring->desc = (uint8_t *) map + off->desc;
+    ring->mask = nr - 1;
+    ring->cached = 0;
+
+    return 0;
+}
+
+static void xdp_ether_unmap_ring(struct ether_xdp_ring *ring)
+{
+    if (!ring->map)
+        return;
+
+    munmap(ring->map, ring->map_size);
+    ring->map = NULL;
+}
+
+/**
+ * Setup the UMEM and the fill, completion, RX and TX rings.
+ */
+static int xdp_ether_rings(struct ether_xdp *eth)
+{
+    const unsigned nr = eth->ex_frames / 2;
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    uint64_t *fill;
+
+    eth->ex_umem_size = (size_t) eth->ex_frames * XDP_FRAME_SIZE;
+    eth->ex_umem = mmap(NULL, eth->ex_umem_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (eth->ex_umem == MAP_FAILED) {
+        eth->ex_umem = NULL;
+        return -1;
+    }
+
+    reg = (struct xdp_umem_reg){
+        .addr = (uintptr_t) eth->ex_umem,
+        .len = eth->ex_umem_size,
+        .chunk_size = XDP_FRAME_SIZE,
+    };
+    if (setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_FILL_RING, &nr, sizeof(nr)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &nr,
+                   sizeof(nr)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_RX_RING, &nr, sizeof(nr)) ||
+        setsockopt(eth->ex_fd, SOL_XDP, XDP_TX_RING, &nr, sizeof(nr)))
+        return -1;
+
+    if (getsockopt(eth->ex_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+        return -1;
+
+    if (xdp_ether_map_ring(eth, &eth->ex_fill, &off.fr, sizeof(uint64_t), nr,
+                           XDP_UMEM_PGOFF_FILL_RING) ||
+        xdp_ether_map_ring(eth, &eth->ex_comp, &off.cr, sizeof(uint64_t), nr,
+                           XDP_UMEM_PGOFF_COMPLETION_RING) ||
+        xdp_ether_map_ring(eth, &eth->ex_rx, &off.rx, sizeof(struct xdp_desc),
+                           nr, XDP_PGOFF_RX_RING) ||
+        xdp_ether_map_ring(eth, &eth->ex_tx, &off.tx, sizeof(struct xdp_desc),
+                           nr, XDP_PGOFF_TX_RING))
+        return -1;
+
+    /* Give the first half of the UMEM to the kernel for RX. */
+    fill = eth->ex_fill.desc;
+    for (unsigned i = 0; i < nr; i++)
+        fill[i] = (uint64_t) i * XDP_FRAME_SIZE;
+    __atomic_store_n(eth->ex_fill.producer, nr, __ATOMIC_RELEASE);
+    eth->ex_fill.cached = nr;
+
+    /* The second half is used for TX. */
+    eth->ex_tx_free = malloc(nr * sizeof(uint64_t));
+    if (!eth->ex_tx_free)
+        return -1;
+    for (unsigned i = 0; i < nr; i++)
+        eth->ex_tx_free[i] = (uint64_t)(nr + i) * XDP_FRAME_SIZE;
+    eth->ex_tx_nfree = nr;
+    eth->ex_tx_pending = 0;
+
+    return 0;
+}
+
+static void xdp_ether_free(struct ether_xdp *eth)
+{
+    if (eth->ex_link_fd >= 0)
+        close(eth->ex_link_fd);
+    if (eth->ex_prog_fd >= 0)
+        close(eth->ex_prog_fd);
+    if (eth->ex_map_fd >= 0)
+        close(eth->ex_map_fd);
+    eth->ex_link_fd = eth->ex_prog_fd = eth->ex_map_fd = -1;
+
+    xdp_ether_unmap_ring(&eth->ex_fill);
+    xdp_ether_unmap_ring(&eth->ex_comp);
+    xdp_ether_unmap_ring(&eth->ex_rx);
+    xdp_ether_unmap_ring(&eth->ex_tx);
+    if (eth->ex_umem)
+        munmap(eth->ex_umem, eth->ex_umem_size);
+    eth->ex_umem = NULL;
+    free(eth->ex_tx_free);
+    eth->ex_tx_free = NULL;
+
+    close(eth->ex_fd);
+}
+
+static int xdp_ether_get_mac(const char *if_name, mac_addr_t mac)
+{
+    struct ifreq if_mac;
+    int fd, retval;
+
+    /* AF_XDP sockets don't support interface ioctls. */
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+        return -1;
+
+    memset(&if_mac, 0, sizeof(struct ifreq));
+    strncpy(if_mac.ifr_name, if_name, IFNAMSIZ - 1);
+    retval = ioctl(fd, SIOCGIFHWADDR, &if_mac);
+    if (retval == 0)
+        memcpy(mac, if_mac.ifr_hwaddr.sa_data, sizeof(mac_addr_t));
+    close(fd);
+
+    return retval;
+}
+
+int ether_init(char *const args[])
+{
+    const int handle = ether_next_handle;
+    struct ether_xdp *eth;
+    char if_name[IFNAMSIZ];
+    struct sockaddr_xdp sxdp;
+    uint32_t key;
+    union bpf_attr attr;
+
+    if (handle >= ETHER_MAX_IF) {
+        errno = EAGAIN;
+        return -1;
+    }
+    eth = &ether_if[handle];
+    ether_next_handle++;
+
+    if (args[0]) { /* Non-default IF */
+        /* prevent buffer overflow */
+        if (strnlen(args[0], IFNAMSIZ) >= IFNAMSIZ)
+            return -2;
+        strcpy(if_name, args[0]);
+    } else { /* Default IF */
+        strcpy(if_name, DEFAULT_IF);
+    }
+
+    eth->ex_queue = xdp_ether_arg(args, "queue", 0);
+    eth->ex_frames = xdp_ether_arg(args, "frames", NSTACK_ETHER_XDP_FRAME_NR);
+    if (eth->ex_frames < 2 || (eth->ex_frames & (eth->ex_frames - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    eth->ex_link_fd = eth->ex_prog_fd = eth->ex_map_fd = -1;
+    eth->ex_nonblock = 0;
+
+    if (!(eth->ex_ifindex = if_nametoindex(if_name)))
+        return -1;
+    if (xdp_ether_get_mac(if_name, eth->ex_mac))
+        return -1;
+
+    if ((eth->ex_fd = socket(AF_XDP, SOCK_RAW, 0)) == -1)
+        return -1;
+
+    pthread_mutex_init(&eth->ex_tx_lock, NULL);
+
+    if (xdp_ether_rings(eth))
+        goto fail;
+
+    sxdp = (struct sockaddr_xdp){
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = eth->ex_ifindex,
+        .sxdp_queue_id = eth->ex_queue,
+        .sxdp_flags = XDP_COPY,
+    };
+    if (bind(eth->ex_fd, (struct sockaddr *) &sxdp, sizeof(sxdp)))
+        goto fail;
+
+    if (xdp_ether_load_prog(eth))
+        goto fail;
+
+    key = eth->ex_queue;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = eth->ex_map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &eth->ex_fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+        goto fail;
+
+    return handle;
+fail:
+    xdp_ether_free(eth);
+    return -1;
+}
+
+void ether_deinit(int handle)
+{
+    struct ether_xdp *eth;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return;
+
+    xdp_ether_free(eth);
+}
+
+/**
+ * Move TX frames completed by the kernel back to the free list.
+ * ex_tx_lock must be held.
+ */
+static void xdp_ether_tx_reclaim(struct ether_xdp *eth)
+{
+    struct ether_xdp_ring *comp = &eth->ex_comp;
+    const uint32_t prod = __atomic_load_n(comp->producer, __ATOMIC_ACQUIRE);
+
+    while (comp->cached != prod) {
+        eth->ex_tx_free[eth->ex_tx_nfree++] =
+            ((uint64_t *) comp->desc)[comp->cached & comp->mask];
+        comp->cached++;
+    }
+    __atomic_store_n(comp->consumer, comp->cached, __ATOMIC_RELEASE);
+}
+
+/**
+ * Kick the kernel to transmit the queued frames.
+ * The frames stay pending until the kernel has taken all of them, so that
+ * the next flush, or xdp_ether_tx_kick(), kicks it again.
+ * ex_tx_lock must be held.
+ */
+static int xdp_ether_flush(struct ether_xdp *eth)
+{
+    struct ether_xdp_ring *tx = &eth->ex_tx;
+    int retval = 0;
+
+    if (eth->ex_tx_pending == 0)
+        return 0;
+
+    /* Copy mode transmits a limited number of frames per call. */
+    while (__atomic_load_n(tx->consumer, __ATOMIC_ACQUIRE) != tx->cached) {
+        const uint32_t cons = __atomic_load_n(tx->consumer, __ATOMIC_ACQUIRE);
+
+        if (sendto(eth->ex_fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            retval = -errno;
+            break;
+        }
+        if (__atomic_load_n(tx->consumer, __ATOMIC_ACQUIRE) == cons)
+            break; /* No progress, the kernel continues later. */
+    }
+    if (__atomic_load_n(tx->consumer, __ATOMIC_ACQUIRE) == tx->cached)
+        __atomic_store_n(&eth->ex_tx_pending, 0, __ATOMIC_RELAXED);
+    xdp_ether_tx_reclaim(eth);
+
+    return retval;
+}
+
+/**
+ * Kick the kernel again for the frames a flush left behind.
+ * Called from the RX path, which doesn't wait for a sender holding the lock.
+ * @returns Returns 1 if frames are still waiting for the kernel.
+ */
+static int xdp_ether_tx_kick(struct ether_xdp *eth)
+{
+    if (!__atomic_load_n(&eth->ex_tx_pending, __ATOMIC_RELAXED))
+        return 0;
+    if (pthread_mutex_trylock(&eth->ex_tx_lock) == 0) {
+        xdp_ether_flush(eth);
+        pthread_mutex_unlock(&eth->ex_tx_lock);
+    }
+
+    return !!__atomic_load_n(&eth->ex_tx_pending, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return an RX frame to the kernel.
+ */
+static void xdp_ether_release(struct ether_frame *frame)
+{
+    struct ether_xdp *eth = frame->priv;
+    struct ether_xdp_ring *fill = &eth->ex_fill;
+    const uint64_t addr = (uint64_t)(frame->data - eth->ex_umem);
+
+    /* The fill ring has room for all RX frames so it can't be full. */
+    ((uint64_t *) fill->desc)[fill->cached & fill->mask] =
+        addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    fill->cached++;
+    __atomic_store_n(fill->producer, fill->cached, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take the next frame from the RX ring.
+ * @param[in] wait tells whether to wait for a frame if the ring is empty.
+ */
+static int xdp_ether_next(struct ether_xdp *eth,
+                          struct ether_frame *frame,
+                          int wait)
+{
+    struct ether_xdp_ring *rx = &eth->ex_rx;
+    const struct xdp_desc *desc;
+    const struct ether_hdr *frame_hdr;
+    int retval;
+
+    do {
+        while (__atomic_load_n(rx->producer, __ATOMIC_ACQUIRE) == rx->cached) {
+            struct pollfd pfd = {
+                .fd = eth->ex_fd,
+                .events = POLLIN,
+            };
+            const int tx_pending = xdp_ether_tx_kick(eth);
+
+            if (eth->ex_nonblock || !wait)
+                return 0;
+            /* Come back soon to kick the kernel for the rest of the TX. */
+            retval = poll(&pfd, 1,
+                          tx_pending ? 1 : NSTACK_PERIODIC_EVENT_SEC * 1000);
+            if (retval == 0 || (retval == -1 && errno == EINTR))
+                return 0;
+            else if (retval == -1)
+                return -1;
+        }
+
+        desc = (struct xdp_desc *) rx->desc + (rx->cached & rx->mask);
+        frame_hdr = (struct ether_hdr *) (eth->ex_umem + desc->addr);
+        frame->data = (uint8_t *) frame_hdr + ETHER_HEADER_LEN;
+        frame->len = desc->len;
+        frame->release = xdp_ether_release;
+        frame->priv = eth;
+        rx->cached++;
+        __atomic_store_n(rx->consumer, rx->cached, __ATOMIC_RELEASE);
+
+        if (frame->len < ETHER_HEADER_LEN)
+            xdp_ether_release(frame);
+    } while (frame->len < ETHER_HEADER_LEN);
+
+    /* A UMEM frame has plenty of room after the largest Ethernet frame. */
+    memcpy(frame->hdr.h_dst, frame_hdr->h_dst, sizeof(mac_addr_t));
+    memcpy(frame->hdr.h_src, frame_hdr->h_src, sizeof(mac_addr_t));
+    frame->hdr.h_proto = ntohs(frame_hdr->h_proto);
+    frame->len -= ETHER_HEADER_LEN;
+
+    return 1;
+}
+
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame)
+{
+    struct ether_xdp *eth;
+
+    assert(frame != NULL);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return xdp_ether_next(eth, frame, 1);
+}
+
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr)
+{
+    struct ether_xdp *eth;
+    int retval;
+    unsigned n;
+
+    assert(frames != NULL);
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -1;
+
+    if (queue != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nr == 0)
+        return 0;
+    retval = xdp_ether_next(eth, &frames[0], 1);
+    if (retval <= 0)
+        return retval;
+
+    /* Each frame is in its own UMEM frame. */
+    for (n = 1; n < nr; n++) {
+        if (!xdp_ether_next(eth, &frames[n], 0))
+            break;
+    }
+
+    return n;
+}
+
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *iov,
+                unsigned iovcnt,
+                const struct ether_offload *off)
+{
+    const size_t bsize = ether_iov_len(iov, iovcnt);
+    struct ether_xdp *eth;
+    struct xdp_desc *desc;
+    struct ether_hdr *frame_hdr;
+    uint8_t *frame;
+    uint64_t addr;
+    size_t frame_size;
+    int retval;
+
+    assert(iovcnt > 0 && iovcnt <= ETHER_IOV_MAX);
+
+    if (ETHER_HEADER_LEN + bsize > ETHER_MAXLEN)
+        return -EMSGSIZE;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->ex_tx_lock);
+    if (eth->ex_tx_nfree == 0) {
+        xdp_ether_tx_reclaim(eth);
+        if (eth->ex_tx_nfree == 0) {
+            xdp_ether_flush(eth);
+            if (eth->ex_tx_nfree == 0) {
+                retval = -ENOBUFS;
+                goto out;
+            }
+        }
+    }
+    addr = eth->ex_tx_free[--eth->ex_tx_nfree];
+
+    /* The NIC pads the frame and appends the FCS. */
+    frame = eth->ex_umem + addr;
+    frame_hdr = (struct ether_hdr *) frame;
+    frame_size = ETHER_HEADER_LEN + bsize;
+    memcpy(frame_hdr->h_dst, dst, sizeof(mac_addr_t));
+    memcpy(frame_hdr->h_src, eth->ex_mac, sizeof(mac_addr_t));
+    frame_hdr->h_proto = htons(proto);
+    ether_iov_copy(frame + ETHER_HEADER_LEN, iov, iovcnt);
+
+    /* The TX ring has room for all TX frames so it can't be full. */
+    desc = (struct xdp_desc *) eth->ex_tx.desc +
+           (eth->ex_tx.cached & eth->ex_tx.mask);
+    desc->addr = addr;
+    desc->len = frame_size;
+    desc->options = 0;
+    eth->ex_tx.cached++;
+    __atomic_store_n(eth->ex_tx.producer, eth->ex_tx.cached, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&eth->ex_tx_pending, 1, __ATOMIC_RELAXED);
+    retval = (int) frame_size;
+
+    if (!ether_tx_defer(handle)) {
+        const int err = xdp_ether_flush(eth);
+
+        if (err < 0)
+            retval = err;
+    }
+out:
+    pthread_mutex_unlock(&eth->ex_tx_lock);
+    return retval;
+}
+
+int ether_flush(int handle)
+{
+    struct ether_xdp *eth;
+    int retval;
+
+    if (!(eth = ether_handle2eth(handle)))
+        return -errno;
+
+    pthread_mutex_lock(&eth->ex_tx_lock);
+    retval = xdp_ether_flush(eth);
+    pthread_mutex_unlock(&eth->ex_tx_lock);
+
+    return retval;
+}
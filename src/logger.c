@@ -0,0 +1,465 @@
+/*
+ * Binary trace log.
+ *
+ * Each thread writes fixed-size records into a ring of its own, so logging
+ * takes no lock and makes no system call. A record holds the format string,
+ * which must be a literal, and a copy of the arguments; The log thread
+ * formats the records of all the rings in time order and prints them.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue_r.h"
+
+#include "collection.h"
+#include "logger.h"
+
+#define LOG_RECORD_SIZE 128
+#define LOG_LINE_MAX 512
+
+struct log_record {
+    uint64_t ts; /*!< CLOCK_MONOTONIC [ns]. */
+    const char *fmt;
+    const char *func;
+    uint8_t level;
+    uint8_t truncated; /*!< The arguments didn't fit in args. */
+    uint8_t len;       /*!< Bytes used of args. */
+    uint8_t args[LOG_RECORD_SIZE - 3 * sizeof(uint64_t) - 3];
+};
+_Static_assert(sizeof(struct log_record) == LOG_RECORD_SIZE,
+               "Unexpected log record size");
+
+/**
+ * The log ring of a thread.
+ */
+struct log_ring {
+    queue_cb_t cb;
+    uint64_t dropped;  /*!< Records dropped because the ring was full. */
+    uint64_t reported; /*!< Drops already reported, read by the consumer. */
+    int dead;          /*!< The thread has exited. */
+    SLIST_ENTRY(log_ring) _link;
+    struct log_record rec[NSTACK_LOG_RING_NR];
+};
+
+SLIST_HEAD(log_ring_list, log_ring);
+
+/*
+ * Protects the list of rings and serializes the consumers.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring_list log_rings = SLIST_HEAD_INITIALIZER(log_rings);
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+
+static __thread struct log_ring *log_ring;
+
+/**
+ * A conversion specification of a format string.
+ */
+struct log_spec {
+    const char *start; /*!< The '%'. */
+    size_t len;        /*!< Length up to and including the conversion. */
+    char length;       /*!< Length modifier, 'H' for hh and 'L' for ll. */
+    size_t length_len; /*!< Number of characters of the length modifier. */
+    char conv;
+    int star; /*!< Has a variable width or precision. */
+};
+
+/**
+ * Parse the conversion specification starting at p.
+ */
+static const char *log_parse_spec(const char *p, struct log_spec *spec)
+{
+    spec->start = p++;
+    spec->length = '\0';
+    spec->length_len = 0;
+    spec->star = 0;
+
+    while (*p && strchr("-+ #0123456789.*'", *p)) {
+        if (*p == '*')
+            spec->star = 1;
+        p++;
+    }
+    if (*p && strchr("hljztL", *p)) {
+        spec->length = *p++;
+        spec->length_len = 1;
+        if ((spec->length == 'h' || spec->length == 'l') && *p == spec->length) {
+            spec->length = spec->length == 'h' ? 'H' : 'L';
+            spec->length_len = 2;
+            p++;
+        }
+    }
+    spec->conv = *p;
+    if (*p)
+        p++;
+    spec->len = p - spec->start;
+
+    return p;
+}
+
+static int log_is_signed(char conv)
+{
+    return conv == 'd' || conv == 'i';
+}
+
+static int log_is_integer(char conv)
+{
+    return strchr("diouxXc", conv) != NULL;
+}
+
+static int log_is_double(char conv)
+{
+    return strchr("fFeEgGaA", conv) != NULL;
+}
+
+/**
+ * Fetch an integer argument of the given length modifier.
+ */
+static uint64_t log_va_integer(const struct log_spec *spec, va_list *ap)
+{
+    const int sign = log_is_signed(spec->conv);
+
+    switch (spec->length) {
+    case 'H':
+        return sign ? (int64_t)(signed char) va_arg(*ap, int)
+                    : (unsigned char) va_arg(*ap, unsigned);
+    case 'h':
+        return sign ? (int64_t)(short) va_arg(*ap, int)
+                    : (unsigned short) va_arg(*ap, unsigned);
+    case 'l':
+        return sign ? (uint64_t) va_arg(*ap, long)
+                    : (uint64_t) va_arg(*ap, unsigned long);
+    case 'L':
+        return sign ? (uint64_t) va_arg(*ap, long long)
+                    : (uint64_t) va_arg(*ap, unsigned long long);
+    case 'j':
+        return va_arg(*ap, uintmax_t);
+    case 'z':
+        return va_arg(*ap, size_t);
+    case 't':
+        return va_arg(*ap, ptrdiff_t);
+    default:
+        return sign ? (int64_t) va_arg(*ap, int) : va_arg(*ap, unsigned);
+    }
+}
+
+/**
+ * Copy the arguments of fmt into the record.
+ */
+static void log_pack(struct log_record *rec, const char *fmt, va_list *ap)
+{
+    uint8_t *p = rec->args;
+    uint8_t *const end = rec->args + sizeof(rec->args);
+
+    rec->truncated = 0;
+    rec->len = 0;
+    while ((fmt = strchr(fmt, '%'))) {
+        struct log_spec spec;
+        uint64_t v;
+        double d;
+
+        fmt = log_parse_spec(fmt, &spec);
+        if (spec.conv == '%' || spec.conv == '\0') {
+            continue;
+        } else if (spec.star) {
+            /* The format can't be decoded past this point. */
+            rec->truncated = 1;
+            return;
+        } else if (spec.conv == 's') {
+            const char *s = va_arg(*ap, const char *);
+            size_t len;
+
+            if (p == end) {
+                /* Not even the terminator fits. */
+                rec->truncated = 1;
+                return;
+            }
+            if (!s)
+                s = "(null)";
+            len = strnlen(s, end - p);
+            if (len == (size_t)(end - p)) {
+                /* Keep what fits of the string. */
+                len--;
+                rec->truncated = 1;
+            }
+            memcpy(p, s, len);
+            p[len] = '\0';
+            p += len + 1;
+            rec->len = p - rec->args;
+            if (rec->truncated)
+                return;
+            continue;
+        } else if (log_is_double(spec.conv)) {
+            d = spec.length == 'L' ? (double) va_arg(*ap, long double)
+                                   : va_arg(*ap, double);
+            memcpy(&v, &d, sizeof(v));
+        } else if (spec.conv == 'p') {
+            v = (uintptr_t) va_arg(*ap, void *);
+        } else if (log_is_integer(spec.conv)) {
+            v = log_va_integer(&spec, ap);
+        } else {
+            /* %n or an unknown conversion. */
+            (void) va_arg(*ap, void *);
+            continue;
+        }
+
+        if (end - p < (ptrdiff_t) sizeof(v)) {
+            rec->truncated = 1;
+            return;
+        }
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+        rec->len = p - rec->args;
+    }
+}
+
+/**
+ * Format a record into a line.
+ */
+static void log_format(const struct log_record *rec, char *line, size_t size)
+{
+    const uint8_t *p = rec->args;
+    const uint8_t *const end = rec->args + rec->len;
+    const char *fmt = rec->fmt;
+    size_t n;
+
+#define LOG_APPEND(...)                                            \
+    do {                                                           \
+        const int _r_ = snprintf(line + n, size - n, __VA_ARGS__); \
+        if (_r_ > 0)                                               \
+            n = (n + _r_ < size) ? n + _r_ : size - 1;             \
+    } while (0)
+
+    n = 0;
+    LOG_APPEND("%c:%s: ", rec->level, rec->func);
+    while (*fmt) {
+        const char *pct = strchr(fmt, '%');
+        struct log_spec spec;
+        char conv[16];
+        size_t flags_len;
+        uint64_t v;
+
+        if (!pct) {
+            LOG_APPEND("%s", fmt);
+            break;
+        }
+        LOG_APPEND("%.*s", (int) (pct - fmt), fmt);
+        fmt = log_parse_spec(pct, &spec);
+
+        if (spec.conv == '%') {
+            LOG_APPEND("%%");
+            continue;
+        } else if (spec.conv == '\0' || spec.conv == 'n') {
+            continue;
+        } else if (spec.star || spec.len + 3 > sizeof(conv) ||
+                   end - p < (spec.conv == 's' ? 1 : (ptrdiff_t) sizeof(v))) {
+            /* Left out of the record. */
+            LOG_APPEND("%.*s", (int) spec.len, spec.start);
+            continue;
+        }
+
+        if (spec.conv == 's') {
+            memcpy(conv, spec.start, spec.len);
+            conv[spec.len] = '\0';
+            LOG_APPEND(conv, (const char *) p);
+            p += strlen((const char *) p) + 1;
+            continue;
+        }
+
+        /* The flags, width and precision without the length modifier. */
+        flags_len = spec.len - 1 - spec.length_len;
+        memcpy(conv, spec.start, flags_len);
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        if (log_is_double(spec.conv)) {
+            double d;
+
+            conv[flags_len] = spec.conv;
+            conv[flags_len + 1] = '\0';
+            memcpy(&d, &v, sizeof(d));
+            LOG_APPEND(conv, d);
+        } else if (spec.conv == 'p') {
+            conv[flags_len] = spec.conv;
+            conv[flags_len + 1] = '\0';
+            LOG_APPEND(conv, (void *) (uintptr_t) v);
+        } else {
+            /* All integers are printed as long long. */
+            memcpy(conv + flags_len, "ll", 2);
+            conv[flags_len + 2] = spec.conv;
+            conv[flags_len + 3] = '\0';
+            if (spec.conv == 'c')
+                LOG_APPEND("%c", (int) v);
+            else if (log_is_signed(spec.conv))
+                LOG_APPEND(conv, (long long) v);
+            else
+                LOG_APPEND(conv, (unsigned long long) v);
+        }
+    }
+    if (rec->truncated)
+        LOG_APPEND(" [truncated]");
+    LOG_APPEND("\n");
+
+#undef LOG_APPEND
+}
+
+static struct log_record *log_ring_head(struct log_ring *ring)
+{
+    int index;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!queue_peek(&ring->cb, &index))
+        return NULL;
+
+    return (struct log_record *) ((uint8_t *) ring->rec + index);
+}
+
+void log_flush(void)
+{
+    struct log_ring *ring, *ring_tmp;
+    char line[LOG_LINE_MAX];
+
+    pthread_mutex_lock(&log_lock);
+
+    /* Merge the rings in time order. */
+    while (1) {
+        struct log_ring *first = NULL;
+        struct log_record *rec, *first_rec = NULL;
+
+        SLIST_FOREACH (ring, &log_rings, _link) {
+            rec = log_ring_head(ring);
+            if (rec && (!first_rec || rec->ts < first_rec->ts)) {
+                first = ring;
+                first_rec = rec;
+            }
+        }
+        if (!first)
+            break;
+
+        log_format(first_rec, line, sizeof(line));
+        fputs(line, stderr);
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        queue_discard(&first->cb, 1);
+    }
+
+    SLIST_FOREACH_SAFE (ring, &log_rings, _link, ring_tmp) {
+        const uint64_t dropped =
+            __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        if (dropped != ring->reported) {
+            fprintf(stderr, "%c:%s: %llu messages dropped\n", LOG_WARN,
+                    __func__, (unsigned long long) (dropped - ring->reported));
+            ring->reported = dropped;
+        }
+        if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+            queue_is_empty(&ring->cb)) {
+            SLIST_REMOVE(&log_rings, ring, log_ring, _link);
+            free(ring);
+        }
+    }
+
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void *log_thread(void *arg)
+{
+    const struct timespec period = {
+        .tv_sec = NSTACK_LOG_FLUSH_USEC / 1000000,
+        .tv_nsec = NSTACK_LOG_FLUSH_USEC % 1000000 * 1000L,
+    };
+
+    while (1) {
+        nanosleep(&period, NULL);
+        log_flush();
+    }
+
+    return NULL;
+}
+
+/**
+ * Called when a thread exits.
+ */
+static void log_ring_release(void *arg)
+{
+    struct log_ring *ring = arg;
+
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_init(void)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t sigset, oldset;
+
+    pthread_key_create(&log_key, log_ring_release);
+    atexit(log_flush);
+
+    /* The log thread must not take the signals of the stack. */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid, &attr, log_thread, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/**
+ * Create the log ring of the calling thread.
+ */
+static struct log_ring *log_ring_create(void)
+{
+    struct log_ring *ring;
+
+    pthread_once(&log_once, log_init);
+
+    if (!(ring = calloc(1, sizeof(struct log_ring))))
+        return NULL;
+    ring->cb = queue_create(sizeof(struct log_record), sizeof(ring->rec));
+
+    pthread_mutex_lock(&log_lock);
+    SLIST_INSERT_HEAD(&log_rings, ring, _link);
+    pthread_mutex_unlock(&log_lock);
+    pthread_setspecific(log_key, ring);
+
+    return ring;
+}
+
+void log_write(enum log_level level, const char *func, const char *fmt, ...)
+{
+    struct log_ring *ring = log_ring;
+    struct log_record *rec;
+    struct timespec now;
+    va_list ap;
+    int index;
+
+    if (!ring && !(ring = log_ring = log_ring_create()))
+        return;
+
+    if ((index = queue_alloc(&ring->cb)) == -1) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = (struct log_record *) ((uint8_t *) ring->rec + index);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->ts = now.tv_sec * 1000000000ull + now.tv_nsec;
+    rec->fmt = fmt;
+    rec->func = func;
+    rec->level = level;
+    va_start(ap, fmt);
+    log_pack(rec, fmt, &ap);
+    va_end(ap);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue_commit(&ring->cb);
+}
@@ -9,10 +9,30 @@ enum log_level {
     LOG_DEBUG = '4',
 };
 
-#define LOG(_level_, _fmt_, ...)                   \
-    do {                                           \
-        fprintf(stderr,                            \
-                "%c:%s: "_fmt_                     \
-                "\n",                              \
-                _level_, __func__, ##__VA_ARGS__); \
+/**
+ * Test if messages of a level are compiled in.
+ * Messages less severe than NSTACK_LOG_LEVEL are removed at compile time,
+ * along with the evaluation of their arguments.
+ */
+#define LOG_ENABLED(_level_) ((_level_) <= NSTACK_LOG_LEVEL)
+
+/**
+ * Write a message to the log ring of the calling thread.
+ * The arguments are copied as they are, the message is formatted later by
+ * the log thread. A string argument is copied up to the space left in the
+ * record. Variable field widths and precisions ("*") are not supported.
+ */
+void log_write(enum log_level level, const char *func, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Format and print the messages in the log rings of all threads.
+ * This is done periodically by the log thread and at exit.
+ */
+void log_flush(void);
+
+#define LOG(_level_, _fmt_, ...)                                \
+    do {                                                        \
+        if (LOG_ENABLED(_level_))                               \
+            log_write(_level_, __func__, _fmt_, ##__VA_ARGS__); \
     } while (0)
@@ -0,0 +1,116 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "nstack_util.h"
+
+#include "nstack_mbuf.h"
+
+SLIST_HEAD(mbuf_freelist, mbuf);
+
+/**
+ * Free buffers kept by a thread.
+ * A thread that allocates and frees a buffer per packet gets it back from its
+ * own list without taking mbuf_lock.
+ */
+struct mbuf_cache {
+    struct mbuf_freelist list;
+    unsigned nr;
+    int registered; /*!< Returned to the pool when the thread exits. */
+};
+
+static struct mbuf mbuf_pool[NSTACK_MBUF_NR];
+/** The buffers not cached by any thread. */
+static struct mbuf_freelist mbuf_freelist;
+static pthread_mutex_t mbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mbuf_key;
+
+static __thread struct mbuf_cache mbuf_cache;
+
+/**
+ * Move up to n buffers from a list to another.
+ * @returns Returns the number of buffers moved.
+ */
+static unsigned mbuf_move(struct mbuf_freelist *to,
+                          struct mbuf_freelist *from,
+                          unsigned n)
+{
+    unsigned moved;
+
+    for (moved = 0; moved < n && !SLIST_EMPTY(from); moved++) {
+        struct mbuf *m = SLIST_FIRST(from);
+
+        SLIST_REMOVE_HEAD(from, _link);
+        SLIST_INSERT_HEAD(to, m, _link);
+    }
+
+    return moved;
+}
+
+static void mbuf_cache_release(void *arg)
+{
+    struct mbuf_cache *cache = arg;
+
+    pthread_mutex_lock(&mbuf_lock);
+    mbuf_move(&mbuf_freelist, &cache->list, cache->nr);
+    pthread_mutex_unlock(&mbuf_lock);
+    cache->nr = 0;
+}
+
+struct mbuf *mbuf_alloc(void)
+{
+    struct mbuf_cache *cache = &mbuf_cache;
+    struct mbuf *m;
+
+    if (cache->nr == 0) {
+        if (!cache->registered) {
+            pthread_setspecific(mbuf_key, cache);
+            cache->registered = 1;
+        }
+
+        pthread_mutex_lock(&mbuf_lock);
+        cache->nr = mbuf_move(&cache->list, &mbuf_freelist,
+                              NSTACK_MBUF_CACHE_NR / 2);
+        pthread_mutex_unlock(&mbuf_lock);
+        if (cache->nr == 0) {
+            errno = ENOBUFS;
+            return NULL;
+        }
+    }
+    m = SLIST_FIRST(&cache->list);
+    SLIST_REMOVE_HEAD(&cache->list, _link);
+    cache->nr--;
+
+    m->data = m->buf + MBUF_HEADROOM;
+    m->len = 0;
+    return m;
+}
+
+void mbuf_free(struct mbuf *m)
+{
+    struct mbuf_cache *cache = &mbuf_cache;
+
+    if (!m)
+        return;
+
+    SLIST_INSERT_HEAD(&cache->list, m, _link);
+    cache->nr++;
+    if (cache->nr <= NSTACK_MBUF_CACHE_NR && cache->registered)
+        return;
+
+    /* Give the buffers to the other threads, half of them when it's full. */
+    pthread_mutex_lock(&mbuf_lock);
+    cache->nr -= mbuf_move(&mbuf_freelist, &cache->list,
+                           cache->registered ? cache->nr / 2 : cache->nr);
+    pthread_mutex_unlock(&mbuf_lock);
+}
+
+__constructor static void mbuf_init(void)
+{
+    SLIST_INIT(&mbuf_freelist);
+
+    for (size_t i = 0; i < num_elem(mbuf_pool); i++) {
+        SLIST_INSERT_HEAD(&mbuf_freelist, &mbuf_pool[i], _link);
+    }
+
+    pthread_key_create(&mbuf_key, mbuf_cache_release);
+}
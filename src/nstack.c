@@ -2,13 +2,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "linker_set.h"
+#include "nstack_doorbell.h"
 #include "nstack_in.h"
 #include "nstack_socket.h"
 
@@ -17,10 +23,11 @@
 #include "nstack_ether.h"
 #include "nstack_internal.h"
 #include "nstack_ip.h"
+#include "nstack_rss.h"
+#include "nstack_timer.h"
 #include "tcp.h"
 #include "udp.h"
 
-extern void tcp_slowtimo();
 /**
  * nstack ingress and egress thread state.
  */
@@ -36,8 +43,55 @@ SET_DECLARE(_nstack_periodic_tasks, void);
  * nstack state variables.
  */
 static enum nstack_state nstack_state = NSTACK_STOPPED;
-static pthread_t ingress_tid, egress_tid, tcp_timer_tid;
-static int ether_handle;
+static pthread_t egress_tid, timer_tid, doorbell_tid;
+static int egress_started, timer_started, doorbell_started;
+
+/**
+ * Ingress thread, or event loop worker, of an interface RX queue.
+ */
+struct nstack_ingress {
+    pthread_t tid;
+    int ether_handle;
+    unsigned queue;
+    int epfd;   /*!< epoll instance of the event loop worker. */
+    int kickfd; /*!< eventfd to wake up the event loop worker. */
+};
+
+static struct nstack_ingress *ingress;
+static unsigned ingress_nr_threads;
+static unsigned ingress_nr_started; /*!< Threads created so far. */
+
+/*
+ * Flow workers of the software RSS.
+ * The ingress threads, or event loop workers, only dispatch the frames to
+ * the flow workers, which run the input chain.
+ */
+static pthread_t rss_tid[RSS_WORKERS_MAX];
+static unsigned rss_nr_threads;
+
+/*
+ * Event loop mode.
+ * Each worker waits on the packet fd of its RX queue; The first worker also
+ * runs the timers and the egress.
+ */
+static int nstack_event_loop;
+static int timer_fd = -1; /*!< Ticks every NSTACK_TIMER_TICK_USEC. */
+
+/*
+ * eventfd kicked by the doorbell thread, waited on by the egress thread or
+ * the first event loop worker.
+ */
+static int egress_fd = -1;
+
+/**
+ * Sources of events of an event loop worker.
+ */
+enum nstack_event {
+    NSTACK_EV_RX = 0,
+    NSTACK_EV_KICK,
+    NSTACK_EV_TIMER,
+    NSTACK_EV_EGRESS,
+};
 
 static nstack_send_fn *proto_send[] = {
     [XIP_PROTO_TCP] = nstack_tcp_send,
@@ -67,6 +121,25 @@ static struct nstack_sock sockets[] = {
      .shmem_path = "/tmp/tnetcat.sock"},
 };
 
+/*
+ * Doorbells rung by the sockets when they queue a datagram for the egress.
+ */
+static struct nstack_doorbell *egress_db[num_elem(sockets)];
+
+/*
+ * Sockets with datagrams queued for the egress, served in deficit round robin.
+ * Only the egress thread, or the first event loop worker, touches the list.
+ * The doorbell of a socket is armed while the socket is off the list, so the
+ * socket end rings it to join the list, and is quiet while on the list.
+ */
+static TAILQ_HEAD(nstack_sock_list, nstack_sock)
+    egress_active = TAILQ_HEAD_INITIALIZER(egress_active);
+
+/*
+ * Sockets whose egress doorbell rang, a bitmap set by the doorbell thread.
+ */
+static uint32_t egress_ready;
+
 static enum nstack_state get_state(void)
 {
     enum nstack_state *state = &nstack_state;
@@ -79,26 +152,33 @@ static void set_state(enum nstack_state state)
     nstack_state = state;
 }
 
-static int delta_time;
-static int eval_timer(void)
+static void run_periodic_tasks(void)
 {
-    static struct timespec start;
-    struct timespec now;
+    const uint64_t now = nstack_timer_now();
+    void **taskp;
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    delta_time = now.tv_sec - start.tv_sec;
-    if (delta_time >= NSTACK_PERIODIC_EVENT_SEC) {
-        start = now;
-        return !0;
+    SET_FOREACH (taskp, _nstack_periodic_tasks) {
+        nstack_periodic_task_t *task = *(nstack_periodic_task_t **) taskp;
+
+        if (task)
+            task(now);
     }
-    return 0;
 }
 
-static void *nstack_tcp_timer_thread(void *arg)
+/**
+ * Advance the timers every tick.
+ * The wheels catch up with the ticks missed if a tick is late.
+ */
+static void *nstack_timer_thread(void *arg)
 {
     while (1) {
-        usleep(NSTACK_TCP_TIMER_USEC);
-        tcp_slowtimo();
+        usleep(NSTACK_TIMER_TICK_USEC);
+        ether_tx_begin();
+        run_periodic_tasks();
+        ether_tx_end();
+
+        if (get_state() == NSTACK_DYING)
+            break;
     }
     pthread_exit(NULL);
 }
@@ -122,79 +202,186 @@ static int nstack_bind(struct nstack_sock *sock)
     }
 }
 
+/*
+ * Socket wakeups deferred by the calling thread.
+ */
+static __thread unsigned sock_wakeup_depth;
+static __thread uint32_t sock_wakeup_pending; /* A bitmap of sockets. */
+_Static_assert(num_elem(sockets) <= 32, "Too many sockets for the bitmap");
+
+/**
+ * Defer the wakeups of the sockets until nstack_sock_wakeup_end(), so that
+ * a socket receiving several datagrams from a burst is woken up once.
+ */
+static void nstack_sock_wakeup_begin(void)
+{
+    sock_wakeup_depth++;
+}
+
+static void nstack_sock_wakeup_end(void)
+{
+    if (--sock_wakeup_depth > 0)
+        return;
+
+    while (sock_wakeup_pending) {
+        const int i = __builtin_ctz(sock_wakeup_pending);
+
+        sock_wakeup_pending &= sock_wakeup_pending - 1;
+        doorbell_ring(&sockets[i].ctrl->ingress_db);
+    }
+}
+
 int nstack_sock_dgram_input(struct nstack_sock *sock,
                             struct nstack_sockaddr *srcaddr,
                             uint8_t *buf,
-                            size_t bsize)
+                            size_t bsize,
+                            const uint32_t *csum)
 {
     int dgram_index;
     struct nstack_dgram *dgram;
 
-    while ((dgram_index = queue_alloc(sock->ingress_q)) == -1)
-        ;
+    if (bsize > NSTACK_DATAGRAM_SIZE_MAX - sizeof(struct nstack_dgram))
+        return -EMSGSIZE;
+
+    /* The ingress queue has a single producer. */
+    pthread_mutex_lock(&sock->ingress_lock);
+    if ((dgram_index = queue_alloc(sock->ingress_q)) == -1) {
+        /*
+         * The socket buffer is full. The datagram is dropped rather than
+         * waiting for the socket end, which could stall this thread and
+         * all the other flows on it for as long as the socket end likes.
+         */
+        pthread_mutex_unlock(&sock->ingress_lock);
+        doorbell_ring(&sock->ctrl->ingress_db);
+        return -ENOBUFS;
+    }
     dgram = (struct nstack_dgram *) (sock->ingress_data + dgram_index);
 
     dgram->srcaddr = *srcaddr;
     dgram->dstaddr = sock->info.sock_addr;
     dgram->buf_size = bsize;
-    memcpy(dgram->buf, buf, bsize);
+    if (!csum) {
+        memcpy(dgram->buf, buf, bsize);
+    } else if (ip_csum_fold(ip_csum_copy(dgram->buf, buf, bsize, *csum))) {
+        /* The slot is reused by the next datagram. */
+        pthread_mutex_unlock(&sock->ingress_lock);
+        return -EBADMSG;
+    }
 
     queue_commit(sock->ingress_q);
-    kill(sock->ctrl->pid_end, SIGUSR2);
+    pthread_mutex_unlock(&sock->ingress_lock);
+    if (sock_wakeup_depth)
+        sock_wakeup_pending |= 1u << (sock - sockets);
+    else
+        doorbell_ring(&sock->ctrl->ingress_db);
 
     return 0;
 }
 
-static void run_periodic_tasks(int delta_time)
+/**
+ * Pass a burst of received frames up the stack, send the fast replies and
+ * release the frames.
+ * transport -> socket fd
+ */
+static void nstack_ingress_burst(int ether_handle,
+                                 struct ether_frame frames[],
+                                 unsigned n)
 {
-    void **taskp;
+    struct ether_pkt pkt[NSTACK_ETHER_RX_BURST];
+    struct ether_pkt *pkts[NSTACK_ETHER_RX_BURST];
 
-    SET_FOREACH (taskp, _nstack_periodic_tasks) {
-        nstack_periodic_task_t *task = *(nstack_periodic_task_t **) taskp;
+    LOG(LOG_DEBUG, "Frames received: %u", n);
 
-        if (task)
-            task(delta_time);
+    for (unsigned i = 0; i < n; i++) {
+        pkt[i] = (struct ether_pkt){
+            .hdr = &frames[i].hdr,
+            .payload = frames[i].data,
+            .bsize = frames[i].len,
+        };
+        pkts[i] = &pkt[i];
+    }
+
+    ether_tx_begin();
+    nstack_sock_wakeup_begin();
+
+    /* The frames are processed in place in the driver buffers. */
+    ether_input_burst(pkts, n);
+    for (unsigned i = 0; i < n; i++) {
+        if (pkt[i].retval < 0) {
+            LOG(LOG_ERR, "Protocol handling failed: %d", -pkt[i].retval);
+        } else if (pkt[i].retval > 0) {
+            if (ether_output_reply(ether_handle, &frames[i].hdr,
+                                   frames[i].data, pkt[i].retval) < 0) {
+                LOG(LOG_ERR, "Reply failed: %d", errno);
+            }
+        }
+        frames[i].release(&frames[i]);
+    }
+
+    nstack_sock_wakeup_end();
+    if (ether_tx_end() < 0)
+        LOG(LOG_ERR, "Failed to flush the replies");
+}
+
+/**
+ * Pass the frames received by an ingress thread up the stack, or to the flow
+ * workers if the software RSS is used.
+ */
+static void nstack_ingress_dispatch(const struct nstack_ingress *self,
+                                    struct ether_frame frames[],
+                                    unsigned n)
+{
+    if (rss_nr_threads > 0)
+        rss_dispatch(self - ingress, self->ether_handle, frames, n);
+    else
+        nstack_ingress_burst(self->ether_handle, frames, n);
+}
+
+/**
+ * Send a datagram from the egress queue of a socket.
+ * socket fd -> transport
+ */
+static void nstack_egress_dgram(struct nstack_sock *sock,
+                                const struct nstack_dgram *dgram)
+{
+    enum nstack_sock_proto proto;
+
+    LOG(LOG_DEBUG, "Sending a datagram");
+    proto = sock->info.sock_proto;
+    if (proto > XIP_PROTO_NONE && proto < XIP_PROTO_LAST) {
+        if (proto_send[proto](sock, dgram) < 0) {
+            LOG(LOG_ERR, "Failed to send a datagram");
+        }
+    } else {
+        LOG(LOG_ERR, "Invalid protocol");
     }
 }
 
 /**
  * Handle the ingress traffic.
- * All ingress data is handled in a single pipeline until this point where
- * the data is demultiplexed to sockets.
- * transport -> socket fd
+ * There is one ingress thread per RX queue of each interface, each handling
+ * its own flows in a single pipeline until this point where the data is
+ * demultiplexed to sockets.
+ * @param arg is a pointer to the struct nstack_ingress of the thread.
  */
 static void *nstack_ingress_thread(void *arg)
 {
-    static uint8_t rx_buffer[ETHER_MAXLEN];
+    const struct nstack_ingress *self = arg;
+    const int ether_handle = self->ether_handle;
+    const unsigned queue = self->queue;
 
     while (1) {
-        struct ether_hdr hdr;
+        struct ether_frame frames[NSTACK_ETHER_RX_BURST];
         int retval;
 
         LOG(LOG_DEBUG, "Waiting for rx");
 
-        retval =
-            ether_receive(ether_handle, &hdr, rx_buffer, sizeof(rx_buffer));
+        retval = ether_receive_burst(ether_handle, queue, frames,
+                                     num_elem(frames));
         if (retval == -1) {
             LOG(LOG_ERR, "Rx failed: %d", errno);
         } else if (retval > 0) {
-            LOG(LOG_DEBUG, "Frame received!");
-
-            retval = ether_input(&hdr, rx_buffer, retval);
-            if (retval == -1) {
-                LOG(LOG_ERR, "Protocol handling failed: %d", errno);
-            } else if (retval > 0) {
-                retval =
-                    ether_output_reply(ether_handle, &hdr, rx_buffer, retval);
-                if (retval < 0) {
-                    LOG(LOG_ERR, "Reply failed: %d", errno);
-                }
-            }
-        }
-
-        if (eval_timer()) {
-            LOG(LOG_DEBUG, "tick");
-            run_periodic_tasks(delta_time);
+            nstack_ingress_dispatch(self, frames, retval);
         }
 
         if (get_state() == NSTACK_DYING) {
@@ -205,57 +392,311 @@ static void *nstack_ingress_thread(void *arg)
     pthread_exit(NULL);
 }
 
+/**
+ * Flow worker of the software RSS.
+ * The worker runs the input chain of the flows steered to it from all the
+ * ingress threads.
+ * @param arg is the index of the worker.
+ */
+static void *nstack_rss_thread(void *arg)
+{
+    const unsigned worker = (uintptr_t) arg;
+
+    while (1) {
+        struct ether_frame frames[NSTACK_ETHER_RX_BURST];
+        int ether_handle;
+        int retval;
+
+        retval = rss_receive_burst(worker, &ether_handle, frames,
+                                   num_elem(frames));
+        if (retval > 0)
+            nstack_ingress_burst(ether_handle, frames, retval);
+
+        if (get_state() == NSTACK_DYING)
+            break;
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Wake up the doorbell thread.
+ */
+static void nstack_egress_kick(void)
+{
+    for (size_t i = 0; i < num_elem(sockets); i++) {
+        if (egress_db[i])
+            doorbell_kick(egress_db[i]);
+    }
+}
+
+/**
+ * Add the sockets that rang their doorbells since the last round to the tail
+ * of the active list.
+ * Only the sockets that rang are visited, an idle socket costs nothing.
+ */
+static void nstack_egress_join(void)
+{
+    uint32_t ready = __atomic_exchange_n(&egress_ready, 0, __ATOMIC_ACQUIRE);
+
+    while (ready) {
+        const int i = __builtin_ctz(ready);
+        struct nstack_sock *sock = sockets + i;
+
+        ready &= ready - 1;
+        if (!sock->egress_active) {
+            /* The socket end doesn't ring while we serve the socket. */
+            doorbell_done(egress_db[i]);
+            sock->egress_active = 1;
+            sock->egress_deficit = 0;
+            TAILQ_INSERT_TAIL(&egress_active, sock, _egress_link);
+        }
+    }
+}
+
+/**
+ * Arm the doorbell of a socket that has emptied its egress queue.
+ * @returns Returns 0 if the socket queued a datagram meanwhile and must stay
+ *          in the active list.
+ */
+static int nstack_egress_leave(struct nstack_sock *sock)
+{
+    struct nstack_doorbell *db = egress_db[sock - sockets];
+
+    doorbell_prepare(db);
+    if (!queue_is_empty(sock->egress_q)) {
+        doorbell_done(db);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Serve each active socket once.
+ * A socket sends its datagrams in a burst until they would exceed its
+ * deficit, which grows by NSTACK_EGRESS_QUANTUM every round, and leaves the
+ * list once its queue is empty.
+ * @returns Returns 0 if there was nothing to send.
+ */
+static int nstack_egress_round(void)
+{
+    struct nstack_sock *sock, *tmp;
+
+    nstack_egress_join();
+    if (TAILQ_EMPTY(&egress_active))
+        return 0;
+
+    TAILQ_FOREACH_SAFE(sock, &egress_active, _egress_link, tmp) {
+        int dgram_index;
+
+        sock->egress_deficit += NSTACK_EGRESS_QUANTUM;
+        while (queue_peek(sock->egress_q, &dgram_index)) {
+            const struct nstack_dgram *dgram =
+                (struct nstack_dgram *) (sock->egress_data + dgram_index);
+            const size_t cost = min(dgram->buf_size, NSTACK_DATAGRAM_SIZE_MAX);
+
+            if (cost > sock->egress_deficit)
+                break;
+            sock->egress_deficit -= cost;
+            nstack_egress_dgram(sock, dgram);
+            queue_discard(sock->egress_q, 1);
+        }
+
+        if (queue_is_empty(sock->egress_q) && nstack_egress_leave(sock)) {
+            TAILQ_REMOVE(&egress_active, sock, _egress_link);
+            sock->egress_active = 0;
+            sock->egress_deficit = 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Wait until the doorbell thread kicks egress_fd or the timeout expires.
+ * The kicks are consumed before the active list is joined, so a kick that
+ * comes later ends the next wait.
+ */
+static void nstack_egress_wait(int timeout_ms)
+{
+    struct pollfd pfd = {
+        .fd = egress_fd,
+        .events = POLLIN,
+    };
+    uint64_t kicks;
+
+    if (poll(&pfd, 1, timeout_ms) > 0 &&
+        read(egress_fd, &kicks, sizeof(kicks)) == -1 && errno != EAGAIN)
+        LOG(LOG_ERR, "Failed to read the egress kicks: %d", errno);
+}
+
 /**
  * Handle the egress traffic.
  * All egress traffic is mux'd and serialized through one egress pipe.
- * socket fd -> transport
  */
 static void *nstack_egress_thread(void *arg)
 {
-    sigset_t sigset;
+    while (1) {
+        int sent;
 
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR2);
+        ether_tx_begin();
+        sent = nstack_egress_round();
+        if (ether_tx_end() < 0)
+            LOG(LOG_ERR, "Failed to flush the egress batch");
 
-    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) == -1) {
-        LOG(LOG_ERR, "Unable to ignore SIGUSR2");
-        abort();
+        if (get_state() == NSTACK_DYING)
+            break;
+
+        if (!sent)
+            nstack_egress_wait(NSTACK_PERIODIC_EVENT_SEC * 1000);
     }
 
-    while (1) {
-        struct timespec timeout = {
-            .tv_sec = NSTACK_PERIODIC_EVENT_SEC,
-            .tv_nsec = 0,
-        };
+    pthread_exit(NULL);
+}
+
+/**
+ * Bridge the egress doorbells to egress_fd.
+ * The sockets off the active list ring their doorbells when they queue a
+ * datagram, which wakes up this thread. The thread marks them ready and kicks
+ * the egress thread, or the first event loop worker, through egress_fd. It
+ * only exists because neither poll nor epoll can wait on a futex, it never
+ * touches a packet.
+ */
+static void *nstack_doorbell_thread(void *arg)
+{
+    const struct timespec timeout = {.tv_sec = NSTACK_PERIODIC_EVENT_SEC};
+    const uint64_t kick = 1;
+    uint32_t seq[num_elem(sockets)];
 
-        sigtimedwait(&sigset, NULL, &timeout);
+    /*
+     * Each wait is on the values the previous one compared against, so a
+     * ring that lands while we kick the worker ends the next wait at once.
+     */
+    for (size_t i = 0; i < num_elem(sockets); i++)
+        seq[i] = __atomic_load_n(&egress_db[i]->seq, __ATOMIC_ACQUIRE);
 
+    while (get_state() != NSTACK_DYING) {
+        uint32_t rung = 0;
+
+        doorbell_wait_any(egress_db, seq, num_elem(sockets), &timeout);
         for (size_t i = 0; i < num_elem(sockets); i++) {
-            struct nstack_sock *sock = sockets + i;
-
-            if (!queue_is_empty(sock->egress_q)) {
-                int dgram_index;
-                struct nstack_dgram *dgram;
-                enum nstack_sock_proto proto;
-
-                while (!queue_peek(sock->egress_q, &dgram_index))
-                    ;
-                dgram =
-                    (struct nstack_dgram *) (sock->egress_data + dgram_index);
-
-                LOG(LOG_DEBUG, "Sending a datagram");
-                proto = sock->info.sock_proto;
-                if (proto > XIP_PROTO_NONE && proto < XIP_PROTO_LAST) {
-                    if (proto_send[proto](sock, dgram) < 0) {
-                        LOG(LOG_ERR, "Failed to send a datagram");
-                    }
-                } else {
-                    LOG(LOG_ERR, "Invalid protocol");
-                }
-
-                queue_discard(sock->egress_q, 1);
+            const uint32_t now =
+                __atomic_load_n(&egress_db[i]->seq, __ATOMIC_ACQUIRE);
+
+            if (now != seq[i])
+                rung |= 1u << i;
+            seq[i] = now;
+        }
+        if (!rung)
+            continue;
+
+        __atomic_fetch_or(&egress_ready, rung, __ATOMIC_RELEASE);
+        if (write(egress_fd, &kick, sizeof(kick)) == -1)
+            LOG(LOG_ERR, "Failed to kick the egress: %d", errno);
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Receive up to NSTACK_EVENT_LOOP_RX_BURST frames from the RX queue of a
+ * worker. The queue is level triggered, so anything left is picked up on the
+ * next round after the other events had their turn.
+ */
+static void nstack_worker_rx(const struct nstack_ingress *self)
+{
+    unsigned budget = NSTACK_EVENT_LOOP_RX_BURST;
+
+    while (budget > 0) {
+        struct ether_frame frames[NSTACK_ETHER_RX_BURST];
+        int retval;
+
+        retval = ether_receive_burst(
+            self->ether_handle, self->queue, frames,
+            budget < num_elem(frames) ? budget : num_elem(frames));
+        if (retval == -1)
+            LOG(LOG_ERR, "Rx failed: %d", errno);
+        if (retval <= 0)
+            break;
+        nstack_ingress_dispatch(self, frames, retval);
+        budget -= retval;
+    }
+}
+
+static void nstack_worker_timer(void)
+{
+    uint64_t expirations;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+        return;
+
+    /* The wheels catch up with any ticks we missed. */
+    run_periodic_tasks();
+
+    /*
+     * A driver may leave frames queued at the end of a batch, e.g. an XDP
+     * TX ring in copy mode, and the interface may not receive anything that
+     * would kick them out.
+     */
+    for (unsigned i = 0; i < ingress_nr_threads; i++) {
+        if (ingress[i].queue == 0 && ether_flush(ingress[i].ether_handle) < 0)
+            LOG(LOG_ERR, "Failed to flush interface %d",
+                ingress[i].ether_handle);
+    }
+}
+
+/**
+ * Event loop worker.
+ * The worker multiplexes the packet fd of its RX queue and, on the first
+ * worker, the timer tick and the egress doorbell, so that a single thread
+ * handles all the packets with no handoffs. Only the doorbell rings of the
+ * sockets reach it through nstack_doorbell_thread().
+ * @param arg is a pointer to the struct nstack_ingress of the worker.
+ */
+static void *nstack_worker_thread(void *arg)
+{
+    const struct nstack_ingress *self = arg;
+
+    while (1) {
+        struct epoll_event events[4];
+        int timeout = -1;
+        int n;
+
+        /* Don't sleep while the active sockets have datagrams left. */
+        if (self == ingress && !TAILQ_EMPTY(&egress_active))
+            timeout = 0;
+        n = epoll_wait(self->epfd, events, num_elem(events), timeout);
+        if (n == -1 && errno != EINTR) {
+            LOG(LOG_ERR, "epoll_wait failed: %d", errno);
+            break;
+        }
+
+        ether_tx_begin();
+        for (int i = 0; i < n; i++) {
+            uint64_t kicks;
+
+            switch (events[i].data.u32) {
+            case NSTACK_EV_RX:
+                nstack_worker_rx(self);
+                break;
+            case NSTACK_EV_TIMER:
+                nstack_worker_timer();
+                break;
+            case NSTACK_EV_EGRESS:
+                if (read(egress_fd, &kicks, sizeof(kicks)) == -1 &&
+                    errno != EAGAIN)
+                    LOG(LOG_ERR, "Failed to read the egress kicks: %d", errno);
+                break;
+            default: /* Woken up by nstack_stop(). */
+                break;
             }
         }
+        if (self == ingress)
+            nstack_egress_round();
+        if (ether_tx_end() < 0)
+            LOG(LOG_ERR, "Failed to flush the egress batch");
 
         if (get_state() == NSTACK_DYING)
             break;
@@ -292,6 +733,10 @@ static void nstack_init(void)
             .pid_inetd = mypid,
             .pid_end = 0,
         };
+        egress_db[i] = &sock->ctrl->egress_db;
+        /* The socket is off the active list until it rings. */
+        doorbell_prepare(egress_db[i]);
+        pthread_mutex_init(&sock->ingress_lock, NULL);
 
         sock->ingress_data = NSTACK_INGRESS_DADDR(pa);
         sock->ingress_q = NSTACK_INGRESS_QADDR(pa);
@@ -310,58 +755,394 @@ static void nstack_init(void)
     }
 }
 
-int nstack_start(int handle)
+static int nstack_epoll_add(int epfd, int fd, enum nstack_event event)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u32 = event,
+    };
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Create the fds the first event loop worker waits on besides its RX queue.
+ */
+static int nstack_worker_fds(void)
 {
-    ether_handle = handle;
+    const struct itimerspec tick = {
+        .it_interval.tv_sec = NSTACK_TIMER_TICK_USEC / 1000000,
+        .it_interval.tv_nsec = NSTACK_TIMER_TICK_USEC % 1000000 * 1000L,
+        .it_value.tv_sec = NSTACK_TIMER_TICK_USEC / 1000000,
+        .it_value.tv_nsec = NSTACK_TIMER_TICK_USEC % 1000000 * 1000L,
+    };
 
-    if (get_state() != NSTACK_STOPPED) {
-        errno = EALREADY;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1 || timerfd_settime(timer_fd, 0, &tick, NULL))
+        return -1;
+
+    if (nstack_epoll_add(ingress[0].epfd, timer_fd, NSTACK_EV_TIMER) ||
+        nstack_epoll_add(ingress[0].epfd, egress_fd, NSTACK_EV_EGRESS))
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Set up the epoll instance of an event loop worker.
+ */
+static int nstack_worker_init(struct nstack_ingress *worker)
+{
+    const int fd = ether_handle2fd(worker->ether_handle, worker->queue);
+
+    if (fd == -1)
+        return -1;
+
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epfd == -1)
+        return -1;
+
+    worker->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->kickfd == -1)
         return -1;
+
+    if (nstack_epoll_add(worker->epfd, fd, NSTACK_EV_RX) ||
+        nstack_epoll_add(worker->epfd, worker->kickfd, NSTACK_EV_KICK))
+        return -1;
+
+    return 0;
+}
+
+static void nstack_close_fd(int *fd)
+{
+    if (*fd != -1)
+        close(*fd);
+    *fd = -1;
+}
+
+static void nstack_free_workers(void)
+{
+    for (unsigned i = 0; ingress && i < ingress_nr_threads; i++) {
+        nstack_close_fd(&ingress[i].epfd);
+        nstack_close_fd(&ingress[i].kickfd);
     }
+    nstack_close_fd(&timer_fd);
+    nstack_close_fd(&egress_fd);
+}
 
-    nstack_init();
+/**
+ * Pin a thread to a CPU.
+ * @param[in] attr is the attribute object the thread is created with.
+ * @param[in] index is the index of the thread, CPUs are assigned round-robin.
+ */
+static int nstack_pin_thread(pthread_attr_t *attr, unsigned index)
+{
+    cpu_set_t cpus;
+    unsigned cpu, nth;
 
-    if (pthread_create(&ingress_tid, NULL, nstack_ingress_thread, NULL)) {
+    if (sched_getaffinity(0, sizeof(cpus), &cpus))
         return -1;
+    nth = index % CPU_COUNT(&cpus);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && nth-- == 0)
+            break;
+    }
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    return pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+/**
+ * Start the flow workers of the software RSS.
+ * The workers are pinned after the ingress threads. On failure the workers
+ * already started are left to nstack_stop_rss().
+ */
+static int nstack_start_rss(unsigned nr_workers, int pin)
+{
+    for (unsigned i = 0; i < nr_workers; i++) {
+        pthread_attr_t attr;
+        int err;
+
+        pthread_attr_init(&attr);
+        err = pin ? nstack_pin_thread(&attr, ingress_nr_threads + i) : 0;
+        if (!err)
+            err = pthread_create(&rss_tid[i], &attr, nstack_rss_thread,
+                                 (void *) (uintptr_t) i);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            /* pthread_create() returns the error number. */
+            if (err > 0)
+                errno = err;
+            return -1;
+        }
+        rss_nr_threads++;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the flow workers.
+ * The ingress threads must have been stopped.
+ */
+static void nstack_stop_rss(void)
+{
+    for (unsigned i = 0; i < rss_nr_threads; i++)
+        rss_wakeup(i);
+    for (unsigned i = 0; i < rss_nr_threads; i++)
+        pthread_join(rss_tid[i], NULL);
+    rss_nr_threads = 0;
+    rss_deinit();
+}
+
+/**
+ * Stop the threads started so far, and release the resources of the stack.
+ * The threads see the state change as soon as they are woken up, and exit.
+ */
+static void nstack_teardown(void)
+{
+    const uint64_t kick = 1;
+
+    set_state(NSTACK_DYING);
+    nstack_egress_kick();
+    if (egress_fd != -1 && write(egress_fd, &kick, sizeof(kick)) == -1)
+        LOG(LOG_ERR, "Failed to wake up the egress: %d", errno);
+    for (unsigned i = 0; i < ingress_nr_started; i++) {
+        if (ingress[i].kickfd != -1 &&
+            write(ingress[i].kickfd, &kick, sizeof(kick)) == -1)
+            LOG(LOG_ERR, "Failed to wake up a worker: %d", errno);
     }
 
-    if (pthread_create(&egress_tid, NULL, nstack_egress_thread, NULL)) {
-        pthread_cancel(ingress_tid);
+    for (unsigned i = 0; i < ingress_nr_started; i++)
+        pthread_join(ingress[i].tid, NULL);
+    ingress_nr_started = 0;
+    if (egress_started)
+        pthread_join(egress_tid, NULL);
+    if (timer_started)
+        pthread_join(timer_tid, NULL);
+    if (doorbell_started)
+        pthread_join(doorbell_tid, NULL);
+    egress_started = timer_started = doorbell_started = 0;
+
+    /* The flow workers are fed by the ingress threads, stopped by now. */
+    nstack_stop_rss();
+    nstack_free_workers();
+
+    free(ingress);
+    ingress = NULL;
+    ingress_nr_threads = 0;
+
+    set_state(NSTACK_STOPPED);
+}
+
+/**
+ * Start the stack.
+ * The stack runs either as a set of fixed threads, one ingress thread per
+ * RX queue plus an egress and a timer thread, or with event_loop=1 as
+ * one event loop worker per RX queue. Both have a doorbell thread waking up
+ * the egress. With rss=N the received frames are
+ * dispatched to N flow workers by a hash of their flows. With pin=1 the
+ * ingress threads or workers, and the flow workers, are pinned to CPUs.
+ * @param[in] handles is an array of initialized ether interfaces.
+ * @param[in] nr_handles is the number of elements in handles.
+ * @param[in] args is a NULL terminated array of stack options in the form
+ *                 "name=value", args[0] is ignored.
+ */
+int nstack_start(const int handles[], size_t nr_handles, char *const args[])
+{
+    unsigned nr_threads = 0, nr_rss;
+    const char *value;
+    int pin, saved_errno;
+
+    if (get_state() != NSTACK_STOPPED) {
+        errno = EALREADY;
         return -1;
     }
 
-    if (pthread_create(&tcp_timer_tid, NULL, nstack_tcp_timer_thread, NULL)) {
-        pthread_cancel(ingress_tid);
-        pthread_cancel(egress_tid);
+    value = ether_arg(args, "event_loop");
+    nstack_event_loop = value ? !!strtoul(value, NULL, 0) : 0;
+    value = ether_arg(args, "pin");
+    pin = value ? !!strtoul(value, NULL, 0) : 0;
+    value = ether_arg(args, "rss");
+    nr_rss = value ? strtoul(value, NULL, 0) : 0;
+    if (nr_rss > RSS_WORKERS_MAX) {
+        errno = EINVAL;
         return -1;
     }
 
+    for (size_t i = 0; i < nr_handles; i++) {
+        const unsigned nr_queues = ether_handle2queues(handles[i]);
+
+        if (nr_queues == 0) {
+            errno = ENODEV;
+            goto fail;
+        }
+        ingress_nr_threads += nr_queues;
+    }
+    ingress = calloc(ingress_nr_threads, sizeof(struct nstack_ingress));
+    if (!ingress)
+        goto fail;
+    for (size_t i = 0; i < nr_handles; i++) {
+        const unsigned nr_queues = ether_handle2queues(handles[i]);
+
+        for (unsigned queue = 0; queue < nr_queues; queue++) {
+            ingress[nr_threads++] = (struct nstack_ingress){
+                .ether_handle = handles[i],
+                .queue = queue,
+                .epfd = -1,
+                .kickfd = -1,
+            };
+        }
+    }
+
+    if (rss_init(nr_rss, ingress_nr_threads))
+        goto fail;
+
+    egress_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (egress_fd == -1)
+        goto fail;
+
+    if (nstack_event_loop) {
+        for (unsigned i = 0; i < ingress_nr_threads; i++) {
+            if (nstack_worker_init(&ingress[i]))
+                goto fail;
+        }
+        if (nstack_worker_fds())
+            goto fail;
+    }
+
+    nstack_init();
+
+    if (nstack_start_rss(nr_rss, pin))
+        goto fail;
+
+    for (unsigned i = 0; i < ingress_nr_threads; i++) {
+        pthread_attr_t attr;
+        int err;
+
+        pthread_attr_init(&attr);
+        err = pin ? nstack_pin_thread(&attr, i) : 0;
+        if (!err)
+            err = pthread_create(&ingress[i].tid, &attr,
+                                 nstack_event_loop ? nstack_worker_thread
+                                                   : nstack_ingress_thread,
+                                 &ingress[i]);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            if (err > 0)
+                errno = err;
+            goto fail;
+        }
+        ingress_nr_started++;
+    }
+
+    if ((errno = pthread_create(&doorbell_tid, NULL, nstack_doorbell_thread,
+                                NULL)))
+        goto fail;
+    doorbell_started = 1;
+
+    if (!nstack_event_loop) {
+        if ((errno = pthread_create(&egress_tid, NULL, nstack_egress_thread,
+                                    NULL)))
+            goto fail;
+        egress_started = 1;
+
+        if ((errno = pthread_create(&timer_tid, NULL, nstack_timer_thread,
+                                    NULL)))
+            goto fail;
+        timer_started = 1;
+    }
+
     set_state(NSTACK_RUNNING);
     return 0;
+fail:
+    saved_errno = errno;
+    nstack_teardown();
+    errno = saved_errno;
+    return -1;
 }
 
 void nstack_stop(void)
 {
-    set_state(NSTACK_DYING);
+    nstack_teardown();
+}
 
-    pthread_join(ingress_tid, NULL);
-    pthread_join(egress_tid, NULL);
-    pthread_join(tcp_timer_tid, NULL);
+/**
+ * Configure the IP address of an interface.
+ * The address is given by the addr=A.B.C.D[/PREFIX] option; The first
+ * interface defaults to STACK_IP.
+ */
+static int nstack_ifconfig(int handle, char *const args[])
+{
+    const char *value = ether_arg(args, "addr");
+    in_addr_t ip_addr = STACK_IP, netmask = SUBNET_MASK;
+
+    if (value) {
+        char str[IP_STR_LEN];
+        const char *prefix = strchr(value, '/');
+        const size_t len = prefix ? (size_t)(prefix - value) : strlen(value);
+
+        if (len >= sizeof(str))
+            goto inval;
+        memcpy(str, value, len);
+        str[len] = '\0';
+        if (str2ip(str, &ip_addr))
+            goto inval;
+        if (prefix) {
+            const unsigned long bits = strtoul(prefix + 1, NULL, 10);
+
+            if (bits == 0 || bits > 32)
+                goto inval;
+            netmask = ~0u << (32 - bits);
+        }
+    } else if (handle != 0) {
+        goto inval;
+    }
 
-    set_state(NSTACK_STOPPED);
+    return ip_config(handle, ip_addr, netmask);
+inval:
+    errno = EINVAL;
+    return -1;
 }
 
 int main(int argc, char *argv[])
 {
-    char *const ether_args[] = {
-        argv[1],
-        NULL,
-    };
-    int handle;
+    /* Arguments of each interface as a NULL terminated array. */
+    char *args[2 * argc];
+    /* Stack options given before the first interface. */
+    char *stack_args[argc + 1];
+    size_t nr_stack_args = 0;
+    char **if_args[NSTACK_ETHER_MAX_IF];
+    int handles[NSTACK_ETHER_MAX_IF];
+    size_t nr_ifs = 0, n = 0;
     sigset_t sigset;
 
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s INTERFACE\n", argv[0]);
+    for (int i = 1; i < argc; i++) {
+        if (!strchr(argv[i], '=')) { /* Next interface */
+            if (nr_ifs == NSTACK_ETHER_MAX_IF) {
+                fprintf(stderr, "Too many interfaces\n");
+                exit(1);
+            }
+            if (nr_ifs > 0)
+                args[n++] = NULL;
+            if_args[nr_ifs++] = args + n;
+        } else if (nr_ifs == 0) {
+            stack_args[++nr_stack_args] = argv[i];
+            continue;
+        }
+        args[n++] = argv[i];
+    }
+    args[n] = NULL;
+    stack_args[0] = argv[0];
+    stack_args[nr_stack_args + 1] = NULL;
+
+    if (nr_ifs == 0) {
+        fprintf(stderr,
+                "Usage: %s [OPTION=VALUE]... INTERFACE [OPTION=VALUE]... "
+                "[INTERFACE [OPTION=VALUE]...]...\n",
+                argv[0]);
         exit(1);
     }
 
@@ -371,29 +1152,37 @@ int main(int argc, char *argv[])
     /* Block sigset for all future threads */
     sigprocmask(SIG_SETMASK, &sigset, NULL);
 
-    handle = ether_init(ether_args);
-    if (handle == -1) {
-        perror("Failed to init");
-        exit(1);
-    } else if (handle == -2) {
-        perror("Interface identifier is too long");
-        exit(1);
+    for (size_t i = 0; i < nr_ifs; i++) {
+        const int handle = ether_init(if_args[i]);
+
+        if (handle == -1) {
+            perror("Failed to init");
+            exit(1);
+        } else if (handle == -2) {
+            perror("Interface identifier is too long");
+            exit(1);
+        }
+        handles[i] = handle;
+
+        if (nstack_ifconfig(handle, if_args[i])) {
+            perror("Failed to config IP");
+            exit(1);
+        }
     }
 
-    if (ip_config(handle, STACK_IP, SUBNET_MASK)) {
-        perror("Failed to config IP");
+    if (nstack_start(handles, nr_ifs, stack_args)) {
+        perror("Failed to start the IP stack");
         exit(1);
     }
 
-    nstack_start(handle);
-
     sigwaitinfo(&sigset, NULL);
 
     fprintf(stderr, "Stopping the IP stack...\n");
 
     nstack_stop();
 
-    ether_deinit(handle);
+    for (size_t i = 0; i < nr_ifs; i++)
+        ether_deinit(handles[i]);
 
     return 0;
 }
@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "linker_set.h"
 #include "nstack_link.h"
@@ -33,6 +35,36 @@
  * @}
  */
 
+/**
+ * Room guaranteed after the payload of a received frame.
+ * Protocol handlers build replies in place and a reply can be this much
+ * longer than the received payload, e.g. an ICMP destination unreachable.
+ */
+#define ETHER_RX_TAILROOM 64
+
+/**
+ * Interface capabilities.
+ * @{
+ */
+#define ETHER_CAP_SW_FCS 0x1  /*!< Frames are padded and get a software FCS. */
+#define ETHER_CAP_TX_CSUM 0x2 /*!< Offloaded L4 checksums are completed. */
+#define ETHER_CAP_TSO 0x4     /*!< TCP super-frames are segmented. */
+/**
+ * @}
+ */
+
+/**
+ * Max payload length of a super-frame.
+ * Received frames can be this long if the driver accepts frames merged by
+ * GRO, and so can sent frames with a gso_size on ETHER_CAP_TSO interfaces.
+ */
+#define ETHER_GSO_MAXLEN 65535
+
+/**
+ * Max number of segments in a chain given to ether_sendv().
+ */
+#define ETHER_IOV_MAX 64
+
 /**
  * Protocol type IDs.
  * @{
@@ -57,9 +89,62 @@ struct ether_hdr {
     uint16_t h_proto; /*!< Packet type ID */
 } __attribute__((packed));
 
+/**
+ * A received frame lent by the driver.
+ * The payload points directly into the driver buffer, e.g. into a kernel
+ * mapped ring, and stays valid until the frame is released.
+ */
+struct ether_frame {
+    struct ether_hdr hdr; /*!< Frame header in host byte order. */
+    uint8_t *data;        /*!< Payload. */
+    size_t len;           /*!< Length of the payload. */
+    /**
+     * Return the buffer to the driver.
+     */
+    void (*release)(struct ether_frame *frame);
+    void *priv; /*!< Driver private data. */
+};
+
+/**
+ * Offloads requested for an outgoing frame.
+ * The L4 checksum is computed over the payload from csum_start to the end
+ * and stored at csum_start + csum_offset, where the caller has left the
+ * pseudo-header sum, like CHECKSUM_PARTIAL of Linux.
+ */
+struct ether_offload {
+    uint16_t csum_start;  /*!< Offset of the L4 header in the payload. */
+    uint16_t csum_offset; /*!< Offset of the checksum from csum_start. */
+    uint16_t gso_size;    /*!< TCP payload per segment; 0 if not TSO. */
+};
+
+struct ip_hdr;
+
+/**
+ * A packet in a burst passed up the input chain.
+ * Each layer points payload and bsize to its own part of the packet before
+ * passing the burst on, and the handler of the packet leaves its result in
+ * retval.
+ */
+struct ether_pkt {
+    const struct ether_hdr *hdr; /*!< Frame header in host byte order. */
+    struct ip_hdr *ip_hdr;       /*!< IP header, set by the IP layer. */
+    uint8_t *payload;            /*!< Payload of the current layer. */
+    size_t bsize;                /*!< Size of the payload. */
+    /**
+     * The size of the reply written back over the frame payload, 0 if no
+     * reply should be sent, or a negative errno code.
+     */
+    int retval;
+};
+
 struct _ether_proto_handler {
     uint16_t proto_id;
     int (*fn)(const struct ether_hdr *hdr, uint8_t *payload, size_t bsize);
+    /**
+     * Handle a burst of packets; NULL if the packets are passed to fn one at
+     * a time.
+     */
+    void (*burst_fn)(struct ether_pkt *pkts[], unsigned n);
 };
 
 /**
@@ -72,13 +157,76 @@ struct _ether_proto_handler {
     };                                                                         \
     DATA_SET(_ether_proto_handlers, _ether_proto_handler_##_handler_fn_)
 
+/**
+ * Declare an ethernet input chain handler with a burst variant.
+ */
+#define ETHER_PROTO_INPUT_BURST_HANDLER(_proto_id_, _handler_fn_, _burst_fn_)  \
+    static struct _ether_proto_handler _ether_proto_handler_##_handler_fn_ = { \
+        .proto_id = _proto_id_,                                                \
+        .fn = _handler_fn_,                                                    \
+        .burst_fn = _burst_fn_,                                                \
+    };                                                                         \
+    DATA_SET(_ether_proto_handlers, _ether_proto_handler_##_handler_fn_)
+
 
 extern const mac_addr_t mac_broadcast_addr;
 
+/**
+ * Initialize an ether interface.
+ * @param[in] args is a NULL terminated array where args[0] is the interface
+ *                 name and the rest are driver options in "name=value" form.
+ * @returns Returns a handle to the interface;
+ *          Otherwise -1 is returned and errno is set.
+ */
 int ether_init(char *const args[]);
 void ether_deinit(int ether_handle);
+
+/**
+ * Calculate the Ethernet CRC-32.
+ * The fastest implementation supported by the CPU is selected at startup.
+ */
 uint32_t ether_fcs(const void *data, size_t bsize);
 
+/**
+ * Pad a frame to ETHER_MINLEN and append its FCS.
+ * Used by drivers with the ETHER_CAP_SW_FCS capability.
+ * @param[in,out] frame must have room for the padding and the FCS.
+ * @param[in] frame_size is the size of the frame without FCS.
+ * @returns Returns the new size of the frame.
+ */
+size_t ether_fcs_append(uint8_t *frame, size_t frame_size);
+
+/**
+ * Complete an offloaded checksum in software.
+ * Used by the drivers for received frames with a partial checksum.
+ * @param[in,out] payload is the frame payload.
+ * @param[in] bsize is the size of the payload.
+ * @param[in] off tells where the checksum is.
+ */
+void ether_offload_csum(uint8_t *payload,
+                        size_t bsize,
+                        const struct ether_offload *off);
+
+/**
+ * Complete an offloaded checksum of a chain of segments in software.
+ * @param[in,out] iov is the payload; the checksum field must be in the first
+ *                    segment.
+ * @param[in] iovcnt is the number of segments.
+ * @param[in] off tells where the checksum is.
+ */
+void ether_offload_csumv(const struct iovec *iov,
+                         unsigned iovcnt,
+                         const struct ether_offload *off);
+
+/**
+ * Get the value of a driver option.
+ * @param[in] args is the argument array given to ether_init().
+ * @param[in] name is the name of the option.
+ * @returns Returns a pointer to the option value if the option was given;
+ *          Otherwise NULL.
+ */
+const char *ether_arg(char *const args[], const char *name);
+
 /* Platform dependent functions */
 
 /**
@@ -88,8 +236,38 @@ uint32_t ether_fcs(const void *data, size_t bsize);
  */
 int ether_handle2addr(int handle, mac_addr_t addr);
 
+/**
+ * Get the capabilities of an interface.
+ * @param[in] handle is the ether handle.
+ * @returns Returns a combination of ETHER_CAP_ flags.
+ */
+unsigned ether_handle2caps(int handle);
+
+/**
+ * Get the number of RX queues of an interface.
+ * Each queue should be served by its own ingress thread.
+ * @param[in] handle is the ether handle.
+ * @returns Returns the number of RX queues; 0 if handle is invalid.
+ */
+unsigned ether_handle2queues(int handle);
+
+/**
+ * Get a file descriptor to wait for the frames of an RX queue with epoll.
+ * The descriptor becomes readable when the queue has frames. The queue is
+ * switched to non-blocking mode: from now on ether_receive() returns 0
+ * right away if there is no frame, instead of waiting for one.
+ * @param[in] handle is the ether handle.
+ * @param[in] queue is the RX queue.
+ * @returns Returns the file descriptor, owned by the driver;
+ *          Otherwise -1 is returned and errno is set, ENOTSUP if the driver
+ *          can't be waited on with epoll.
+ */
+int ether_handle2fd(int handle, unsigned queue);
+
 /**
  * Get the corresponding handle of an MAC address.
+ * @returns Returns the handle of the interface;
+ *          Otherwise -1 is returned and errno is set.
  */
 int ether_addr2handle(const mac_addr_t addr);
 
@@ -100,22 +278,134 @@ int ether_addr2handle(const mac_addr_t addr);
 
 /**
  * Receive a frame from ether.
- * @retval >0 the size of the received frame;
- * @retval  0 read timed out;
+ * The frame is lent without copying and it must be released with
+ * frame->release() before the next call on the same queue. The payload is
+ * writable and followed by at least ETHER_RX_TAILROOM bytes of room. Drivers
+ * accepting frames merged by GRO may return up to ETHER_GSO_MAXLEN bytes of
+ * payload, with the L4 checksum already completed.
+ * A queue must be only read by a single thread at time.
+ * @param[in] queue is the RX queue, less than ether_handle2queues().
+ * @param[out] frame is set to the received frame.
+ * @retval  1 a frame was received;
+ * @retval  0 read timed out, or no frame in non-blocking mode;
  * @retval -1 a read error occurred, errno is set.
  */
-int ether_receive(int handle,
-                  struct ether_hdr *hdr,
-                  uint8_t *buf,
-                  size_t bsize);
+int ether_receive(int handle, unsigned queue, struct ether_frame *frame);
+
+/**
+ * Receive a burst of frames from ether.
+ * Waits for the first frame like ether_receive() and then takes the frames
+ * that are ready without waiting, up to nr. The frames are lent like with
+ * ether_receive() and they must all be released, in any order, before the
+ * next call on the same queue. Drivers reading into a single buffer return
+ * at most one frame.
+ * @param[in] queue is the RX queue, less than ether_handle2queues().
+ * @param[out] frames is set to the received frames.
+ * @param[in] nr is the size of frames, at most NSTACK_ETHER_RX_BURST.
+ * @returns Returns the number of frames received, 0 if the read timed out
+ *          or there was no frame in non-blocking mode;
+ *          Otherwise -1 is returned and errno is set.
+ */
+int ether_receive_burst(int handle,
+                        unsigned queue,
+                        struct ether_frame frames[],
+                        unsigned nr);
 /**
  * Send a frame to a destination over ether.
+ * The frame is transmitted immediately unless the calling thread is inside
+ * a TX batch, in which case it's queued by the driver until the batch ends.
+ * @param[in] off is NULL for a complete frame. It can be only given if the
+ *                interface has ETHER_CAP_TX_CSUM, and gso_size can be only
+ *                non-zero if it has ETHER_CAP_TSO.
+ * @retval >0 the size of the frame;
+ * @retval <0 a negative errno code.
  */
 int ether_send(int handle,
                const mac_addr_t dst,
                uint16_t proto,
                uint8_t *buf,
-               size_t bsize);
+               size_t bsize,
+               const struct ether_offload *off);
+
+/**
+ * Send a frame gathered from a chain of segments.
+ * Like ether_send() with the payload being the segments one after another.
+ * The segments are only referenced during the call; a driver copies them if
+ * it queues the frame. The headers up to the end of the L4 header given in
+ * off must be in the first segment.
+ * @param[in] iov is the chain.
+ * @param[in] iovcnt is the number of segments, at most ETHER_IOV_MAX.
+ * @retval >0 the size of the frame;
+ * @retval <0 a negative errno code.
+ */
+int ether_sendv(int handle,
+                const mac_addr_t dst,
+                uint16_t proto,
+                const struct iovec *iov,
+                unsigned iovcnt,
+                const struct ether_offload *off);
+
+/**
+ * Get the total length of a chain of segments.
+ */
+static inline size_t ether_iov_len(const struct iovec *iov, unsigned iovcnt)
+{
+    size_t len = 0;
+
+    for (unsigned i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/**
+ * Gather a chain of segments to a contiguous buffer.
+ * @returns Returns the number of bytes copied.
+ */
+static inline size_t ether_iov_copy(uint8_t *buf,
+                                    const struct iovec *iov,
+                                    unsigned iovcnt)
+{
+    size_t len = 0;
+
+    for (unsigned i = 0; i < iovcnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/**
+ * Transmit all frames queued for an interface.
+ * @retval  0 on success;
+ * @retval <0 a negative errno code.
+ */
+int ether_flush(int handle);
+/**
+ * @}
+ */
+
+/**
+ * Batched transmission.
+ * Frames sent by the calling thread between ether_tx_begin() and
+ * ether_tx_end() are flushed once at the end of the batch. Batches can be
+ * nested; only the outermost ether_tx_end() flushes.
+ * @{
+ */
+void ether_tx_begin(void);
+
+/**
+ * End a TX batch.
+ * @retval  0 on success;
+ * @retval <0 a negative errno code of the last failed flush.
+ */
+int ether_tx_end(void);
+
+/**
+ * Check whether the driver should defer flushing a frame queued by
+ * ether_send() for the given handle.
+ * @returns Returns non-zero if the calling thread is inside a TX batch.
+ */
+int ether_tx_defer(int handle);
 /**
  * @}
  */
@@ -127,12 +417,24 @@ int ether_send(int handle,
 
 /**
  * Handle the received ethernet frame.
+ * The payload is processed in place and the reply is written over it.
  * @retval >0 the size of the reply written back to payload;
  * @retval  0 if no reply should be sent;
  * @retval -1 an error occurred, errno is set.
  */
 int ether_input(const struct ether_hdr *hdr, uint8_t *payload, size_t bsize);
 
+/**
+ * Handle a burst of received ethernet frames.
+ * The burst is passed through each layer in turn, so that the code of a
+ * layer stays hot for the whole burst. The result of each packet is left in
+ * its retval, like the return value of ether_input() but with a negative
+ * errno code on error.
+ * @param[in,out] pkts are the packets, with hdr, payload and bsize set.
+ * @param[in] n is the number of packets, at most NSTACK_ETHER_RX_BURST.
+ */
+void ether_input_burst(struct ether_pkt *pkts[], unsigned n);
+
 /**
  * Send back a reply message.
  * @param hdr must be untouched header received by ether_receive().
@@ -1,17 +1,22 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <sys/time.h>
 
+#include "collection.h"
 #include "nstack_socket.h"
 #include "tree.h"
 
 #define NSTACK_CTRL_FLAG_DYING 0x8000
 
-typedef void nstack_periodic_task_t(int delta_time);
+typedef void nstack_periodic_task_t(uint64_t now);
 
 /**
  * Declare a periodic task.
+ * The tasks are called every NSTACK_TIMER_TICK_USEC with the current tick
+ * and are meant to advance the timing wheels of their subsystems.
  */
 #define NSTACK_PERIODIC_TASK(_task_fn_) \
     DATA_SET(_nstack_periodic_tasks, _task_fn_)
@@ -25,10 +30,14 @@ struct nstack_sock {
     struct nstack_sock_info info; /* Must be first */
 
     struct nstack_sock_ctrl *ctrl;
+    pthread_mutex_t ingress_lock; /*!< Serializes the ingress threads. */
     uint8_t *ingress_data;
     struct queue_cb *ingress_q;
     uint8_t *egress_data;
     struct queue_cb *egress_q;
+    TAILQ_ENTRY(nstack_sock) _egress_link; /*!< Link in the active list. */
+    int egress_active;     /*!< The socket is in the active list. */
+    size_t egress_deficit; /*!< DRR deficit of the socket [bytes]. */
 
     union {
         struct {
@@ -49,11 +58,19 @@ struct nstack_sock {
 /**
  * Handle socket input data.
  * Transport -> Socket
+ * @param[in] csum is the partial sum of the pseudo-header and the transport
+ *                 header if the checksum should be verified, otherwise NULL.
+ *                 The payload is summed while it's copied to the socket.
+ * @retval 0 on success;
+ * @retval -EMSGSIZE if bsize doesn't fit in NSTACK_DATAGRAM_SIZE_MAX;
+ * @retval -ENOBUFS if the ingress queue of the socket is full;
+ * @retval -EBADMSG if the checksum doesn't match.
  */
 int nstack_sock_dgram_input(struct nstack_sock *sock,
                             struct nstack_sockaddr *srcaddr,
                             uint8_t *buf,
-                            size_t bsize);
+                            size_t bsize,
+                            const uint32_t *csum);
 
 typedef int nstack_send_fn(struct nstack_sock *sock,
                            const struct nstack_dgram *dgram);
@@ -107,6 +107,12 @@ struct ip_hdr {
 struct _ip_proto_handler {
     uint16_t proto_id;
     int (*fn)(const struct ip_hdr *hdr, uint8_t *payload, size_t bsize);
+    /**
+     * Handle a burst of packets; NULL if the packets are passed to fn one at
+     * a time. The IP header of each packet is in ip_hdr and the payload
+     * points to the transport header.
+     */
+    void (*burst_fn)(struct ether_pkt *pkts[], unsigned n);
 };
 
 /**
@@ -119,6 +125,17 @@ struct _ip_proto_handler {
     };                                                                   \
     DATA_SET(_ip_proto_handlers, _ip_proto_handler_##_handler_fn_)
 
+/**
+ * Declare an IP input chain handler with a burst variant.
+ */
+#define IP_PROTO_INPUT_BURST_HANDLER(_proto_id_, _handler_fn_, _burst_fn_) \
+    static struct _ip_proto_handler _ip_proto_handler_##_handler_fn_ = {   \
+        .proto_id = _proto_id_,                                            \
+        .fn = _handler_fn_,                                                \
+        .burst_fn = _burst_fn_,                                            \
+    };                                                                     \
+    DATA_SET(_ip_proto_handlers, _ip_proto_handler_##_handler_fn_)
+
 int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask);
 
 /**
@@ -126,10 +143,96 @@ int ip_config(int ether_handle, in_addr_t ip_addr, in_addr_t netmask);
  * @{
  */
 
+/**
+ * Internet checksum.
+ * The words are summed in the byte order they are loaded in by the CPU, so
+ * a sum, and the checksum made of it, is stored to a packet as it is. The
+ * fastest kernel supported by the CPU is selected at startup.
+ * @{
+ */
+
+/**
+ * Add the 16-bit words of a buffer to a partial sum.
+ * @param[in] sum is a partial sum or 0.
+ * @returns Returns the new partial sum, folded to 16 bits.
+ */
+uint32_t ip_csum_partial(const void *dp, size_t bsize, uint32_t sum);
+
+/**
+ * Copy a buffer and add its 16-bit words to a partial sum.
+ * Same as memcpy() followed by ip_csum_partial() but the data is read once.
+ * @param[in] sum is a partial sum or 0.
+ * @returns Returns the new partial sum, folded to 16 bits.
+ */
+uint32_t ip_csum_copy(void *dst, const void *src, size_t bsize, uint32_t sum);
+
+/**
+ * Calculate the partial sum of an IPv4 pseudo-header.
+ * @param[in] src and dst are in host byte order.
+ * @param[in] bsize is the size of the L4 segment.
+ */
+uint32_t ip_csum_pseudo(in_addr_t src,
+                        in_addr_t dst,
+                        uint8_t proto,
+                        size_t bsize);
+
+/**
+ * Add two partial sums.
+ */
+static inline uint32_t ip_csum_add(uint32_t a, uint32_t b)
+{
+    a += b;
+
+    return (a & 0xffff) + (a >> 16);
+}
+
+/**
+ * Fold a partial sum to the checksum.
+ */
+static inline uint16_t ip_csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/**
+ * Update a checksum for a 16-bit word that was changed, as in RFC 1624.
+ * @param[in] csum is the checksum as stored in the packet.
+ * @param[in] from and to are the word before and after the change, loaded
+ *                from the packet in the same way as the checksum.
+ * @returns Returns the new checksum.
+ */
+static inline uint16_t ip_csum_update16(uint16_t csum,
+                                        uint16_t from,
+                                        uint16_t to)
+{
+    /* HC' = ~(~HC + ~m + m') */
+    return ip_csum_fold(
+        ip_csum_add(ip_csum_add((uint16_t) ~csum, (uint16_t) ~from), to));
+}
+
+/**
+ * Update a checksum for a 32-bit field that was changed, e.g. an address.
+ */
+static inline uint16_t ip_csum_update32(uint16_t csum,
+                                        uint32_t from,
+                                        uint32_t to)
+{
+    csum = ip_csum_update16(csum, from >> 16, to >> 16);
+
+    return ip_csum_update16(csum, from & 0xffff, to & 0xffff);
+}
+
 /**
  * Calculate the Internet checksum.
  */
-uint16_t ip_checksum(void *dp, size_t bsize);
+uint16_t ip_checksum(const void *dp, size_t bsize);
+
+/**
+ * @}
+ */
 
 /**
  * Get the header length of an IP packet.
@@ -150,8 +253,12 @@ static inline size_t ip_hdr_hlen(const struct ip_hdr *ip)
 
 /**
  * Update a route.
+ * The route to the network is replaced, and the interface address of the
+ * route is added, next to the addresses of other interfaces on the network.
  * @param[in] route is a pointer to a route struct; the information will be
  *                  copied from the struct.
+ * @retval  0 on success;
+ * @retval -1 the RIB is full, errno is set to ENOMEM.
  */
 int ip_route_update(struct ip_route *route);
 
@@ -174,6 +281,12 @@ int ip_route_find_by_network(in_addr_t ip, struct ip_route *route);
  */
 int ip_route_find_by_iface(in_addr_t addr, struct ip_route *route);
 
+/**
+ * Get the capabilities of the interface routing to an address.
+ * @returns Returns a combination of ETHER_CAP_ flags; 0 if there is no route.
+ */
+unsigned ip_route_caps(in_addr_t addr);
+
 /**
  * @}
  */
@@ -189,7 +302,8 @@ int ip_input(const struct ether_hdr *e_hdr, uint8_t *payload, size_t bsize);
 
 /**
  * Construct a reply header from a received IP packet header.
- * Swaps src and dst etc.
+ * Swaps src and dst etc. The checksum is updated for the changed fields, so
+ * the header must still have the checksum it was received with.
  * @param host_ip_hd is a pointer to a IP packet header that should be reversed.
  * @param bsize is the size of the packet data.
  * @returns Returns the size of the header.
@@ -201,8 +315,52 @@ size_t ip_reply_header(struct ip_hdr *host_ip_hdr, size_t bsize);
 
 /**
  * Send an IP packet to a destination.
+ * @param[in] off requests the L4 checksum, and TSO if gso_size is non-zero,
+ *                to be offloaded; csum_start is relative to buf and the
+ *                checksum field is overwritten with the pseudo-header sum.
+ *                The offloads are done in software if the interface can't
+ *                do them. NULL if buf is complete.
+ */
+int ip_send(in_addr_t dst,
+            uint8_t proto,
+            const uint8_t *buf,
+            size_t bsize,
+            const struct ether_offload *off);
+
+/**
+ * Max size of the L4 header in the first segment given to ip_sendv().
+ */
+#define IP_SENDV_HDR_MAX 64
+
+/**
+ * Send an IP packet gathered from a chain of segments.
+ * The payload isn't copied if the interface can take the chain as is; it's
+ * gathered to a packet buffer if the packet is deferred or fragmented.
+ * @param[in] iov is the chain. The first segment is the L4 header, of at
+ *                most IP_SENDV_HDR_MAX bytes, and the segments are only
+ *                referenced during the call.
+ * @param[in] iovcnt is the number of segments, at most ETHER_IOV_MAX.
+ * @param[in] off is as with ip_send().
+ */
+int ip_sendv(in_addr_t dst,
+             uint8_t proto,
+             const struct iovec *iov,
+             unsigned iovcnt,
+             const struct ether_offload *off);
+
+struct mbuf;
+
+/**
+ * Send an IP packet built in a packet buffer.
+ * The IP header is prepended to the segment in m in place and the buffer
+ * is freed.
+ * @param[in] m is the L4 segment with room for the IP header in front.
+ * @param[in] off is as with ip_send(); csum_start is relative to m->data.
  */
-int ip_send(in_addr_t dst, uint8_t proto, const uint8_t *buf, size_t bsize);
+int ip_send_mbuf(in_addr_t dst,
+                 uint8_t proto,
+                 struct mbuf *m,
+                 const struct ether_offload *off);
 
 /**
  * IP Fragmentation
@@ -0,0 +1,84 @@
+/**
+ * @addtogroup mbuf
+ * Packet buffers for the egress path.
+ * A packet is built from the payload towards the front: the payload is
+ * copied once right after the headroom and each layer prepends its header in
+ * place.
+ * @{
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "collection.h"
+
+/**
+ * Space reserved in front of the payload for the headers.
+ */
+#define MBUF_HEADROOM 128
+
+/**
+ * Max size of a packet in a buffer, headers included.
+ */
+#define MBUF_DATA_LEN 65535
+
+struct mbuf {
+    uint8_t *data; /*!< Start of the packet. */
+    size_t len;    /*!< Size of the packet. */
+    SLIST_ENTRY(mbuf) _link;
+    uint8_t buf[MBUF_HEADROOM + MBUF_DATA_LEN] __attribute__((aligned(8)));
+};
+
+/**
+ * Get an empty buffer from the pool.
+ * @returns Returns a buffer with the data pointer right after the headroom;
+ *          NULL and errno is set to ENOBUFS if the pool is empty.
+ */
+struct mbuf *mbuf_alloc(void);
+
+/**
+ * Return a buffer to the pool.
+ */
+void mbuf_free(struct mbuf *m);
+
+/**
+ * Reserve len bytes in front of the packet for a header.
+ * @returns Returns a pointer to the reserved bytes.
+ */
+static inline uint8_t *mbuf_prepend(struct mbuf *m, size_t len)
+{
+    assert(m->data - m->buf >= (ptrdiff_t) len);
+
+    m->data -= len;
+    m->len += len;
+    return m->data;
+}
+
+/**
+ * Reserve len bytes at the end of the packet.
+ * @returns Returns a pointer to the reserved bytes.
+ */
+static inline uint8_t *mbuf_append(struct mbuf *m, size_t len)
+{
+    uint8_t *tail = m->data + m->len;
+
+    assert(tail + len <= m->buf + sizeof(m->buf));
+
+    m->len += len;
+    return tail;
+}
+
+/**
+ * Get the number of bytes that can still be appended to the packet.
+ */
+static inline size_t mbuf_tailroom(const struct mbuf *m)
+{
+    return m->buf + sizeof(m->buf) - (m->data + m->len);
+}
+
+/**
+ * @}
+ */
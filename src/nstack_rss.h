@@ -0,0 +1,110 @@
+/**
+ * Software RSS.
+ * @addtogroup RSS
+ * The ingress threads can be turned into dispatchers that spread the received
+ * frames over a set of flow workers, so that the input chain of the transport
+ * protocols scales over cores even if the interface has a single RX queue.
+ * Each frame is steered by a Toeplitz hash of its flow into a single
+ * producer single consumer ring between the dispatcher and the worker.
+ * ARP, IP fragments and the other protocols take the slow path to worker 0.
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "nstack_ether.h"
+#include "nstack_in.h"
+
+/**
+ * Max number of flow workers.
+ */
+#define RSS_WORKERS_MAX NSTACK_RSS_WORKERS_MAX
+
+/**
+ * The worker of the slow path.
+ */
+#define RSS_WORKER_SLOW 0
+
+/**
+ * Set up the rings between the dispatchers and the workers.
+ * @param[in] nr_workers is the number of flow workers, 0 disables RSS.
+ * @param[in] nr_dispatchers is the number of ingress threads.
+ * @returns 0 if succeed; Otherwise -1 and errno is set.
+ */
+int rss_init(unsigned nr_workers, unsigned nr_dispatchers);
+
+/**
+ * Free the rings.
+ * The dispatchers and the workers must have been stopped.
+ */
+void rss_deinit(void);
+
+/**
+ * Get the number of flow workers, 0 if RSS is not used.
+ */
+unsigned rss_nr_workers(void);
+
+/**
+ * Toeplitz hash of an IPv4 flow.
+ * The arguments are in host byte order and hashed in the order of the
+ * Microsoft RSS specification, so the hash matches that of a NIC using the
+ * same key.
+ */
+uint32_t rss_hash(in_addr_t src, in_addr_t dst, uint16_t sport, uint16_t dport);
+
+/**
+ * Get the worker of a flow hash.
+ */
+static inline unsigned rss_hash2worker(uint32_t hash)
+{
+    const unsigned nr_workers = rss_nr_workers();
+
+    return nr_workers > 1 ? hash % nr_workers : 0;
+}
+
+/**
+ * Get the worker of a received frame.
+ * TCP is steered by the 4-tuple of the segment. UDP sockets are looked up by
+ * the local address, so UDP is steered by the destination address and port
+ * and each worker owns the sockets hashed to it.
+ */
+unsigned rss_steer(const struct ether_hdr *hdr,
+                   const uint8_t *data,
+                   size_t len);
+
+/**
+ * Copy a burst of received frames to the rings of their workers.
+ * The frames are released and the workers that got frames are woken up.
+ * A frame is dropped if the ring of its worker is full.
+ * @param[in] dispatcher is the index of the calling ingress thread.
+ * @returns Returns the number of frames dropped.
+ */
+unsigned rss_dispatch(unsigned dispatcher,
+                      int ether_handle,
+                      struct ether_frame frames[],
+                      unsigned n);
+
+/**
+ * Receive a burst of frames dispatched to a worker.
+ * All the frames of a burst are from the same interface. The frames must be
+ * released in the order they were received. Waits for
+ * NSTACK_PERIODIC_EVENT_SEC or until rss_wakeup() if there are no frames.
+ * @param[in] worker is the index of the worker.
+ * @param[out] ether_handle is the interface the frames were received from.
+ * @returns Returns the number of frames received.
+ */
+int rss_receive_burst(unsigned worker,
+                      int *ether_handle,
+                      struct ether_frame frames[],
+                      unsigned nr);
+
+/**
+ * Wake up a worker waiting in rss_receive_burst().
+ */
+void rss_wakeup(unsigned worker);
+
+/**
+ * @}
+ */
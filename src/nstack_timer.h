@@ -0,0 +1,111 @@
+/**
+ * Timers.
+ * @addtogroup timer
+ * Timers are kept in hierarchical timing wheels, so that arming and
+ * cancelling a timer is O(1) and advancing a wheel by a tick only touches
+ * the timers that expire, or cascade down from a coarser level, at that tick.
+ * A wheel isn't thread safe; Each subsystem keeps its timers in its own wheel
+ * under the lock of the objects the timers belong to, and advances the wheel
+ * from a periodic task. The periodic tasks run every NSTACK_TIMER_TICK_USEC.
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "collection.h"
+
+#define TIMER_WHEEL_BITS 6 /*!< log2 of the number of slots in a level. */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 /*!< Timers up to 2^24 ticks away. */
+
+/**
+ * Convert milliseconds to ticks, rounding up.
+ */
+#define NSTACK_TIMER_MSEC(_ms_)                               \
+    (((uint64_t) (_ms_) * 1000 + NSTACK_TIMER_TICK_USEC - 1) / \
+     NSTACK_TIMER_TICK_USEC)
+
+/**
+ * Convert seconds to ticks.
+ */
+#define NSTACK_TIMER_SEC(_sec_) NSTACK_TIMER_MSEC((uint64_t) (_sec_) * 1000)
+
+struct nstack_timer;
+
+/**
+ * Timer callback.
+ * Called from nstack_timer_run() with the timer already disarmed, so the
+ * timer can be armed again.
+ */
+typedef void nstack_timer_fn(struct nstack_timer *timer, void *arg);
+
+struct nstack_timer {
+    LIST_ENTRY(nstack_timer) _link;
+    uint64_t expires; /*!< The tick the timer expires at. */
+    nstack_timer_fn *fn;
+    void *arg;
+};
+
+LIST_HEAD(nstack_timer_list, nstack_timer);
+
+/**
+ * A timing wheel.
+ * A zeroed wheel is empty and ready for use.
+ */
+struct nstack_timer_wheel {
+    uint64_t now;   /*!< The tick the wheel has advanced to. */
+    unsigned count; /*!< Number of armed timers. */
+    struct nstack_timer_list slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+#define NSTACK_TIMER_INITIALIZER(_fn_, _arg_) \
+    {                                         \
+        .fn = (_fn_), .arg = (_arg_),         \
+    }
+
+/**
+ * Get the current tick.
+ */
+uint64_t nstack_timer_now(void);
+
+/**
+ * Initialize a timer.
+ */
+void nstack_timer_init(struct nstack_timer *timer,
+                       nstack_timer_fn *fn,
+                       void *arg);
+
+/**
+ * Test if a timer is armed.
+ */
+static inline int nstack_timer_pending(const struct nstack_timer *timer)
+{
+    return timer->_link.le_prev != NULL;
+}
+
+/**
+ * Arm a timer, or rearm it if it's already armed.
+ * @param[in] ticks is the number of ticks from now the timer expires after,
+ *                  at least one.
+ */
+void nstack_timer_arm(struct nstack_timer_wheel *wheel,
+                      struct nstack_timer *timer,
+                      uint64_t ticks);
+
+/**
+ * Cancel a timer if it's armed.
+ */
+void nstack_timer_cancel(struct nstack_timer_wheel *wheel,
+                         struct nstack_timer *timer);
+
+/**
+ * Advance a wheel to a tick and call the timers that expire on the way.
+ * @param[in] now is the current tick, see nstack_timer_now().
+ */
+void nstack_timer_run(struct nstack_timer_wheel *wheel, uint64_t now);
+
+/**
+ * @}
+ */
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nstack_util.h"
+#include "queue_r.h"
+
+#include "logger.h"
+#include "nstack_ip.h"
+#include "nstack_rss.h"
+
+#define RSS_INPUT_LEN 12 /*!< Addresses and ports of a flow. */
+
+/*
+ * The default key of the Microsoft RSS specification.
+ */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67,
+    0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb,
+    0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30,
+    0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Toeplitz tables.
+ * rss_table[i][v] is the hash of an input that is all zeros but byte i,
+ * which is v.
+ */
+static uint32_t rss_table[RSS_INPUT_LEN][256];
+
+/**
+ * A frame in a ring.
+ * Frames up to the standard MTU are copied into the slot, larger (GRO)
+ * frames into a buffer allocated for them.
+ */
+struct rss_slot {
+    struct ether_hdr hdr;
+    int ether_handle;
+    size_t len;
+    uint8_t *data; /*!< Points to buf or to the allocated buffer. */
+    uint8_t buf[ETHER_DATA_LEN + ETHER_RX_TAILROOM] __attribute__((aligned(16)));
+};
+
+/**
+ * Frames from one dispatcher to one worker.
+ */
+struct rss_ring {
+    queue_cb_t cb;
+    struct rss_slot slot[NSTACK_RSS_RING_NR];
+};
+
+struct rss_worker {
+    struct rss_ring *rings; /*!< One ring for each dispatcher. */
+    unsigned next_ring;     /*!< The ring served first on the next burst. */
+    uint32_t seq;           /*!< Futex word, bumped to wake up the worker. */
+    uint32_t waiting;       /*!< The worker is about to sleep on seq. */
+};
+
+static struct rss_worker rss_workers[RSS_WORKERS_MAX];
+static unsigned nr_workers;
+static unsigned nr_dispatchers;
+
+__constructor static void rss_table_init(void)
+{
+    for (unsigned i = 0; i < RSS_INPUT_LEN; i++) {
+        for (unsigned bit = 0; bit < 8; bit++) {
+            const uint8_t *k = rss_key + i;
+            /* The 32 bits of the key starting from the input bit. */
+            const uint32_t window =
+                ((uint32_t) k[0] << 24 | k[1] << 16 | k[2] << 8 | k[3])
+                    << bit |
+                (bit ? k[4] >> (8 - bit) : 0);
+
+            for (unsigned v = 0; v < 256; v++) {
+                if (v & (0x80 >> bit))
+                    rss_table[i][v] ^= window;
+            }
+        }
+    }
+}
+
+uint32_t rss_hash(in_addr_t src, in_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    const uint8_t input[RSS_INPUT_LEN] = {
+        src >> 24,  src >> 16, src >> 8, src,   dst >> 24, dst >> 16,
+        dst >> 8,   dst,       sport >> 8, sport, dport >> 8, dport,
+    };
+    uint32_t hash = 0;
+
+    for (unsigned i = 0; i < RSS_INPUT_LEN; i++)
+        hash ^= rss_table[i][input[i]];
+
+    return hash;
+}
+
+unsigned rss_nr_workers(void)
+{
+    return nr_workers;
+}
+
+int rss_init(unsigned workers, unsigned dispatchers)
+{
+    if (workers > RSS_WORKERS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < workers; i++) {
+        struct rss_worker *worker = &rss_workers[i];
+
+        worker->rings = calloc(dispatchers, sizeof(struct rss_ring));
+        if (!worker->rings) {
+            nr_workers = i;
+            rss_deinit();
+            return -1;
+        }
+        for (unsigned j = 0; j < dispatchers; j++) {
+            worker->rings[j].cb = queue_create(sizeof(struct rss_slot),
+                                               sizeof(worker->rings[j].slot));
+        }
+        worker->next_ring = 0;
+        worker->seq = 0;
+        worker->waiting = 0;
+    }
+    nr_workers = workers;
+    nr_dispatchers = dispatchers;
+
+    return 0;
+}
+
+void rss_deinit(void)
+{
+    for (unsigned i = 0; i < nr_workers; i++) {
+        struct rss_worker *worker = &rss_workers[i];
+
+        for (unsigned j = 0; worker->rings && j < nr_dispatchers; j++) {
+            struct rss_ring *ring = &worker->rings[j];
+            int index;
+
+            while (queue_peek(&ring->cb, &index)) {
+                struct rss_slot *slot =
+                    (struct rss_slot *) ((uint8_t *) ring->slot + index);
+
+                if (slot->data != slot->buf)
+                    free(slot->data);
+                queue_discard(&ring->cb, 1);
+            }
+        }
+        free(worker->rings);
+        worker->rings = NULL;
+    }
+    nr_workers = 0;
+    nr_dispatchers = 0;
+}
+
+unsigned rss_steer(const struct ether_hdr *hdr,
+                   const uint8_t *data,
+                   size_t len)
+{
+    const struct ip_hdr *ip = (const struct ip_hdr *) data;
+    size_t hlen;
+    uint16_t sport, dport;
+
+    if (hdr->h_proto != ETHER_PROTO_IPV4 || len < sizeof(struct ip_hdr))
+        return RSS_WORKER_SLOW;
+
+    hlen = (ip->ip_vhl & 0x0f) * 4;
+    if (hlen < sizeof(struct ip_hdr) || len < hlen + 4 ||
+        (ntohs(ip->ip_foff) & (IP_FLAGS_MF | 0x1fff)))
+        return RSS_WORKER_SLOW;
+
+    /* The ports are at the same offset in the TCP and UDP headers. */
+    memcpy(&sport, data + hlen, sizeof(sport));
+    memcpy(&dport, data + hlen + 2, sizeof(dport));
+
+    switch (ip->ip_proto) {
+    case IP_PROTO_TCP:
+        return rss_hash2worker(
+            rss_hash(ntohl(ip->ip_src), ntohl(ip->ip_dst), ntohs(sport),
+                     ntohs(dport)));
+    case IP_PROTO_UDP:
+        return rss_hash2worker(rss_hash(0, ntohl(ip->ip_dst), 0, ntohs(dport)));
+    default:
+        return RSS_WORKER_SLOW;
+    }
+}
+
+static long rss_futex(uint32_t *uaddr,
+                      int op,
+                      uint32_t val,
+                      const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static void rss_kick(struct rss_worker *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->waiting, __ATOMIC_RELAXED))
+        rss_wakeup(worker - rss_workers);
+}
+
+void rss_wakeup(unsigned worker)
+{
+    __atomic_fetch_add(&rss_workers[worker].seq, 1, __ATOMIC_RELEASE);
+    rss_futex(&rss_workers[worker].seq, FUTEX_WAKE, 1, NULL);
+}
+
+/**
+ * Copy a frame to a slot of the ring.
+ */
+static int rss_enqueue(struct rss_ring *ring,
+                       int ether_handle,
+                       const struct ether_frame *frame)
+{
+    struct rss_slot *slot;
+    int index;
+
+    if ((index = queue_alloc(&ring->cb)) == -1)
+        return -1;
+    slot = (struct rss_slot *) ((uint8_t *) ring->slot + index);
+
+    slot->data = slot->buf;
+    if (frame->len > ETHER_DATA_LEN &&
+        !(slot->data = malloc(frame->len + ETHER_RX_TAILROOM)))
+        return -1;
+    memcpy(slot->data, frame->data, frame->len);
+    slot->hdr = frame->hdr;
+    slot->ether_handle = ether_handle;
+    slot->len = frame->len;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue_commit(&ring->cb);
+
+    return 0;
+}
+
+unsigned rss_dispatch(unsigned dispatcher,
+                      int ether_handle,
+                      struct ether_frame frames[],
+                      unsigned n)
+{
+    uint32_t kick = 0; /* A bitmap of workers. */
+    unsigned drops = 0;
+
+    _Static_assert(RSS_WORKERS_MAX <= 32, "Too many workers for the bitmap");
+
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_frame *frame = &frames[i];
+        const unsigned w = rss_steer(&frame->hdr, frame->data, frame->len);
+
+        if (rss_enqueue(&rss_workers[w].rings[dispatcher], ether_handle,
+                        frame)) {
+            drops++;
+        } else {
+            kick |= 1u << w;
+        }
+        frame->release(frame);
+    }
+
+    while (kick) {
+        const int w = __builtin_ctz(kick);
+
+        kick &= kick - 1;
+        rss_kick(&rss_workers[w]);
+    }
+
+    if (drops > 0)
+        LOG(LOG_DEBUG, "Dropped %u frames", drops);
+
+    return drops;
+}
+
+static void rss_release(struct ether_frame *frame)
+{
+    struct rss_ring *ring = frame->priv;
+    struct rss_slot *slot;
+    int index;
+
+    /* Frames are released in order, so this is the head of the ring. */
+    if (!queue_peek(&ring->cb, &index))
+        return;
+    slot = (struct rss_slot *) ((uint8_t *) ring->slot + index);
+    if (slot->data != slot->buf)
+        free(slot->data);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    queue_discard(&ring->cb, 1);
+}
+
+/**
+ * Take up to nr frames from the first ring that has any.
+ */
+static int rss_dequeue_burst(struct rss_worker *worker,
+                             int *ether_handle,
+                             struct ether_frame frames[],
+                             unsigned nr)
+{
+    for (unsigned r = 0; r < nr_dispatchers; r++) {
+        const unsigned ring_index = (worker->next_ring + r) % nr_dispatchers;
+        struct rss_ring *ring = &worker->rings[ring_index];
+        unsigned n = 0;
+        int index;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        while (n < nr && queue_peek_nth(&ring->cb, n, &index)) {
+            struct rss_slot *slot =
+                (struct rss_slot *) ((uint8_t *) ring->slot + index);
+
+            frames[n++] = (struct ether_frame){
+                .hdr = slot->hdr,
+                .data = slot->data,
+                .len = slot->len,
+                .release = rss_release,
+                .priv = ring,
+            };
+            *ether_handle = slot->ether_handle;
+        }
+        if (n > 0) {
+            worker->next_ring = ring_index + 1;
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+int rss_receive_burst(unsigned worker_index,
+                      int *ether_handle,
+                      struct ether_frame frames[],
+                      unsigned nr)
+{
+    const struct timespec timeout = {.tv_sec = NSTACK_PERIODIC_EVENT_SEC};
+    struct rss_worker *worker = &rss_workers[worker_index];
+    const uint32_t seq = __atomic_load_n(&worker->seq, __ATOMIC_ACQUIRE);
+    int n;
+
+    if ((n = rss_dequeue_burst(worker, ether_handle, frames, nr)))
+        return n;
+
+    /* The dispatchers check waiting after committing the frames. */
+    __atomic_store_n(&worker->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!(n = rss_dequeue_burst(worker, ether_handle, frames, nr)))
+        rss_futex(&worker->seq, FUTEX_WAIT, seq, &timeout);
+    __atomic_store_n(&worker->waiting, 0, __ATOMIC_RELAXED);
+
+    return n;
+}
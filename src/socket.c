@@ -1,6 +1,5 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -11,17 +10,6 @@
 
 /* TODO bind fn for outbound connections */
 
-static void block_sigusr2(void)
-{
-    sigset_t sigset;
-
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR2);
-
-    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL) == -1)
-        abort();
-}
-
 void *nstack_listen(const char *socket_path)
 {
     int fd;
@@ -35,7 +23,6 @@ void *nstack_listen(const char *socket_path)
     if (pa == MAP_FAILED)
         return NULL;
 
-    block_sigusr2();
     NSTACK_SOCK_CTRL(pa)->pid_end = getpid();
 
     return pa;
@@ -47,23 +34,24 @@ ssize_t nstack_recvfrom(void *socket,
                         int flags,
                         struct nstack_sockaddr *restrict address)
 {
+    struct nstack_doorbell *db = &NSTACK_SOCK_CTRL(socket)->ingress_db;
     struct queue_cb *ingress_q = NSTACK_INGRESS_QADDR(socket);
     struct nstack_dgram *dgram;
-    sigset_t sigset;
     int dgram_index;
     ssize_t rd;
 
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR2);
-
-    do {
-        struct timespec timeout = {
+    /* A single wakeup may be sent for several datagrams. */
+    while (!queue_peek(ingress_q, &dgram_index)) {
+        const struct timespec timeout = {
             .tv_sec = NSTACK_PERIODIC_EVENT_SEC,
             .tv_nsec = 0,
         };
+        const uint32_t seq = doorbell_prepare(db);
 
-        sigtimedwait(&sigset, NULL, &timeout);
-    } while (!queue_peek(ingress_q, &dgram_index));
+        if (!queue_peek(ingress_q, &dgram_index))
+            doorbell_wait(db, seq, &timeout);
+        doorbell_done(db);
+    }
     dgram =
         (struct nstack_dgram *) (NSTACK_INGRESS_DADDR(socket) + dgram_index);
 
@@ -85,7 +73,7 @@ ssize_t nstack_sendto(void *socket,
                       int flags,
                       const struct nstack_sockaddr *dest_addr)
 {
-    const struct nstack_sock_ctrl *ctrl = NSTACK_SOCK_CTRL(socket);
+    struct nstack_sock_ctrl *ctrl = NSTACK_SOCK_CTRL(socket);
     struct queue_cb *egress_q = NSTACK_EGRESS_QADDR(socket);
     struct nstack_dgram *dgram;
     int dgram_index;
@@ -107,6 +95,7 @@ ssize_t nstack_sendto(void *socket,
     dgram->buf_size = length;
 
     queue_commit(egress_q);
+    doorbell_ring(&ctrl->egress_db);
 
     return length;
 }
@@ -7,6 +7,8 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -17,6 +19,8 @@
 #include "collection.h"
 #include "logger.h"
 #include "nstack_internal.h"
+#include "nstack_rss.h"
+#include "nstack_timer.h"
 #include "tcp.h"
 #include "tree.h"
 
@@ -26,6 +30,11 @@
 #define TCP_FIN_WAIT_TIMEOUT_MS 20000
 #define TCP_SYN_RCVD_TIMEOUT_MS 20000
 
+/**
+ * Number of timer ticks in a TCP slow tick.
+ */
+#define TCP_TIMER_TICKS NSTACK_TIMER_MSEC(1000 / TCP_TIMER_PR_SLOWHZ)
+
 /*
  * TCP Connection Flags.
  */
@@ -36,11 +45,6 @@
 #define TCP_FLAG_GOT_FIN 0x10
 #define TCP_FLAG_NODELAY 0x20 /*!< Disable nagle algorithm. */
 
-/**
- * Current time. Used if RTT is measured using timestamp method.
- */
-unsigned tcp_now = 0;
-
 /**
  * TCP Segment.
  */
@@ -48,11 +52,14 @@ struct tcp_segment {
     TAILQ_ENTRY(tcp_segment) _link;
     size_t size;
     char *data;
+    uint32_t csum; /*!< Partial sum of the data, taken while copying it in. */
     struct tcp_hdr header;
 };
 
 TAILQ_HEAD(tcp_segment_list, tcp_segment);
 
+struct tcp_conn_shard;
+
 /**
  * TCP Connection Control Block.
  */
@@ -67,10 +74,11 @@ struct tcp_conn_tcb {
     unsigned keepalive_cnt; /*!< Keepalive counter. */
 
     /* RTT Estimation. */
-    int rtt_est;     /*!< RTT estimator. */
-    int rtt_var;     /*!< mean deviation RTT estimator*/
-    int rtt;         /*!< RTT sample*/
-    int rtt_cur_seq; /*!< Seq number being timed for RTT estimation. */
+    int rtt_est;        /*!< RTT estimator. */
+    int rtt_var;        /*!< mean deviation RTT estimator*/
+    int rtt;            /*!< RTT sample*/
+    int rtt_cur_seq;    /*!< Seq number being timed for RTT estimation. */
+    uint64_t rtt_start; /*!< The tick the timed segment was sent at. */
 
     unsigned retran_timeout; /*!< Retransmission timeout. */
     unsigned retran_count;   /*!< Number of retransmissions. */
@@ -99,7 +107,8 @@ struct tcp_conn_tcb {
     struct tcp_segment_list unacked_list;      /*!< Unacked segments. */
     struct tcp_segment_list oos_segments_list; /*!< Out of seq segments. */
 
-    int timer[TCP_T_NTIMERS];
+    struct tcp_conn_shard *shard;
+    struct nstack_timer timer[TCP_T_NTIMERS];
     pthread_mutex_t mutex;
 };
 
@@ -110,7 +119,28 @@ struct tcp_conn_attr {
 
 RB_HEAD(tcp_conn_map, tcp_conn_tcb);
 
-static struct tcp_conn_map tcp_conn_map = RB_INITIALIZER();
+/**
+ * A shard of the connection map.
+ * With the software RSS each flow worker owns the shard its connections are
+ * hashed to, so the lock is only shared with the output and the timers.
+ */
+struct tcp_conn_shard {
+    struct tcp_conn_map map;
+    struct nstack_timer_wheel timers; /*!< Timers of the connections. */
+    /*
+     * Serializes the TCP input, output and timers of the shard. Must be taken
+     * before the mutex of a connection.
+     */
+    pthread_mutex_t lock;
+};
+
+static struct tcp_conn_shard tcp_conn_shards[RSS_WORKERS_MAX] = {
+    [0 ... RSS_WORKERS_MAX - 1] =
+        {
+            .map = RB_INITIALIZER(),
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+        },
+};
 
 static int tcp_conn_cmp(struct tcp_conn_tcb *a, struct tcp_conn_tcb *b)
 {
@@ -123,25 +153,76 @@ static int tcp_conn_cmp(struct tcp_conn_tcb *a, struct tcp_conn_tcb *b)
 
 RB_GENERATE_STATIC(tcp_conn_map, tcp_conn_tcb, _rb_entry, tcp_conn_cmp);
 
-static struct tcp_conn_tcb *tcp_find_connection(struct tcp_conn_attr *find)
+/**
+ * Get the shard of a connection.
+ * The segments of the connection are steered to the worker of the shard.
+ */
+static struct tcp_conn_shard *tcp_conn_shard(const struct tcp_conn_attr *attr)
+{
+    if (rss_nr_workers() <= 1)
+        return &tcp_conn_shards[0];
+
+    return &tcp_conn_shards[rss_hash2worker(
+        rss_hash(attr->remote.inet4_addr, attr->local.inet4_addr,
+                 attr->remote.port, attr->local.port))];
+}
+
+static struct tcp_conn_tcb *tcp_find_connection(struct tcp_conn_shard *shard,
+                                                struct tcp_conn_attr *find)
 {
     struct tcp_conn_tcb *find_p = (struct tcp_conn_tcb *) find;
 
-    return RB_FIND(tcp_conn_map, &tcp_conn_map, find_p);
+    return RB_FIND(tcp_conn_map, &shard->map, find_p);
 }
 
-static struct tcp_conn_tcb *tcp_new_connection(const struct tcp_conn_attr *attr)
+static void tcp_timer(struct nstack_timer *timer, void *arg);
+
+static struct tcp_conn_tcb *tcp_new_connection(struct tcp_conn_shard *shard,
+                                               const struct tcp_conn_attr *attr)
 {
     struct tcp_conn_tcb *conn = calloc(1, sizeof(struct tcp_conn_tcb));
     assert(conn);
     memcpy(&conn->local, &attr->local, sizeof(struct nstack_sockaddr));
     memcpy(&conn->remote, &attr->remote, sizeof(struct nstack_sockaddr));
+    conn->mss = TCP_MSS;
+    TAILQ_INIT(&conn->unsent_list);
+    TAILQ_INIT(&conn->unacked_list);
+    TAILQ_INIT(&conn->oos_segments_list);
+    for (int i = 0; i < TCP_T_NTIMERS; i++)
+        nstack_timer_init(&conn->timer[i], tcp_timer, conn);
+    conn->shard = shard;
     pthread_mutex_init(&conn->mutex, NULL);
-    RB_INSERT(tcp_conn_map, &tcp_conn_map, conn);
+    RB_INSERT(tcp_conn_map, &shard->map, conn);
 
     return conn;
 }
 
+/**
+ * Remove a connection from its shard and free it.
+ */
+static void tcp_free_connection(struct tcp_conn_tcb *conn)
+{
+    for (int i = 0; i < TCP_T_NTIMERS; i++)
+        nstack_timer_cancel(&conn->shard->timers, &conn->timer[i]);
+    RB_REMOVE(tcp_conn_map, &conn->shard->map, conn);
+    free(conn);
+}
+
+/**
+ * Set a timer of a connection.
+ * @param[in] value is the timeout in slow ticks, 0 stops the timer.
+ */
+static void tcp_timer_set(struct tcp_conn_tcb *conn,
+                          int index,
+                          unsigned value)
+{
+    if (value)
+        nstack_timer_arm(&conn->shard->timers, &conn->timer[index],
+                         (uint64_t) value * TCP_TIMER_TICKS);
+    else
+        nstack_timer_cancel(&conn->shard->timers, &conn->timer[index]);
+}
+
 RB_HEAD(tcp_sock_tree, nstack_sock);
 
 static struct tcp_sock_tree tcp_sock_tree_head = RB_INITIALIZER();
@@ -166,50 +247,13 @@ static struct nstack_sock *find_tcp_socket(const struct nstack_sockaddr *addr)
 
 static uint16_t tcp_checksum(const struct nstack_sockaddr *restrict src,
                              const struct nstack_sockaddr *restrict dst,
-                             struct tcp_hdr *restrict dp,
+                             const struct tcp_hdr *restrict dp,
                              size_t bsize)
 {
-    const uint8_t *restrict data = (uint8_t *) dp;
-    uint32_t acc = 0xffff;
-    size_t i;
-    uint16_t word;
-    struct {
-        uint32_t src_addr;
-        uint32_t dst_addr;
-        uint8_t zeros;
-        uint8_t proto;
-        uint16_t tcp_len;
-    } __attribute__((packed, aligned(4))) pseudo_header = {
-        .src_addr = htonl(src->inet4_addr),
-        .dst_addr = htonl(dst->inet4_addr),
-        .zeros = 0,
-        .proto = IP_PROTO_TCP,
-        .tcp_len = htons(bsize),
-    };
-
-    for (i = 0; i + 1 < 12; i += 2) {
-        memcpy(&word, (uint8_t *) (&pseudo_header) + i, 2);
-        acc += word;
-        if (acc > 0xffff)
-            acc -= ntohs(0xffff);
-    }
-
-    for (i = 0; i + 1 < bsize; i += 2) {
-        memcpy(&word, data + i, 2);
-        acc += word;
-        if (acc > 0xffff)
-            acc -= ntohs(0xffff);
-    }
-
-    if (bsize & 1) {
-        word = 0;
-        memcpy(&word, data + bsize - 1, 1);
-        acc += word;
-        if (acc > 0xffff)
-            acc -= ntohs(0xffff);
-    }
+    const uint32_t sum = ip_csum_pseudo(src->inet4_addr, dst->inet4_addr,
+                                        IP_PROTO_TCP, bsize);
 
-    return ~acc;
+    return ip_csum_fold(ip_csum_partial(dp, bsize, sum));
 }
 
 static void tcp_hton_opt(struct tcp_hdr *hdr, int len)
@@ -280,11 +324,18 @@ static void tcp_ntoh_opt(struct tcp_hdr *hdr, int len)
     }
 }
 
-static void tcp_hton(const struct nstack_sockaddr *restrict src,
-                     const struct nstack_sockaddr *restrict dst,
-                     const struct tcp_hdr *host,
-                     struct tcp_hdr *net,
-                     size_t bsize)
+/**
+ * The checksum of the segments we send is completed by ip_send().
+ */
+static const struct ether_offload tcp_offload = {
+    .csum_offset = offsetof(struct tcp_hdr, tcp_checksum),
+};
+
+/**
+ * Convert a header to network byte order without the checksum.
+ * Used for the segments sent with tcp_offload.
+ */
+static void tcp_hton_hdr(const struct tcp_hdr *host, struct tcp_hdr *net)
 {
     int opt_len = tcp_opt_size(host);
     tcp_hton_opt(host, opt_len);
@@ -296,6 +347,15 @@ static void tcp_hton(const struct nstack_sockaddr *restrict src,
     net->tcp_win_size = htons(host->tcp_win_size);
     net->tcp_urg_ptr = htons(host->tcp_urg_ptr);
     net->tcp_checksum = 0;
+}
+
+static void tcp_hton(const struct nstack_sockaddr *restrict src,
+                     const struct nstack_sockaddr *restrict dst,
+                     const struct tcp_hdr *host,
+                     struct tcp_hdr *net,
+                     size_t bsize)
+{
+    tcp_hton_hdr(host, net);
     net->tcp_checksum = tcp_checksum(src, dst, net, bsize);
 }
 
@@ -315,52 +375,83 @@ static void tcp_ntoh(const struct tcp_hdr *net, struct tcp_hdr *host)
 static void tcp_rto_update(struct tcp_conn_tcb *conn, int rtt);
 static void tcp_ack_segments(struct tcp_conn_tcb *conn, struct tcp_hdr *tcp);
 
+/**
+ * Pass the data of a segment to the socket.
+ * A segment merged by GRO can be larger than a socket datagram, so the data
+ * is split.
+ * @returns Returns the number of bytes the socket took, less than bsize if
+ *          its buffer is full.
+ */
+static size_t tcp_sock_input(struct nstack_sock *sock,
+                             struct nstack_sockaddr *srcaddr,
+                             uint8_t *buf,
+                             size_t bsize)
+{
+    const size_t dgram_max =
+        NSTACK_DATAGRAM_SIZE_MAX - sizeof(struct nstack_dgram);
+    size_t done = 0;
+
+    do {
+        const size_t n =
+            (bsize - done < dgram_max) ? bsize - done : dgram_max;
+
+        if (nstack_sock_dgram_input(sock, srcaddr, buf + done, n, NULL))
+            break;
+        done += n;
+    } while (done < bsize);
+
+    return done;
+}
+
 static int tcp_fsm(struct tcp_conn_tcb *conn,
                    struct tcp_hdr *rs,
                    struct ip_hdr *ip_hdr,
                    size_t bsize)
 {
     if (conn->rtt && (rs->tcp_ack_num > conn->rtt_cur_seq)) {
+        /* The sample counts the slow ticks since the segment was sent. */
+        conn->rtt += (conn->shard->timers.now - conn->rtt_start) /
+                     TCP_TIMER_TICKS;
         tcp_rto_update(conn, conn->rtt);
     }
     switch (conn->state) {
     case TCP_CLOSED:
-        LOG(LOG_INFO, "TCP state: TCP_CLOSED");
+        LOG(LOG_DEBUG, "TCP state: TCP_CLOSED");
         return 0;
     case TCP_SYN_SENT:
-        LOG(LOG_INFO, "TCP state: TCP_SYN_SENT");
+        LOG(LOG_DEBUG, "TCP state: TCP_SYN_SENT");
         if (rs->tcp_flags & (TCP_SYN | TCP_ACK)) {
-            LOG(LOG_INFO, "SYN & ACK received");
+            LOG(LOG_DEBUG, "SYN & ACK received");
             rs->tcp_flags = TCP_ACK | 5 << 12;
             rs->tcp_ack_num = rs->tcp_seqno + 1;
             rs->tcp_seqno = conn->send_next;
             conn->recv_next = rs->tcp_ack_num;
             conn->recv_wnd = rs->tcp_win_size;
-            LOG(LOG_INFO, "%d", ((uint32_t *) &rs)[3]);
-            conn->timer[TCP_T_KEEP] = 0;
+            LOG(LOG_DEBUG, "%d", ((uint32_t *) &rs)[3]);
+            tcp_timer_set(conn, TCP_T_KEEP, 0);
             conn->state = TCP_ESTABLISHED;
-            conn->timer[TCP_T_REXMT] =
-                1; /* TODO: Instead of utilizing retransmission, use another way
-                      to send any unsent segments after receiving SYN & ACK.*/
+            /* TODO: Instead of utilizing retransmission, use another way to
+             * send any unsent segments after receiving SYN & ACK. */
+            tcp_timer_set(conn, TCP_T_REXMT, 1);
             return tcp_hdr_size(rs);
         }
         if (rs->tcp_flags & (TCP_SYN)) {
             /*Client and server open connection simultaneously*/
-            LOG(LOG_INFO, "SYN received, connection opened simultaneously ");
+            LOG(LOG_DEBUG, "SYN received, connection opened simultaneously ");
             rs->tcp_flags = (TCP_SYN | TCP_ACK) | 5 << 12;
             rs->tcp_ack_num = rs->tcp_seqno + 1;
             rs->tcp_seqno = conn->send_next;
             conn->recv_next = rs->tcp_ack_num;
             conn->recv_wnd = rs->tcp_win_size;
-            LOG(LOG_INFO, "%d", ((uint32_t *) &rs)[3]);
+            LOG(LOG_DEBUG, "%d", ((uint32_t *) &rs)[3]);
             conn->state = TCP_SYN_RCVD;
             return tcp_hdr_size(rs);
         }
     case TCP_LISTEN:
-        LOG(LOG_INFO, "TCP state: TCP_LISTEN");
+        LOG(LOG_DEBUG, "TCP state: TCP_LISTEN");
 
         if (rs->tcp_flags & TCP_SYN) {
-            LOG(LOG_INFO, "SYN received");
+            LOG(LOG_DEBUG, "SYN received");
 
             struct nstack_sockaddr sockaddr = {
                 .inet4_addr = ip_hdr->ip_dst,
@@ -391,12 +482,14 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
             }
             conn->recv_next = rs->tcp_ack_num;
             conn->send_next = rs->tcp_seqno + 1;
-            LOG(LOG_INFO, "%d", ((uint32_t *) &rs)[3]);
+            conn->send_una = conn->send_next;
+            conn->send_max = conn->send_next;
+            LOG(LOG_DEBUG, "%d", ((uint32_t *) &rs)[3]);
             return tcp_hdr_size(rs);
         }
         return 0;
     case TCP_SYN_RCVD:
-        LOG(LOG_INFO, "TCP state: TCP_SYN_RCVD");
+        LOG(LOG_DEBUG, "TCP state: TCP_SYN_RCVD");
         if ((rs->tcp_flags & TCP_RST) && rs->tcp_seqno == conn->recv_next &&
             rs->tcp_ack_num == conn->send_next) {
             conn->state = TCP_LISTEN;
@@ -404,7 +497,7 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
         }
         if ((rs->tcp_flags & TCP_ACK) && rs->tcp_seqno == conn->recv_next &&
             rs->tcp_ack_num == conn->send_next) {
-            conn->timer[TCP_T_KEEP] = 0;
+            tcp_timer_set(conn, TCP_T_KEEP, 0);
             conn->state = TCP_ESTABLISHED;
             return 0;
         }
@@ -416,19 +509,11 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
         conn->send_next = rs->tcp_seqno + 1;
         return tcp_hdr_size(rs);
     case TCP_ESTABLISHED:
-        LOG(LOG_INFO, "TCP state: TCP_ESTABLISHED");
+        LOG(LOG_DEBUG, "TCP state: TCP_ESTABLISHED");
         tcp_ack_segments(conn, rs);
         if ((rs->tcp_flags & TCP_ACK) && (rs->tcp_flags & TCP_PSH) &&
             rs->tcp_seqno == conn->recv_next &&
             rs->tcp_ack_num == conn->send_next) {
-            /* data handling */
-            rs->tcp_flags &= ~TCP_PSH;
-            rs->tcp_ack_num = rs->tcp_seqno + (bsize - tcp_hdr_size(rs));
-            rs->tcp_seqno = conn->send_next;
-
-            conn->recv_next = rs->tcp_ack_num;
-            conn->send_next = rs->tcp_seqno;
-
             /* forward the payload to application layer */
             struct nstack_sockaddr sockaddr = {
                 .inet4_addr = ip_hdr->ip_dst,
@@ -440,9 +525,21 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
                 .port = rs->tcp_sport,
             };
             size_t header_size = tcp_hdr_size(rs);
-            nstack_sock_dgram_input(sock, &srcaddr,
-                                    ((uint8_t *) rs) + header_size,
-                                    bsize - header_size);
+            size_t taken =
+                tcp_sock_input(sock, &srcaddr, ((uint8_t *) rs) + header_size,
+                               bsize - header_size);
+
+            /* Only the data the socket took is acked, the peer resends. */
+            if (taken == 0 && bsize > header_size)
+                return 0;
+
+            /* data handling */
+            rs->tcp_flags &= ~TCP_PSH;
+            rs->tcp_ack_num = rs->tcp_seqno + taken;
+            rs->tcp_seqno = conn->send_next;
+
+            conn->recv_next = rs->tcp_ack_num;
+            conn->send_next = rs->tcp_seqno;
 
             return tcp_hdr_size(rs);
         }
@@ -461,20 +558,19 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
     case TCP_FIN_WAIT_2:
     case TCP_CLOSE_WAIT:
     case TCP_CLOSING:
-        LOG(LOG_INFO, "TCP state: TCP_CLOSING");
+        LOG(LOG_DEBUG, "TCP state: TCP_CLOSING");
 
         return 0;
     case TCP_LAST_ACK:
-        LOG(LOG_INFO, "TCP state: TCP_LAST_ACK");
+        LOG(LOG_DEBUG, "TCP state: TCP_LAST_ACK");
         if (rs->tcp_flags & TCP_ACK) {
-            RB_REMOVE(tcp_conn_map, &tcp_conn_map, conn);
             conn->state = TCP_CLOSED;
-            free(conn);
+            tcp_free_connection(conn);
         }
         return 0;
     /* TODO handle error? */
     case TCP_TIME_WAIT:
-        LOG(LOG_INFO, "TCP state: TCP_TIME_WAIT");
+        LOG(LOG_DEBUG, "TCP state: TCP_TIME_WAIT");
     default:
         LOG(LOG_INFO, "TCP state: INVALID (%d)", conn->state);
 
@@ -485,11 +581,15 @@ static int tcp_fsm(struct tcp_conn_tcb *conn,
 /**
  * TCP input chain.
  * IP -> TCP
+ * Takes the lock of the shard of the connection and releases the shard in
+ * locked, unless it's the same shard. The caller releases the last shard.
  */
-static int tcp_input(const struct ip_hdr *ip_hdr,
-                     uint8_t *payload,
-                     size_t bsize)
+static int tcp_input_segment(const struct ip_hdr *ip_hdr,
+                             uint8_t *payload,
+                             size_t bsize,
+                             struct tcp_conn_shard **locked)
 {
+    struct tcp_conn_shard *shard;
     struct tcp_conn_attr attr;
     struct tcp_hdr *tcp = (struct tcp_hdr *) payload;
 
@@ -516,7 +616,15 @@ static int tcp_input(const struct ip_hdr *ip_hdr,
 
     tcp_ntoh(tcp, tcp);
 
-    struct tcp_conn_tcb *conn = tcp_find_connection(&attr);
+    shard = tcp_conn_shard(&attr);
+    if (shard != *locked) {
+        if (*locked)
+            pthread_mutex_unlock(&(*locked)->lock);
+        pthread_mutex_lock(&shard->lock);
+        *locked = shard;
+    }
+
+    struct tcp_conn_tcb *conn = tcp_find_connection(shard, &attr);
     if ((conn &&
          ((tcp->tcp_flags & TCP_SYN) && (conn->state >= TCP_ESTABLISHED))) ||
         tcp_hdr_size(tcp) < 0) {
@@ -532,8 +640,10 @@ static int tcp_input(const struct ip_hdr *ip_hdr,
         LOG(LOG_INFO, "New connection %s:%i -> %s:%i", rem_str,
             attr.remote.port, loc_str, attr.local.port);
 
-        conn = tcp_new_connection(&attr);
+        conn = tcp_new_connection(shard, &attr);
         conn->state = TCP_LISTEN;
+    } else if (!conn) {
+        return -ENOTCONN;
     }
 
     int retval = tcp_fsm(conn, tcp, ip_hdr, bsize);
@@ -545,7 +655,42 @@ static int tcp_input(const struct ip_hdr *ip_hdr,
 
     return retval;
 }
-IP_PROTO_INPUT_HANDLER(IP_PROTO_TCP, tcp_input);
+
+static int tcp_input(const struct ip_hdr *ip_hdr,
+                     uint8_t *payload,
+                     size_t bsize)
+{
+    struct tcp_conn_shard *locked = NULL;
+    int retval;
+
+    retval = tcp_input_segment(ip_hdr, payload, bsize, &locked);
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
+
+    return retval;
+}
+
+/**
+ * TCP input chain for a burst of segments.
+ * A shard is kept locked for as long as the segments are for its
+ * connections, which is the whole burst on a flow worker.
+ */
+static void tcp_input_burst(struct ether_pkt *pkts[], unsigned n)
+{
+    struct tcp_conn_shard *locked = NULL;
+
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_pkt *pkt = pkts[i];
+
+        if (i + 1 < n)
+            __builtin_prefetch(pkts[i + 1]->payload);
+        pkt->retval = tcp_input_segment(pkt->ip_hdr, pkt->payload, pkt->bsize,
+                                        &locked);
+    }
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
+}
+IP_PROTO_INPUT_BURST_HANDLER(IP_PROTO_TCP, tcp_input, tcp_input_burst);
 
 int nstack_tcp_bind(struct nstack_sock *sock)
 {
@@ -603,44 +748,111 @@ static int tcp_send_syn(struct tcp_conn_tcb *conn)
     tcp->tcp_win_size = 502;
     tcp->tcp_sport = conn->local.port;
     tcp->tcp_dport = conn->remote.port;
-    tcp_hton(&(conn->local), &(conn->remote), tcp, tcp, tcp_hdr_size(tcp));
+    tcp_hton_hdr(tcp, tcp);
     conn->state = TCP_SYN_SENT;
-    conn->timer[TCP_T_KEEP] = TCP_TV_KEEP_INIT;
+    tcp_timer_set(conn, TCP_T_KEEP, TCP_TV_KEEP_INIT);
     int retval = ip_send(conn->remote.inet4_addr, IP_PROTO_TCP, buf,
-                         sizeof(struct tcp_hdr) + opt.length);
+                         sizeof(struct tcp_hdr) + opt.length, &tcp_offload);
     return retval;
 }
 
+/**
+ * Get the max size of a segment given to ip_send().
+ * Unsent segments are coalesced up to a super-frame if the interface
+ * segments them, otherwise they are sent one by one.
+ */
+static size_t tcp_send_max(const struct tcp_conn_tcb *conn)
+{
+    if (ip_route_caps(conn->remote.inet4_addr) & ETHER_CAP_TSO)
+        return IP_DATA_MAX_BYTES;
+    return 0;
+}
+
 static int tcp_send_segments(struct tcp_conn_tcb *conn)
 {
-    struct tcp_segment *seg, *seg_tmp;
-    int retval;
+    const size_t send_max = tcp_send_max(conn);
+    struct tcp_segment *seg, *seg_end;
+    int retval = 0;
     pthread_mutex_lock(&conn->mutex);
-    TAILQ_FOREACH_SAFE(seg, &conn->unsent_list, _link, seg_tmp)
-    {
-        TAILQ_REMOVE(&conn->unsent_list, seg, _link);
+    ether_tx_begin();
+    while ((seg = TAILQ_FIRST(&conn->unsent_list))) {
         size_t hdr_size = tcp_hdr_size(&seg->header);
-        uint8_t payload[hdr_size + seg->size];
-        struct tcp_hdr *tcp = (struct tcp_hdr *) (payload);
-
-        memcpy(payload, &seg->header, hdr_size);
-        ((struct tcp_hdr *) payload)->tcp_seqno = conn->send_next;
-        ((struct tcp_hdr *) payload)->tcp_ack_num = conn->recv_next;
-        memcpy(payload + hdr_size, seg->data, seg->size);
+        size_t size = seg->size;
+        unsigned iovcnt = 2;
+
+        /* Coalesce the following segments with the same header size. */
+        for (seg_end = TAILQ_NEXT(seg, _link);
+             seg_end && (size_t) tcp_hdr_size(&seg_end->header) == hdr_size &&
+             hdr_size + size + seg_end->size <= send_max &&
+             iovcnt < ETHER_IOV_MAX;
+             seg_end = TAILQ_NEXT(seg_end, _link), iovcnt++)
+            size += seg_end->size;
+
+        union {
+            struct tcp_hdr hdr;
+            uint8_t buf[IP_SENDV_HDR_MAX];
+        } tcp;
+        struct iovec iov[ETHER_IOV_MAX];
+        struct ether_offload off = tcp_offload;
+
+        /* The data is sent from the segments without copying. */
+        iovcnt = 0;
+        iov[iovcnt++] = (struct iovec){.iov_base = &tcp, .iov_len = hdr_size};
+        for (struct tcp_segment *s = seg; s != seg_end;
+             s = TAILQ_NEXT(s, _link)) {
+            iov[iovcnt++] = (struct iovec){
+                .iov_base = s->data,
+                .iov_len = s->size,
+            };
+        }
 
-        tcp_hton(&(conn->local), &(conn->remote), tcp, tcp,
-                 hdr_size + seg->size);
-        conn->send_next += seg->size;
-        conn->send_max = conn->send_next;
-        retval = ip_send(conn->remote.inet4_addr, IP_PROTO_TCP, payload,
-                         (hdr_size + seg->size));
+        memcpy(&tcp, &seg->header, hdr_size);
+        tcp.hdr.tcp_seqno = conn->send_next;
+        tcp.hdr.tcp_ack_num = conn->recv_next;
+        tcp_hton_hdr(&tcp.hdr, &tcp.hdr);
+        if (size > conn->mss) {
+            off.gso_size = conn->mss;
+        } else {
+            /*
+             * A single segment is summed from the partial sums of the data
+             * instead of reading the data again.
+             */
+            uint32_t sum = ip_csum_pseudo(conn->local.inet4_addr,
+                                          conn->remote.inet4_addr,
+                                          IP_PROTO_TCP, hdr_size + size);
+            int odd = hdr_size & 1;
+
+            sum = ip_csum_partial(&tcp, hdr_size, sum);
+            for (struct tcp_segment *s = seg; s != seg_end;
+                 s = TAILQ_NEXT(s, _link)) {
+                uint32_t part = s->csum;
+
+                if (odd)
+                    part = ((part & 0xff) << 8) | (part >> 8);
+                sum = ip_csum_add(sum, part);
+                odd ^= s->size & 1;
+            }
+            tcp.hdr.tcp_checksum = ip_csum_fold(sum);
+        }
+        retval = ip_sendv(conn->remote.inet4_addr, IP_PROTO_TCP, iov, iovcnt,
+                          size > conn->mss ? &off : NULL);
         if (retval < 0) {
-            return -1;
+            retval = -1;
+            break;
         }
-        TAILQ_INSERT_TAIL(&conn->unacked_list, seg, _link);
+        retval = 0;
+        while ((seg = TAILQ_FIRST(&conn->unsent_list)) != seg_end) {
+            /* Remember where the segment went for the acks and rexmt. */
+            seg->header.tcp_seqno = conn->send_next;
+            conn->send_next += seg->size;
+            TAILQ_REMOVE(&conn->unsent_list, seg, _link);
+            TAILQ_INSERT_TAIL(&conn->unacked_list, seg, _link);
+        }
+        conn->send_max = conn->send_next;
     }
+    ether_tx_end();
     pthread_mutex_unlock(&conn->mutex);
-    return 0;
+    return retval;
 }
 
 static void tcp_ack_segments(struct tcp_conn_tcb *conn, struct tcp_hdr *tcp)
@@ -651,17 +863,18 @@ static void tcp_ack_segments(struct tcp_conn_tcb *conn, struct tcp_hdr *tcp)
         pthread_mutex_lock(&conn->mutex);
         TAILQ_FOREACH_SAFE(seg, &conn->unacked_list, _link, seg_tmp)
         {
-            if (seg->header.tcp_seqno < conn->send_una) {
+            if ((int32_t) (seg->header.tcp_seqno + seg->size -
+                           conn->send_una) <= 0) {
                 TAILQ_REMOVE(&conn->unacked_list, seg, _link);
                 free(seg);
             }
         }
         pthread_mutex_unlock(&conn->mutex);
+        /* The segments still in flight are resent if the timer expires. */
         if (conn->send_una == conn->send_max) {
-            conn->timer[TCP_T_REXMT] = 0;
+            tcp_timer_set(conn, TCP_T_REXMT, 0);
         } else {
-            conn->send_next = conn->send_una;
-            conn->timer[TCP_T_REXMT] = conn->rtt_est;
+            tcp_timer_set(conn, TCP_T_REXMT, conn->rtt_est);
         }
         return;
     } else {
@@ -680,7 +893,9 @@ int nstack_tcp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
     attr.local.port = sock->info.sock_addr.port;
     attr.remote.inet4_addr = dgram->dstaddr.inet4_addr;
     attr.remote.port = dgram->dstaddr.port;
-    struct tcp_conn_tcb *conn = tcp_find_connection(&attr);
+    struct tcp_conn_shard *shard = tcp_conn_shard(&attr);
+    pthread_mutex_lock(&shard->lock);
+    struct tcp_conn_tcb *conn = tcp_find_connection(shard, &attr);
     if (!conn) {
         /*Client, send syn*/
         char rem_str[IP_STR_LEN];
@@ -689,7 +904,7 @@ int nstack_tcp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
         ip2str(attr.local.inet4_addr, loc_str);
         LOG(LOG_INFO, "Client request new connection %s:%i -> %s:%i", rem_str,
             attr.remote.port, loc_str, attr.local.port);
-        conn = tcp_new_connection(&attr);
+        conn = tcp_new_connection(shard, &attr);
         tcp_connection_init(conn);
         tcp = (struct tcp_hdr){
             .tcp_flags = TCP_PSH | TCP_ACK | (5 << TCP_DOFF_OFF),
@@ -702,12 +917,13 @@ int nstack_tcp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
                             dgram->buf_size);
         seg->data = (seg->header.opt) + tcp_opt_size(&tcp);
         seg->size = dgram->buf_size;
-        memcpy(seg->data, dgram->buf, dgram->buf_size);
+        seg->csum = ip_csum_copy(seg->data, dgram->buf, dgram->buf_size, 0);
         memcpy(&seg->header, &tcp, tcp_hdr_size(&tcp));
         pthread_mutex_lock(&conn->mutex);
         TAILQ_INSERT_TAIL(&conn->unsent_list, seg, _link);
         pthread_mutex_unlock(&conn->mutex);
-        int retval = tcp_send_syn(conn);
+        retval = tcp_send_syn(conn);
+        pthread_mutex_unlock(&shard->lock);
         return retval;
     } else {
         switch (conn->state) {
@@ -722,20 +938,23 @@ int nstack_tcp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
             if (conn->rtt == 0) {
                 conn->rtt = 1;
                 conn->rtt_cur_seq = conn->send_next;
+                conn->rtt_start = shard->timers.now;
             }
             struct tcp_segment *seg =
                 calloc(1, sizeof(struct tcp_segment) + tcp_opt_size(&tcp) +
                               dgram->buf_size);
             seg->data = (seg->header.opt) + tcp_opt_size(&tcp);
             seg->size = dgram->buf_size;
-            memcpy(seg->data, dgram->buf, dgram->buf_size);
+            seg->csum = ip_csum_copy(seg->data, dgram->buf, dgram->buf_size, 0);
             memcpy(&seg->header, &tcp, tcp_hdr_size(&tcp));
             pthread_mutex_lock(&conn->mutex);
             TAILQ_INSERT_TAIL(&conn->unsent_list, seg, _link);
             pthread_mutex_unlock(&conn->mutex);
             retval = tcp_send_segments(conn);
+            pthread_mutex_unlock(&shard->lock);
             return retval;
         default:
+            pthread_mutex_unlock(&shard->lock);
             LOG(LOG_INFO, "TCP state: INVALID (%d)", conn->state);
 
             return -EINVAL;
@@ -761,7 +980,7 @@ static void tcp_rto_update(struct tcp_conn_tcb *conn, int rtt)
         conn->rtt_var = rtt << (TCP_RTTVAR_SHIFT - 1);
     }
     conn->retran_timeout = TCP_REXMTVAL(conn);
-    LOG(LOG_INFO, "Update RTO: value = %d", conn->retran_timeout);
+    LOG(LOG_DEBUG, "Update RTO: value = %d", conn->retran_timeout);
     conn->rtt = 0; /*Reset to 0 for timing and transmission of next segment. */
 }
 
@@ -769,6 +988,10 @@ static void tcp_rexmt_prepare(struct tcp_conn_tcb *conn)
 {
     struct tcp_segment *seg, *seg_tmp;
     pthread_mutex_lock(&conn->mutex);
+    /* Go back to the first segment in flight. */
+    seg = TAILQ_FIRST(&conn->unacked_list);
+    if (seg)
+        conn->send_next = seg->header.tcp_seqno;
     TAILQ_FOREACH_SAFE(seg, &conn->unsent_list, _link, seg_tmp)
     {
         TAILQ_REMOVE(&conn->unsent_list, seg, _link);
@@ -784,12 +1007,14 @@ static void tcp_rexmt_commit(struct tcp_conn_tcb *conn)
     tcp_send_segments(conn);
 }
 
-
-static void tcp_timer(struct tcp_conn_tcb *conn, int counter_index)
+static void tcp_timer(struct nstack_timer *timer, void *arg)
 {
+    struct tcp_conn_tcb *conn = arg;
+    const int counter_index = timer - conn->timer;
+
     switch (counter_index) {
     case TCP_T_REXMT:
-        conn->timer[counter_index] = conn->retran_timeout;
+        tcp_timer_set(conn, counter_index, conn->retran_timeout);
         /* Karn's Algorithm: the only segments that are timed by conn->rtt are
          * those that are not retransmitted.
          * TODO: Use timestamps to estimate
@@ -801,29 +1026,30 @@ static void tcp_timer(struct tcp_conn_tcb *conn, int counter_index)
     case TCP_T_PERSIST:
     case TCP_T_KEEP:
         if (conn->state < TCP_ESTABLISHED) {
-            RB_REMOVE(tcp_conn_map, &tcp_conn_map, conn);
-            free(conn);
+            tcp_free_connection(conn);
             return;
         }
 
     case TCP_T_2MSL:
-        RB_REMOVE(tcp_conn_map, &tcp_conn_map, conn);
-        free(conn);
+        tcp_free_connection(conn);
         return;
     }
 }
-void tcp_slowtimo()
+
+/**
+ * Run the expired TCP timers.
+ * Only the connections with an expiring timer are touched.
+ */
+static void tcp_timer_task(uint64_t now)
 {
-    struct tcp_conn_tcb *conn;
-    RB_FOREACH (conn, tcp_conn_map, &tcp_conn_map) {
-        for (int i = 0; i < TCP_T_NTIMERS; i++) {
-            if (conn->timer[i] && (--conn->timer[i] == 0)) {
-                tcp_timer(conn, i);
-            }
-        }
-        if (conn->rtt) {
-            conn->rtt++;
-        }
+    const unsigned nr_shards = rss_nr_workers() > 1 ? rss_nr_workers() : 1;
+
+    for (unsigned s = 0; s < nr_shards; s++) {
+        struct tcp_conn_shard *shard = &tcp_conn_shards[s];
+
+        pthread_mutex_lock(&shard->lock);
+        nstack_timer_run(&shard->timers, now);
+        pthread_mutex_unlock(&shard->lock);
     }
-    tcp_now++;
-}
\ No newline at end of file
+}
+NSTACK_PERIODIC_TASK(tcp_timer_task);
@@ -0,0 +1,139 @@
+#include <time.h>
+
+#include "nstack_timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/*
+ * Max distance of a timer from the current tick of a wheel. Timers further
+ * away are parked at the far end of the wheel and placed again when they
+ * cascade down.
+ */
+#define TIMER_DELTA_MAX \
+    ((UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+uint64_t nstack_timer_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000) /
+           NSTACK_TIMER_TICK_USEC;
+}
+
+void nstack_timer_init(struct nstack_timer *timer,
+                       nstack_timer_fn *fn,
+                       void *arg)
+{
+    *timer = (struct nstack_timer){
+        .fn = fn,
+        .arg = arg,
+    };
+}
+
+/**
+ * Put a timer in the slot of its expiry.
+ * The level is the finest one that covers the distance of the timer, so
+ * the slot is cascaded to the level below before the timer expires.
+ */
+static void timer_place(struct nstack_timer_wheel *wheel,
+                        struct nstack_timer *timer)
+{
+    uint64_t at = timer->expires;
+    unsigned level = 0;
+
+    if (at - wheel->now > TIMER_DELTA_MAX)
+        at = wheel->now + TIMER_DELTA_MAX;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           (at - wheel->now) >> (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    LIST_INSERT_HEAD(
+        &wheel->slot[level][(at >> (TIMER_WHEEL_BITS * level)) &
+                            TIMER_WHEEL_MASK],
+        timer, _link);
+}
+
+static void timer_unlink(struct nstack_timer_wheel *wheel,
+                         struct nstack_timer *timer)
+{
+    LIST_REMOVE(timer, _link);
+    timer->_link.le_prev = NULL;
+    wheel->count--;
+}
+
+void nstack_timer_arm(struct nstack_timer_wheel *wheel,
+                      struct nstack_timer *timer,
+                      uint64_t ticks)
+{
+    if (nstack_timer_pending(timer))
+        timer_unlink(wheel, timer);
+
+    /* An empty wheel may not have been advanced for a while. */
+    if (wheel->count == 0) {
+        const uint64_t now = nstack_timer_now();
+
+        if (now > wheel->now)
+            wheel->now = now;
+    }
+
+    timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+    timer_place(wheel, timer);
+    wheel->count++;
+}
+
+void nstack_timer_cancel(struct nstack_timer_wheel *wheel,
+                         struct nstack_timer *timer)
+{
+    if (nstack_timer_pending(timer))
+        timer_unlink(wheel, timer);
+}
+
+/**
+ * Move the timers of a slot to the finer levels.
+ */
+static void timer_cascade(struct nstack_timer_wheel *wheel, unsigned level)
+{
+    const unsigned index =
+        (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct nstack_timer_list list = LIST_HEAD_INITIALIZER(list);
+    struct nstack_timer *timer;
+
+    LIST_SWAP(&list, &wheel->slot[level][index], nstack_timer, _link);
+    while ((timer = LIST_FIRST(&list))) {
+        LIST_REMOVE(timer, _link);
+        timer_place(wheel, timer);
+    }
+}
+
+void nstack_timer_run(struct nstack_timer_wheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        struct nstack_timer_list *slot;
+        struct nstack_timer *timer;
+        unsigned level = 1;
+
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+
+        /* The coarser levels are cascaded when the finer ones wrap around. */
+        while (level < TIMER_WHEEL_LEVELS &&
+               !((wheel->now >> (TIMER_WHEEL_BITS * (level - 1))) &
+                 TIMER_WHEEL_MASK))
+            level++;
+        while (--level > 0)
+            timer_cascade(wheel, level);
+
+        /* The callbacks may arm and cancel timers, even of this slot. */
+        slot = &wheel->slot[0][wheel->now & TIMER_WHEEL_MASK];
+        while ((timer = LIST_FIRST(slot))) {
+            timer_unlink(wheel, timer);
+            timer->fn(timer, timer->arg);
+        }
+    }
+}
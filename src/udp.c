@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -69,38 +71,45 @@ int nstack_udp_bind(struct nstack_sock *sock)
 }
 
 /**
- * UDP input chain.
- * IP -> UDP
+ * Deliver a datagram to its socket.
+ * @param[in] udp is the datagram with the header in host byte order.
+ * @param[in] sock is the socket bound to the destination or NULL.
  */
-static int udp_input(const struct ip_hdr *ip_hdr,
-                     uint8_t *payload,
-                     size_t bsize)
+static int udp_input_dgram(const struct ip_hdr *ip_hdr,
+                           struct udp_hdr *udp,
+                           size_t bsize,
+                           struct nstack_sock *sock)
 {
-    struct udp_hdr *udp = (struct udp_hdr *) payload;
-    struct nstack_sock *sock;
-    struct nstack_sockaddr sockaddr;
+    uint8_t *payload = (uint8_t *) udp;
 
-    if (bsize < sizeof(struct udp_hdr)) {
-        LOG(LOG_INFO, "Datagram size too small");
-
-        return -EBADMSG;
-    }
-
-    udp_ntoh(udp, udp);
-
-    sockaddr.inet4_addr = ip_hdr->ip_dst;
-    sockaddr.port = udp->udp_dport;
-    sock = find_udp_socket(&sockaddr);
     if (sock) {
         int retval;
         struct nstack_sockaddr srcaddr = {
             .inet4_addr = ip_hdr->ip_src,
             .port = udp->udp_sport,
         };
+        const uint32_t *verify = NULL;
+        uint32_t csum;
+
+        /*
+         * The payload is summed while it's copied to the socket, so only
+         * the pseudo-header and the header are summed here. The header is
+         * already in host byte order except for the checksum.
+         */
+        if (NSTACK_UDP_VERIFY_CSUM && udp->udp_csum != 0) {
+            csum = ip_csum_pseudo(ip_hdr->ip_src, ip_hdr->ip_dst,
+                                  IP_PROTO_UDP, udp->udp_len);
+            csum = ip_csum_add(csum, htons(udp->udp_sport));
+            csum = ip_csum_add(csum, htons(udp->udp_dport));
+            csum = ip_csum_add(csum, htons(udp->udp_len));
+            csum = ip_csum_add(csum, udp->udp_csum);
+            verify = &csum;
+        }
 
         retval = nstack_sock_dgram_input(sock, &srcaddr,
                                          payload + sizeof(struct udp_hdr),
-                                         bsize - sizeof(struct udp_hdr));
+                                         bsize - sizeof(struct udp_hdr),
+                                         verify);
         if (retval > 0) {
             /*
              * RFE The following code is probably not needed as
@@ -126,58 +135,90 @@ static int udp_input(const struct ip_hdr *ip_hdr,
         }
         return retval;
     } else {
-        LOG(LOG_INFO, "Port %d unreachable", sockaddr.port);
+        LOG(LOG_INFO, "Port %d unreachable", udp->udp_dport);
 
         return -ENOTSOCK;
     }
 }
-IP_PROTO_INPUT_HANDLER(IP_PROTO_UDP, udp_input);
 
-static uint16_t udp_checksum(const void *buff,
-                             size_t len,
-                             in_addr_t src_addr,
-                             in_addr_t dest_addr)
+/**
+ * UDP input chain.
+ * IP -> UDP
+ */
+static int udp_input(const struct ip_hdr *ip_hdr,
+                     uint8_t *payload,
+                     size_t bsize)
 {
-    const uint16_t *buf = buff;
-    uint16_t *ip_src = (void *) &src_addr, *ip_dst = (void *) &dest_addr;
-    uint32_t sum;
-    size_t length = len;
-
-    /* Calculate the sum */
-    sum = 0;
-    while (len > 1) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        len -= 2;
+    struct udp_hdr *udp = (struct udp_hdr *) payload;
+    struct nstack_sockaddr sockaddr;
+
+    if (bsize < sizeof(struct udp_hdr)) {
+        LOG(LOG_INFO, "Datagram size too small");
+
+        return -EBADMSG;
     }
-    /* Add the padding if the packet length is odd */
-    if (len & 1)
-        sum += *((uint8_t *) buf);
 
-    /* Add the pseudo-header */
-    sum += *(ip_src++);
-    sum += *ip_src;
+    udp_ntoh(udp, udp);
+
+    sockaddr.inet4_addr = ip_hdr->ip_dst;
+    sockaddr.port = udp->udp_dport;
+    return udp_input_dgram(ip_hdr, udp, bsize, find_udp_socket(&sockaddr));
+}
+
+/**
+ * UDP input chain for a burst of datagrams.
+ * The socket is looked up once for each run of datagrams to the same
+ * address.
+ */
+static void udp_input_burst(struct ether_pkt *pkts[], unsigned n)
+{
+    struct nstack_sockaddr sockaddr = {0};
+    struct nstack_sock *sock = NULL;
+    bool found = false;
 
-    sum += *(ip_dst++);
-    sum += *ip_dst;
+    for (unsigned i = 0; i < n; i++) {
+        struct ether_pkt *pkt = pkts[i];
+        struct udp_hdr *udp = (struct udp_hdr *) pkt->payload;
 
-    sum += htons(IPPROTO_UDP);
-    sum += htons(length);
+        if (i + 1 < n)
+            __builtin_prefetch(pkts[i + 1]->payload);
 
-    /* Add the carries */
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
+        if (pkt->bsize < sizeof(struct udp_hdr)) {
+            LOG(LOG_INFO, "Datagram size too small");
 
-    /* Return the one's complement of sum */
-    return ((uint16_t) (~sum));
+            pkt->retval = -EBADMSG;
+            continue;
+        }
+
+        udp_ntoh(udp, udp);
+
+        if (!found || sockaddr.inet4_addr != pkt->ip_hdr->ip_dst ||
+            sockaddr.port != udp->udp_dport) {
+            sockaddr.inet4_addr = pkt->ip_hdr->ip_dst;
+            sockaddr.port = udp->udp_dport;
+            sock = find_udp_socket(&sockaddr);
+            found = true;
+        }
+        pkt->retval = udp_input_dgram(pkt->ip_hdr, udp, pkt->bsize, sock);
+    }
 }
+IP_PROTO_INPUT_BURST_HANDLER(IP_PROTO_UDP, udp_input, udp_input_burst);
+
+/**
+ * The UDP checksum is left to ip_send().
+ */
+static const struct ether_offload udp_offload = {
+    .csum_offset = offsetof(struct udp_hdr, udp_csum),
+};
 
 int nstack_udp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
 {
-    uint8_t buf[sizeof(struct udp_hdr) + dgram->buf_size];
-    struct udp_hdr *udp = (struct udp_hdr *) buf;
-    uint8_t *payload = udp->data;
+    struct udp_hdr udp;
+    /* The payload is sent from the egress queue of the socket. */
+    const struct iovec iov[] = {
+        {.iov_base = &udp, .iov_len = sizeof(udp)},
+        {.iov_base = (void *) dgram->buf, .iov_len = dgram->buf_size},
+    };
 
     if (!(dgram->buf_size > 0 && dgram->buf_size < UDP_MAXLEN)) {
         return -EINVAL;
@@ -186,21 +227,12 @@ int nstack_udp_send(struct nstack_sock *sock, const struct nstack_dgram *dgram)
     /*
      * UDP Header.
      */
-    udp->udp_sport = sock->info.sock_addr.port;
-    udp->udp_dport = dgram->dstaddr.port;
-    udp->udp_len = sizeof(struct udp_hdr) + dgram->buf_size;
-    udp->udp_csum = 0;
-    /* Calculate UDP csum */
-    int chk = udp_checksum(udp, udp->udp_len, dgram->srcaddr.inet4_addr,
-                           dgram->dstaddr.inet4_addr);
-
-    if (chk) {
-        LOG(LOG_INFO, "Checksum error: %d", chk);
-        return -1;
-    }
-
-    memcpy(payload, dgram->buf, dgram->buf_size);
-
-    udp_hton(udp, udp);
-    return ip_send(dgram->dstaddr.inet4_addr, IP_PROTO_UDP, buf, sizeof(buf));
+    udp.udp_sport = sock->info.sock_addr.port;
+    udp.udp_dport = dgram->dstaddr.port;
+    udp.udp_len = sizeof(struct udp_hdr) + dgram->buf_size;
+    udp.udp_csum = 0;
+
+    udp_hton(&udp, &udp);
+    return ip_sendv(dgram->dstaddr.inet4_addr, IP_PROTO_UDP, iov,
+                    num_elem(iov), &udp_offload);
 }
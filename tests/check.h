@@ -0,0 +1,19 @@
+/**
+ * Checks of the unit tests.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Fail the test with the location and the condition if cond is false.
+ */
+#define CHECK(_cond_)                                                    \
+    do {                                                                 \
+        if (!(_cond_)) {                                                 \
+            fprintf(stdout, "%s:%d: %s\n", __FILE__, __LINE__, #_cond_); \
+            exit(1);                                                     \
+        }                                                                \
+    } while (0)
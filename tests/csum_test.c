@@ -0,0 +1,209 @@
+/*
+ * The checksum and CRC kernels are included to test each of them, whatever
+ * the CPU would select, against a plain reference.
+ */
+#include "../src/ether_fcs.c"
+#include "../src/ip_csum.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "check.h"
+
+/* Long enough to cross the flush of the 32-bit lanes of the vector kernels. */
+#define BUF_SIZE (300 * 1024)
+#define SHORT_MAX 3000
+#define GUARD 64
+
+static uint8_t src[BUF_SIZE + GUARD];
+static uint8_t dst[BUF_SIZE + GUARD];
+
+struct csum_kernel {
+    const char *name;
+    ip_csum_fn_t *fn;
+    ip_csum_copy_fn_t *copy_fn;
+};
+
+struct fcs_kernel {
+    const char *name;
+    ether_fcs_fn_t *fn;
+};
+
+static uint16_t ref_csum(uint32_t sum, const uint8_t *dp, size_t bsize)
+{
+    uint64_t acc = sum;
+
+    for (; bsize >= 2; dp += 2, bsize -= 2) {
+        uint16_t h;
+
+        memcpy(&h, dp, sizeof(h));
+        acc += h;
+    }
+    if (bsize) {
+        uint16_t h = 0;
+
+        memcpy(&h, dp, 1);
+        acc += h;
+    }
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+
+    return acc;
+}
+
+static uint32_t ref_crc(const uint8_t *dp, size_t bsize)
+{
+    uint32_t crc = ~0u;
+
+    while (bsize--) {
+        crc ^= *dp++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (-(crc & 1) & ETHER_FCS_POLY);
+    }
+
+    return ~crc;
+}
+
+/**
+ * Check a checksum kernel, and its copying variant, for a buffer.
+ */
+static void check_csum(const struct csum_kernel *k,
+                       size_t off,
+                       size_t bsize,
+                       uint32_t sum)
+{
+    const uint16_t expected = ref_csum(sum, src + off, bsize);
+
+    if (ip_csum_fold64(k->fn(sum, src + off, bsize)) != expected) {
+        printf("%s: sum of %zu bytes at %zu\n", k->name, bsize, off);
+        exit(1);
+    }
+
+    memset(dst, 0xa5, bsize + off + GUARD);
+    if (ip_csum_fold64(k->copy_fn(sum, dst + off, src + off, bsize)) !=
+            expected ||
+        memcmp(dst + off, src + off, bsize)) {
+        printf("%s: copy of %zu bytes at %zu\n", k->name, bsize, off);
+        exit(1);
+    }
+    for (size_t i = 0; i < off; i++)
+        CHECK(dst[i] == 0xa5);
+    for (size_t i = off + bsize; i < off + bsize + GUARD; i++)
+        CHECK(dst[i] == 0xa5);
+}
+
+static void test_csum(const struct csum_kernel *k)
+{
+    for (size_t off = 0; off < 3; off++) {
+        for (size_t bsize = 0; bsize <= SHORT_MAX; bsize++)
+            check_csum(k, off, bsize, 0);
+    }
+    check_csum(k, 1, 1501, 0xfffe);
+    check_csum(k, 0, BUF_SIZE, 0);
+    check_csum(k, 1, BUF_SIZE - 1, 0x1234);
+    check_csum(k, 0, 0x20000, 0);
+    check_csum(k, 2, 0x20000 + 2, 0);
+
+    printf("csum_test: %s OK\n", k->name);
+}
+
+static void test_fcs(const struct fcs_kernel *k)
+{
+    for (size_t off = 0; off < 3; off++) {
+        for (size_t bsize = 0; bsize <= SHORT_MAX; bsize++) {
+            if (~k->fn(~0u, src + off, bsize) != ref_crc(src + off, bsize)) {
+                printf("%s: %zu bytes at %zu\n", k->name, bsize, off);
+                exit(1);
+            }
+        }
+    }
+    CHECK(~k->fn(~0u, src, BUF_SIZE) == ref_crc(src, BUF_SIZE));
+    CHECK(~k->fn(~0u, (const uint8_t *) "123456789", 9) == 0xcbf43926);
+
+    printf("csum_test: %s OK\n", k->name);
+}
+
+/*
+ * The byte order conversions and the incremental update are checked against
+ * a header summed in full.
+ */
+static void test_csum_helpers(void)
+{
+    uint8_t hdr[20];
+    uint16_t csum, word;
+
+    memcpy(hdr, src, sizeof(hdr));
+    memset(hdr + 10, 0, 2);
+    csum = ip_checksum(hdr, sizeof(hdr));
+    memcpy(hdr + 10, &csum, 2);
+    CHECK(ip_checksum(hdr, sizeof(hdr)) == 0);
+
+    memcpy(&word, hdr + 8, 2);
+    csum = ip_csum_update16(csum, word, word ^ 0x5aa5);
+    word ^= 0x5aa5;
+    memcpy(hdr + 8, &word, 2);
+    memcpy(hdr + 10, &csum, 2);
+    CHECK(ip_checksum(hdr, sizeof(hdr)) == 0);
+
+    printf("csum_test: helpers OK\n");
+}
+
+int main(void)
+{
+    const struct csum_kernel scalar = {"scalar", ip_csum_scalar,
+                                       ip_csum_copy_scalar};
+    const struct fcs_kernel slice8 = {"slice8", ether_fcs_slice8};
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = rand();
+    /* All ones, the worst case for the carries. */
+    memset(src + BUF_SIZE / 2, 0xff, BUF_SIZE / 4);
+
+    test_csum(&scalar);
+#if defined(IP_CSUM_X86)
+    if (__builtin_cpu_supports("sse2")) {
+        const struct csum_kernel sse2 = {"sse2", ip_csum_sse2,
+                                         ip_csum_copy_sse2};
+
+        test_csum(&sse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        const struct csum_kernel avx2 = {"avx2", ip_csum_avx2,
+                                         ip_csum_copy_avx2};
+
+        test_csum(&avx2);
+    }
+#elif defined(IP_CSUM_NEON)
+    if (getauxval(AT_HWCAP) & HWCAP_ASIMD) {
+        const struct csum_kernel neon = {"neon", ip_csum_neon,
+                                         ip_csum_copy_neon};
+
+        test_csum(&neon);
+    }
+#endif
+
+    /* Force the scalar path for the exported functions too. */
+    ip_csum_fn = ip_csum_scalar;
+    ip_csum_copy_fn = ip_csum_copy_scalar;
+    test_csum_helpers();
+
+    test_fcs(&slice8);
+#if defined(ETHER_FCS_CLMUL)
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        const struct fcs_kernel clmul = {"clmul", ether_fcs_clmul};
+
+        test_fcs(&clmul);
+    }
+#elif defined(ETHER_FCS_ARMV8)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        const struct fcs_kernel armv8 = {"armv8", ether_fcs_armv8};
+
+        test_fcs(&armv8);
+    }
+#endif
+    ether_fcs_fn = ether_fcs_slice8;
+    CHECK(ether_fcs("123456789", 9) == 0xcbf43926);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nstack_ether.h"
+#include "nstack_ip.h"
+
+#include "check.h"
+
+#define IP(a, b, c, d) \
+    (((in_addr_t) (a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+#define MASK24 IP(255, 255, 255, 0)
+
+unsigned ether_handle2caps(int handle)
+{
+    return 0;
+}
+
+static void route_add(int handle, in_addr_t addr, in_addr_t netmask)
+{
+    struct ip_route route = {
+        .r_network = addr & netmask,
+        .r_netmask = netmask,
+        .r_iface = addr,
+        .r_iface_handle = handle,
+    };
+
+    CHECK(ip_route_update(&route) == 0);
+}
+
+/*
+ * Two interfaces on the same network share its route, and both of their
+ * addresses stay local.
+ */
+static void test_same_network(void)
+{
+    struct ip_route route;
+
+    route_add(0, IP(10, 0, 0, 2), MASK24);
+    route_add(1, IP(10, 0, 0, 3), MASK24);
+
+    CHECK(ip_route_find_by_iface(IP(10, 0, 0, 2), &route) == 0);
+    CHECK(route.r_iface == IP(10, 0, 0, 2) && route.r_iface_handle == 0);
+    CHECK(ip_route_find_by_iface(IP(10, 0, 0, 3), &route) == 0);
+    CHECK(route.r_iface == IP(10, 0, 0, 3) && route.r_iface_handle == 1);
+    CHECK(ip_route_find_by_iface(IP(10, 0, 0, 4), NULL) == -1);
+
+    CHECK(ip_route_find_by_network(IP(10, 0, 0, 9), &route) == 0);
+    CHECK(route.r_network == IP(10, 0, 0, 0) && route.r_iface_handle == 1);
+}
+
+static void test_networks(void)
+{
+    struct ip_route route;
+
+    route_add(2, IP(192, 168, 1, 1), IP(255, 255, 0, 0));
+    CHECK(ip_route_find_by_network(IP(192, 168, 7, 7), &route) == 0);
+    CHECK(route.r_iface == IP(192, 168, 1, 1) && route.r_iface_handle == 2);
+    CHECK(ip_route_find_by_network(IP(10, 0, 1, 1), NULL) == -1);
+
+    /* The address goes with the route of its interface. */
+    CHECK(ip_route_remove(&route) == 0);
+    CHECK(ip_route_find_by_network(IP(192, 168, 7, 7), NULL) == -1);
+    CHECK(ip_route_find_by_iface(IP(192, 168, 1, 1), NULL) == -1);
+    CHECK(ip_route_find_by_iface(IP(10, 0, 0, 2), NULL) == 0);
+}
+
+static void test_full(void)
+{
+    int i;
+
+    /* Each network takes a route and an address. */
+    for (i = 0; i < NSTACK_IP_RIB_SIZE; i++) {
+        struct ip_route route = {
+            .r_network = IP(172, 16, i, 0),
+            .r_netmask = MASK24,
+            .r_iface = IP(172, 16, i, 1),
+        };
+
+        if (ip_route_update(&route))
+            break;
+    }
+    CHECK(i < NSTACK_IP_RIB_SIZE && errno == ENOMEM);
+
+    /* A failed update leaves the RIB as it was. */
+    CHECK(ip_route_find_by_network(IP(172, 16, i, 1), NULL) == -1);
+    CHECK(ip_route_find_by_iface(IP(172, 16, i, 1), NULL) == -1);
+    CHECK(ip_route_find_by_iface(IP(10, 0, 0, 3), NULL) == 0);
+}
+
+int main(void)
+{
+    test_same_network();
+    test_networks();
+    test_full();
+
+    printf("ip_route_test: OK\n");
+    return 0;
+}
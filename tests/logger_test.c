@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#include "check.h"
+
+/**
+ * Write a message and return the line printed for it.
+ */
+#define LOG_LINE(_line_, ...)                                      \
+    do {                                                           \
+        FILE *_f_ = tmpfile();                                     \
+        const int _fd_ = dup(STDERR_FILENO);                       \
+        size_t _n_;                                                \
+                                                                   \
+        CHECK(_f_ && _fd_ >= 0);                                   \
+        fflush(stderr);                                            \
+        dup2(fileno(_f_), STDERR_FILENO);                          \
+        log_write(LOG_ERR, "main", __VA_ARGS__);                   \
+        log_flush();                                               \
+        fflush(stderr);                                            \
+        dup2(_fd_, STDERR_FILENO);                                 \
+        close(_fd_);                                               \
+        rewind(_f_);                                               \
+        _n_ = fread((_line_), 1, sizeof(_line_) - 1, _f_);         \
+        (_line_)[_n_] = '\0';                                      \
+        fclose(_f_);                                               \
+    } while (0)
+
+static char line[1024];
+
+static void test_integers(void)
+{
+    LOG_LINE(line, "%d %u %lx %lld %c %s", -1, 2u, 0xabcUL, -4LL, 'z', "ok");
+    CHECK(!strcmp(line, "1:main: -1 2 abc -4 z ok\n"));
+}
+
+static void test_string_truncated(void)
+{
+    char s[200];
+
+    memset(s, 'a', sizeof(s) - 1);
+    s[sizeof(s) - 1] = '\0';
+    LOG_LINE(line, "%s!", s);
+    CHECK(strstr(line, "1:main: aaaa") == line);
+    CHECK(strstr(line, "! [truncated]\n"));
+}
+
+/*
+ * A string fills the arguments up to the end, the next one has no room left,
+ * not even for its terminator.
+ */
+static void test_string_at_end(void)
+{
+    char s[101];
+    char expected[256];
+
+    memset(s, 'a', sizeof(s) - 1);
+    s[sizeof(s) - 1] = '\0';
+    LOG_LINE(line, "%s%s", s, "x");
+    snprintf(expected, sizeof(expected), "1:main: %s%%s [truncated]\n", s);
+    CHECK(!strcmp(line, expected));
+
+    /* An integer after it has no room either. */
+    LOG_LINE(line, "%s%d", s, 1);
+    snprintf(expected, sizeof(expected), "1:main: %s%%d [truncated]\n", s);
+    CHECK(!strcmp(line, expected));
+}
+
+int main(void)
+{
+    test_integers();
+    test_string_truncated();
+    test_string_at_end();
+
+    printf("logger_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nstack_mbuf.h"
+
+#include "check.h"
+
+static struct mbuf *bufs[NSTACK_MBUF_NR];
+
+/**
+ * Take every buffer of the pool.
+ */
+static void alloc_all(void)
+{
+    for (int i = 0; i < NSTACK_MBUF_NR; i++) {
+        CHECK((bufs[i] = mbuf_alloc()));
+        CHECK(bufs[i]->data == bufs[i]->buf + MBUF_HEADROOM);
+        CHECK(bufs[i]->len == 0);
+        for (int j = 0; j < i; j++)
+            CHECK(bufs[i] != bufs[j]);
+    }
+    errno = 0;
+    CHECK(!mbuf_alloc() && errno == ENOBUFS);
+}
+
+static void *free_all(void *arg)
+{
+    for (int i = 0; i < NSTACK_MBUF_NR; i++)
+        mbuf_free(bufs[i]);
+
+    return NULL;
+}
+
+static void *alloc_free(void *arg)
+{
+    mbuf_free(mbuf_alloc());
+
+    return NULL;
+}
+
+static void run_thread(void *(*fn)(void *))
+{
+    pthread_t tid;
+
+    CHECK(pthread_create(&tid, NULL, fn, NULL) == 0);
+    CHECK(pthread_join(tid, NULL) == 0);
+}
+
+int main(void)
+{
+    /* The buffers cached by this thread are found again. */
+    alloc_all();
+    for (int i = 0; i < NSTACK_MBUF_NR; i++)
+        mbuf_free(bufs[i]);
+    alloc_all();
+
+    /* Freed by a thread that never allocated, they go back to the pool. */
+    run_thread(free_all);
+    alloc_all();
+    free_all(NULL);
+
+    /* The cache of a thread is returned to the pool when it exits. */
+    for (int i = 0; i < 2 * NSTACK_MBUF_NR; i++)
+        run_thread(alloc_free);
+    alloc_all();
+    free_all(NULL);
+
+    printf("mbuf_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nstack_timer.h"
+
+#include "check.h"
+
+#define LEVEL1 (UINT64_C(1) << TIMER_WHEEL_BITS)
+#define LEVEL2 (UINT64_C(1) << (2 * TIMER_WHEEL_BITS))
+#define LEVEL3 (UINT64_C(1) << (3 * TIMER_WHEEL_BITS))
+#define DELTA_MAX \
+    ((UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static struct nstack_timer_wheel wheel;
+
+struct test_timer {
+    struct nstack_timer timer;
+    uint64_t fired_at;
+    unsigned fired;
+    unsigned rearm;              /*!< Times the callback arms it again. */
+    struct nstack_timer *cancel; /*!< Cancelled by the callback. */
+};
+
+static unsigned nr_freed;
+
+static void test_fn(struct nstack_timer *timer, void *arg)
+{
+    struct test_timer *t = arg;
+
+    CHECK(!nstack_timer_pending(timer));
+    t->fired_at = wheel.now;
+    t->fired++;
+    if (t->cancel)
+        nstack_timer_cancel(&wheel, t->cancel);
+    if (t->rearm) {
+        t->rearm--;
+        nstack_timer_arm(&wheel, timer, 1);
+    }
+}
+
+static void free_fn(struct nstack_timer *timer, void *arg)
+{
+    free(timer);
+    nr_freed++;
+}
+
+/**
+ * Start from an empty wheel far ahead of the clock, so arming a timer
+ * doesn't move the wheel to the current tick.
+ */
+static void wheel_reset(uint64_t now)
+{
+    memset(&wheel, 0, sizeof(wheel));
+    wheel.now = nstack_timer_now() + (UINT64_C(1) << 40) + now;
+}
+
+static void test_init(struct test_timer *t)
+{
+    memset(t, 0, sizeof(*t));
+    nstack_timer_init(&t->timer, test_fn, t);
+}
+
+static void test_arm_cancel(void)
+{
+    struct test_timer a, b;
+    uint64_t start;
+
+    wheel_reset(0);
+    start = wheel.now;
+    test_init(&a);
+    test_init(&b);
+    CHECK(!nstack_timer_pending(&a.timer));
+
+    nstack_timer_arm(&wheel, &a.timer, 5);
+    nstack_timer_arm(&wheel, &b.timer, 5);
+    CHECK(nstack_timer_pending(&a.timer) && wheel.count == 2);
+    nstack_timer_cancel(&wheel, &b.timer);
+    CHECK(!nstack_timer_pending(&b.timer) && wheel.count == 1);
+    nstack_timer_cancel(&wheel, &b.timer);
+    CHECK(wheel.count == 1);
+
+    nstack_timer_run(&wheel, start + 4);
+    CHECK(a.fired == 0);
+    nstack_timer_run(&wheel, start + 5);
+    CHECK(a.fired == 1 && a.fired_at == start + 5 && b.fired == 0);
+    CHECK(!nstack_timer_pending(&a.timer) && wheel.count == 0);
+
+    /* Rearming moves the expiry, and 0 ticks means 1. */
+    nstack_timer_arm(&wheel, &a.timer, 10);
+    nstack_timer_arm(&wheel, &a.timer, 0);
+    CHECK(wheel.count == 1);
+    nstack_timer_run(&wheel, start + 20);
+    CHECK(a.fired == 2 && a.fired_at == start + 6 && wheel.count == 0);
+    CHECK(wheel.now == start + 20);
+}
+
+/*
+ * Timers are armed around each level boundary, from a current tick just
+ * before a boundary, and must all expire at their own tick.
+ */
+static void test_cascade(void)
+{
+    static const uint64_t bounds[] = {LEVEL1, LEVEL2, LEVEL3};
+    static const uint64_t starts[] = {0, 1, LEVEL1 - 1, LEVEL2 - 1,
+                                      LEVEL3 - 1, LEVEL3 + 17};
+
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+        struct test_timer t[3][7];
+        uint64_t start;
+
+        wheel_reset(starts[s]);
+        start = wheel.now;
+        for (size_t b = 0; b < 3; b++) {
+            for (int d = -3; d <= 3; d++) {
+                test_init(&t[b][d + 3]);
+                nstack_timer_arm(&wheel, &t[b][d + 3].timer, bounds[b] + d);
+            }
+        }
+        CHECK(wheel.count == 21);
+
+        /* In steps that don't line up with the boundaries. */
+        while (wheel.count)
+            nstack_timer_run(&wheel, wheel.now + 37);
+
+        for (size_t b = 0; b < 3; b++) {
+            for (int d = -3; d <= 3; d++) {
+                const struct test_timer *p = &t[b][d + 3];
+
+                CHECK(p->fired == 1);
+                CHECK(p->fired_at == start + bounds[b] + d);
+            }
+        }
+    }
+}
+
+static void test_random(void)
+{
+    enum { NR = 2000 };
+    static struct test_timer t[NR];
+    uint64_t expires[NR];
+    int cancelled[NR] = {0};
+
+    srand(1);
+    wheel_reset(LEVEL2 - 5);
+    for (int i = 0; i < NR; i++) {
+        const uint64_t ticks = 1 + (uint64_t) rand() % (LEVEL3 + LEVEL2);
+
+        test_init(&t[i]);
+        nstack_timer_arm(&wheel, &t[i].timer, ticks);
+        expires[i] = wheel.now + ticks;
+        /* Move the wheel between the arms. */
+        if (i % 100 == 99)
+            nstack_timer_run(&wheel, wheel.now + 3);
+    }
+    for (int i = 0; i < NR; i += 7) {
+        cancelled[i] = nstack_timer_pending(&t[i].timer);
+        nstack_timer_cancel(&wheel, &t[i].timer);
+    }
+
+    while (wheel.count)
+        nstack_timer_run(&wheel, wheel.now + 1000);
+    for (int i = 0; i < NR; i++) {
+        if (cancelled[i]) {
+            CHECK(t[i].fired == 0);
+        } else {
+            CHECK(t[i].fired == 1 && t[i].fired_at == expires[i]);
+        }
+    }
+}
+
+/*
+ * A timer beyond the reach of the wheel is parked and placed again as it
+ * cascades down, until it expires at its own tick.
+ */
+static void test_far(void)
+{
+    struct test_timer t;
+    const uint64_t ticks = DELTA_MAX + LEVEL2 + 3;
+    uint64_t start;
+
+    wheel_reset(0);
+    start = wheel.now;
+    test_init(&t);
+    nstack_timer_arm(&wheel, &t.timer, ticks);
+    nstack_timer_run(&wheel, start + DELTA_MAX);
+    CHECK(t.fired == 0 && nstack_timer_pending(&t.timer));
+    nstack_timer_run(&wheel, start + ticks - 1);
+    CHECK(t.fired == 0);
+    nstack_timer_run(&wheel, start + ticks);
+    CHECK(t.fired == 1 && t.fired_at == start + ticks);
+}
+
+static void test_callbacks(void)
+{
+    struct test_timer periodic, a, b;
+    struct nstack_timer *freed[3];
+    uint64_t start;
+
+    wheel_reset(LEVEL1 - 2);
+    start = wheel.now;
+
+    /* Rearmed by its callback, across a level boundary. */
+    test_init(&periodic);
+    periodic.rearm = 9;
+    nstack_timer_arm(&wheel, &periodic.timer, 1);
+
+    /* Cancels the next timer of the same slot. */
+    test_init(&a);
+    test_init(&b);
+    nstack_timer_arm(&wheel, &b.timer, 3);
+    nstack_timer_arm(&wheel, &a.timer, 3);
+    a.cancel = &b.timer;
+
+    /* Freed by their callbacks. */
+    for (int i = 0; i < 3; i++) {
+        CHECK((freed[i] = malloc(sizeof(*freed[i]))));
+        nstack_timer_init(freed[i], free_fn, NULL);
+        nstack_timer_arm(&wheel, freed[i], 2);
+    }
+
+    nstack_timer_run(&wheel, start + 100);
+    CHECK(periodic.fired == 10 && periodic.fired_at == start + 10);
+    CHECK(a.fired == 1 && b.fired == 0);
+    CHECK(nr_freed == 3);
+    CHECK(wheel.count == 0);
+}
+
+int main(void)
+{
+    test_arm_cancel();
+    test_cascade();
+    test_random();
+    test_far();
+    test_callbacks();
+
+    printf("timer_test: OK\n");
+    return 0;
+}